@@ -475,6 +475,50 @@ static int xmp_write(const char *path, const char *buf, size_t size,
 	return res;
 }
 
+#ifdef HAVE_POSIX_FALLOCATE
+static int xmp_fallocate(const char *path, int mode,
+			off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	int fd;
+	int res;
+
+	(void) fi;
+
+	if (mode)
+		return -EOPNOTSUPP;
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1)
+		return -errno;
+
+	res = -posix_fallocate(fd, offset, length);
+
+	close(fd);
+	return res;
+}
+#endif
+
+#ifdef SEEK_HOLE
+static off_t xmp_lseek(const char *path, off_t off, int whence,
+			struct fuse_file_info *fi)
+{
+	int fd;
+	off_t res;
+
+	(void) fi;
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	res = lseek(fd, off, whence);
+	if (res == -1)
+		res = -errno;
+
+	close(fd);
+	return res;
+}
+#endif
+
 static int xmp_statfs(const char *path, struct statvfs *stbuf)
 {
 	int res;
@@ -655,6 +699,12 @@ static struct fuse_operations xmp_oper = {
 	.getxtimes	 = xmp_getxtimes,
 	.setattr_x	 = xmp_setattr_x,
 	.fsetattr_x	 = xmp_fsetattr_x,
+#ifdef HAVE_POSIX_FALLOCATE
+	.fallocate	= xmp_fallocate,
+#endif
+#ifdef SEEK_HOLE
+	.lseek		= xmp_lseek,
+#endif
 };
 
 int main(int argc, char *argv[])
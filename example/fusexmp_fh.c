@@ -440,6 +440,56 @@ static int xmp_removexattr(const char *path, const char *name)
 }
 #endif /* HAVE_SETXATTR */
 
+#ifdef HAVE_COPY_FILE_RANGE
+static ssize_t xmp_copy_file_range(const char *path_in,
+				   struct fuse_file_info *fi_in,
+				   off_t offset_in, const char *path_out,
+				   struct fuse_file_info *fi_out,
+				   off_t offset_out, size_t len, int flags)
+{
+	ssize_t res;
+	(void) path_in;
+	(void) path_out;
+
+	res = copy_file_range(fi_in->fh, &offset_in, fi_out->fh, &offset_out,
+			      len, flags);
+	if (res == -1)
+		return -errno;
+
+	return res;
+}
+#endif
+
+#ifdef HAVE_FALLOCATE
+static int xmp_fallocate(const char *path, int mode, off_t offset,
+			 off_t length, struct fuse_file_info *fi)
+{
+	int res;
+	(void) path;
+
+	res = fallocate(fi->fh, mode, offset, length);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+#endif
+
+#ifdef SEEK_HOLE
+static off_t xmp_lseek(const char *path, off_t off, int whence,
+		       struct fuse_file_info *fi)
+{
+	off_t res;
+	(void) path;
+
+	res = lseek(fi->fh, off, whence);
+	if (res == -1)
+		return -errno;
+
+	return res;
+}
+#endif
+
 static int xmp_lock(const char *path, struct fuse_file_info *fi, int cmd,
 		    struct flock *lock)
 {
@@ -484,6 +534,15 @@ static struct fuse_operations xmp_oper = {
 	.removexattr	= xmp_removexattr,
 #endif
 	.lock		= xmp_lock,
+#ifdef HAVE_COPY_FILE_RANGE
+	.copy_file_range = xmp_copy_file_range,
+#endif
+#ifdef HAVE_FALLOCATE
+	.fallocate	= xmp_fallocate,
+#endif
+#ifdef SEEK_HOLE
+	.lseek		= xmp_lseek,
+#endif
 
 	.flag_nullpath_ok = 1,
 };
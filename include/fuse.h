@@ -168,6 +168,16 @@ struct fuse_operations {
 	 * filehandle in the fuse_file_info structure, which will be
 	 * passed to all file operations.
 	 *
+	 * If the 'writeback_cache' option is in effect, O_WRONLY is
+	 * changed to O_RDWR, unless that fails with EACCES, and
+	 * O_APPEND is cleared.  The kernel then reads from write-only
+	 * handles and computes the offsets of appending writes itself.
+	 *
+	 * If neither open() nor release() is implemented, and the
+	 * 'kernel_cache' and 'hard_remove' options are given, opens
+	 * are handled by the kernel without sending any request to the
+	 * filesystem, provided the kernel supports this.
+	 *
 	 * Changed in version 2.2
 	 */
 	int (*open) (const char *, struct fuse_file_info *);
@@ -307,6 +317,11 @@ struct fuse_operations {
 	 * is full (or an error happens) the filler function will return
 	 * '1'.
 	 *
+	 * If the kernel supports readdirplus, attributes passed to the
+	 * filler function with a non-zero st_nlink are returned to the
+	 * kernel along with the entry, saving a lookup for each file.
+	 * Such attributes must be complete, as for getattr().
+	 *
 	 * Introduced in version 2.3
 	 */
 	int (*readdir) (const char *, void *, fuse_fill_dir_t, off_t,
@@ -465,10 +480,17 @@ struct fuse_operations {
 	 */
 	unsigned int flag_nullpath_ok : 1;
 
+	/**
+	 * Flag indicating, that file handles point to state of this
+	 * process, which fuse_handoff_send() cannot pass on.  Handoff
+	 * is refused while any file is open.
+	 */
+	unsigned int flag_private_fh : 1;
+
 	/**
 	 * Reserved flags, don't set
 	 */
-	unsigned int flag_reserved : 31;
+	unsigned int flag_reserved : 30;
 
 	/**
 	 * Ioctl
@@ -543,6 +565,64 @@ struct fuse_operations {
 	int (*fsetattr_x) (const char *, struct setattr_x *,
 			   struct fuse_file_info *);
 #endif /* __APPLE__ */
+
+	/**
+	 * Copy a range of data from one file to another
+	 *
+	 * Performs an optimized copy between two open files, without
+	 * passing the data through the kernel and back to the
+	 * filesystem with read and write requests.
+	 *
+	 * Returns the number of bytes copied, which may be less than
+	 * requested.  If this method is not implemented, the kernel
+	 * falls back to reading and writing the data.
+	 *
+	 * Introduced in version 2.9
+	 */
+	ssize_t (*copy_file_range) (const char *path_in,
+				    struct fuse_file_info *fi_in,
+				    off_t offset_in, const char *path_out,
+				    struct fuse_file_info *fi_out,
+				    off_t offset_out, size_t size, int flags);
+
+	/**
+	 * Allocates space for an open file
+	 *
+	 * This function ensures that required space is allocated for
+	 * the specified file.  If this function returns success then
+	 * any subsequent write request to the specified range is
+	 * guaranteed not to fail because of lack of space on the file
+	 * system media.  The mode argument is as for fallocate(2).
+	 *
+	 * Introduced in version 2.9
+	 */
+	int (*fallocate) (const char *, int, off_t, off_t,
+			  struct fuse_file_info *);
+
+	/**
+	 * Find next data or hole after the specified offset
+	 *
+	 * Only called with SEEK_DATA or SEEK_HOLE.  Returns the
+	 * resulting offset, or -ENXIO if there is no more data after
+	 * the offset.  If this method is not implemented, the whole
+	 * file is treated as data.
+	 *
+	 * Introduced in version 2.9
+	 */
+	off_t (*lseek) (const char *, off_t off, int whence,
+			struct fuse_file_info *);
+
+	/**
+	 * Receive data retrieved from the kernel cache
+	 *
+	 * Called once for every successful fuse_notify_retrieve().
+	 * The path is NULL if the file no longer has a name.  The
+	 * data is only valid for the duration of the call.
+	 *
+	 * Introduced in version 2.9
+	 */
+	void (*retrieve_reply) (const char *path, void *cookie, off_t offset,
+				const void *buf, size_t size);
 };
 
 /** Extra context that may be needed by some filesystems
@@ -668,6 +748,57 @@ void fuse_exit(struct fuse *f);
  */
 int fuse_loop_mt(struct fuse *f);
 
+/**
+ * Hand the mounted filesystem over to another process
+ *
+ * Sends the device file descriptor, the negotiated connection
+ * parameters and the node table, including open counts and POSIX
+ * locks, over the connected Unix domain socket 'sock' to a process
+ * calling fuse_handoff_receive().  Must be called after the event
+ * loop has returned, so no request is being processed.  Requests
+ * arriving in the meantime are queued by the kernel and answered by
+ * the new process.
+ *
+ * Returns after the new process has confirmed that it took over.
+ * From then on fuse_teardown() doesn't unmount and fuse_destroy()
+ * doesn't remove hidden files.  On failure the event loop may simply
+ * be restarted.
+ *
+ * File handles are passed to the new process unchanged.  If they
+ * refer to resources of this process, such as file descriptors, the
+ * filesystem must pass those over the same socket itself.  Handles
+ * that can't be passed on make the handoff fail instead: it fails
+ * while any directory is open, and while any file is open if the
+ * filesystem or a stacked module sets flag_private_fh.  The
+ * readahead and writebehind modules set it, as their handles point
+ * to prefetched and unwritten data in this process.
+ *
+ * @param f the FUSE handle
+ * @param sock connected Unix domain socket
+ * @return 0 on success, -1 on failure
+ */
+int fuse_handoff_send(struct fuse *f, int sock);
+
+/**
+ * Take over a filesystem from another process
+ *
+ * Receives the state sent by fuse_handoff_send() and creates a FUSE
+ * handle from it, like fuse_new() would.  The init() method is called
+ * with the connection parameters negotiated by the previous process.
+ * The channel can be obtained with fuse_session_next_chan() for
+ * unmounting later.
+ *
+ * @param sock connected Unix domain socket
+ * @param args argument vector
+ * @param op the filesystem operations
+ * @param op_size the size of the fuse_operations structure
+ * @param user_data user data supplied in the context during the init() method
+ * @return the created FUSE handle, or NULL on failure
+ */
+struct fuse *fuse_handoff_receive(int sock, struct fuse_args *args,
+				  const struct fuse_operations *op,
+				  size_t op_size, void *user_data);
+
 /**
  * Get the current context
  *
@@ -712,6 +843,48 @@ int fuse_interrupted(void);
  */
 int fuse_invalidate(struct fuse *f, const char *path);
 
+/**
+ * Store data in the kernel cache of a file
+ *
+ * The data is marked up-to-date, so subsequent reads of the range
+ * are served without calling the read() method.  If the range ends
+ * past the end of the file, the file size seen by the kernel is
+ * extended.
+ *
+ * Only files currently known to the kernel can be stored to.  The
+ * kernel drops the cache of a file when it is opened without
+ * keep_cache, so the next open of the file after a store keeps the
+ * cache, whatever the kernel_cache and auto_cache options say.  Later
+ * opens follow those options again; use kernel_cache to keep stored
+ * data across all of them.
+ *
+ * @param f the FUSE handle
+ * @param path the path of the file, relative to the mountpoint
+ * @param offset the starting offset to store to
+ * @param buf the data to store
+ * @param size the number of bytes to store
+ * @return zero for success, -errno for failure
+ */
+int fuse_notify_store(struct fuse *f, const char *path, off_t offset,
+		      const void *buf, size_t size);
+
+/**
+ * Retrieve data from the kernel cache of a file
+ *
+ * If successful, the retrieve_reply() method is called with the
+ * cached data up to the first page that is not present in the
+ * cache.
+ *
+ * @param f the FUSE handle
+ * @param path the path of the file, relative to the mountpoint
+ * @param size the number of bytes to retrieve
+ * @param offset the starting offset to retrieve from
+ * @param cookie user data passed to retrieve_reply()
+ * @return zero for success, -errno for failure
+ */
+int fuse_notify_retrieve(struct fuse *f, const char *path, size_t size,
+			 off_t offset, void *cookie);
+
 /* Deprecated, don't use */
 int fuse_is_lib_option(const char *opt);
 
@@ -834,6 +1007,18 @@ int fuse_fs_ioctl(struct fuse_fs *fs, const char *path, int cmd, void *arg,
 int fuse_fs_poll(struct fuse_fs *fs, const char *path,
 		 struct fuse_file_info *fi, struct fuse_pollhandle *ph,
 		 unsigned *reventsp);
+ssize_t fuse_fs_copy_file_range(struct fuse_fs *fs, const char *path_in,
+				struct fuse_file_info *fi_in, off_t off_in,
+				const char *path_out,
+				struct fuse_file_info *fi_out, off_t off_out,
+				size_t len, int flags);
+int fuse_fs_fallocate(struct fuse_fs *fs, const char *path, int mode,
+		      off_t offset, off_t length, struct fuse_file_info *fi);
+off_t fuse_fs_lseek(struct fuse_fs *fs, const char *path, off_t off,
+		    int whence, struct fuse_file_info *fi);
+void fuse_fs_retrieve_reply(struct fuse_fs *fs, const char *path,
+			    void *cookie, off_t offset, const void *buf,
+			    size_t size);
 void fuse_fs_init(struct fuse_fs *fs, struct fuse_conn_info *conn);
 void fuse_fs_destroy(struct fuse_fs *fs);
 
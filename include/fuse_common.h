@@ -129,6 +129,12 @@ struct fuse_file_info {
  * FUSE_CAP_EXPORT_SUPPORT: filesystem handles lookups of "." and ".."
  * FUSE_CAP_BIG_WRITES: filesystem can handle write size larger than 4kB
  * FUSE_CAP_DONT_MASK: don't apply umask to file mode on create operations
+ * FUSE_CAP_READDIRPLUS: filesystem supports readdirplus
+ * FUSE_CAP_READDIRPLUS_AUTO: kernel decides when to use readdirplus
+ * FUSE_CAP_WRITEBACK_CACHE: kernel caches writes and owns mtime and size
+ * FUSE_CAP_PARALLEL_DIROPS: allow parallel lookups and readdirs in a directory
+ * FUSE_CAP_NO_OPEN_SUPPORT: kernel handles open if it returns ENOSYS
+ * FUSE_CAP_NO_OPENDIR_SUPPORT: kernel handles opendir if it returns ENOSYS
  */
 #define FUSE_CAP_ASYNC_READ	(1 << 0)
 #define FUSE_CAP_POSIX_LOCKS	(1 << 1)
@@ -136,6 +142,12 @@ struct fuse_file_info {
 #define FUSE_CAP_EXPORT_SUPPORT	(1 << 4)
 #define FUSE_CAP_BIG_WRITES	(1 << 5)
 #define FUSE_CAP_DONT_MASK	(1 << 6)
+#define FUSE_CAP_READDIRPLUS	(1 << 13)
+#define FUSE_CAP_READDIRPLUS_AUTO	(1 << 14)
+#define FUSE_CAP_WRITEBACK_CACHE	(1 << 16)
+#define FUSE_CAP_NO_OPEN_SUPPORT	(1 << 17)
+#define FUSE_CAP_PARALLEL_DIROPS	(1 << 18)
+#define FUSE_CAP_NO_OPENDIR_SUPPORT	(1 << 24)
 
 /**
  * Ioctl flags
@@ -143,12 +155,14 @@ struct fuse_file_info {
  * FUSE_IOCTL_COMPAT: 32bit compat ioctl on 64bit machine
  * FUSE_IOCTL_UNRESTRICTED: not restricted to well-formed ioctls, retry allowed
  * FUSE_IOCTL_RETRY: retry with new iovecs
+ * FUSE_IOCTL_DIR: is a directory
  *
  * FUSE_IOCTL_MAX_IOV: maximum of in_iovecs + out_iovecs
  */
 #define FUSE_IOCTL_COMPAT	(1 << 0)
 #define FUSE_IOCTL_UNRESTRICTED	(1 << 1)
 #define FUSE_IOCTL_RETRY	(1 << 2)
+#define FUSE_IOCTL_DIR		(1 << 4)
 
 #define FUSE_IOCTL_MAX_IOV	256
 
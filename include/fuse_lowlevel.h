@@ -114,6 +114,15 @@ struct fuse_ctx {
 	mode_t umask;
 };
 
+/** Inode and lookup count passed to forget_multi() */
+struct fuse_forget_data {
+	/** Inode number */
+	uint64_t ino;
+
+	/** Number of lookups to forget */
+	uint64_t nlookup;
+};
+
 /* 'to_set' flags in setattr */
 #define FUSE_SET_ATTR_MODE	(1 << 0)
 #define FUSE_SET_ATTR_UID	(1 << 1)
@@ -391,6 +400,12 @@ struct fuse_lowlevel_ops {
 	 * filesystem may set in fi, to change the way the file is opened.
 	 * See fuse_file_info structure in <fuse_common.h> for more details.
 	 *
+	 * If FUSE_CAP_NO_OPEN_SUPPORT is set in conn->capable, a
+	 * stateless filesystem may answer this request with ENOSYS.
+	 * The open then succeeds, and the kernel handles all further
+	 * opens itself: no open or release requests are sent, fi->fh
+	 * is zero, and cached data is kept as if keep_cache was set.
+	 *
 	 * Valid replies:
 	 *   fuse_reply_open
 	 *   fuse_reply_err
@@ -544,6 +559,12 @@ struct fuse_lowlevel_ops {
 	 * case the contents of the directory can change between opendir
 	 * and releasedir.
 	 *
+	 * If FUSE_CAP_NO_OPENDIR_SUPPORT is set in conn->capable, a
+	 * filesystem with stateless directory streams may answer this
+	 * request with ENOSYS.  The opendir then succeeds, and the
+	 * kernel handles all further opendirs itself: no opendir or
+	 * releasedir requests are sent and fi->fh is zero.
+	 *
 	 * Valid replies:
 	 *   fuse_reply_open
 	 *   fuse_reply_err
@@ -923,6 +944,163 @@ struct fuse_lowlevel_ops {
 			   struct fuse_file_info *fi);
 
 #endif /* __APPLE__ */
+
+	/**
+	 * Forget about multiple inodes
+	 *
+	 * See description of the forget function for more
+	 * information.  If this method is not implemented, forget is
+	 * called for each inode instead.
+	 *
+	 * Introduced in version 2.9
+	 *
+	 * Valid replies:
+	 *   fuse_reply_none
+	 *
+	 * @param req request handle
+	 * @param count the number of inodes to forget
+	 * @param forgets the inodes and their lookup counts
+	 */
+	void (*forget_multi) (fuse_req_t req, size_t count,
+			      struct fuse_forget_data *forgets);
+
+	/**
+	 * Read directory with attributes
+	 *
+	 * Send a buffer filled using fuse_add_direntry_plus(), with size
+	 * not exceeding the requested size.  Send an empty buffer on end
+	 * of stream.
+	 *
+	 * Every entry with a non-zero inode number in its entry
+	 * parameters counts as a lookup, exactly like a reply to
+	 * lookup, and will eventually be forgotten.  Entries with a
+	 * zero inode number are looked up by the kernel separately
+	 * when needed.
+	 *
+	 * fi->fh will contain the value set by the opendir method, or
+	 * will be undefined if the opendir method didn't set any value.
+	 *
+	 * Introduced in version 2.9
+	 *
+	 * Valid replies:
+	 *   fuse_reply_buf
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param size maximum number of bytes to send
+	 * @param off offset to continue reading the directory stream
+	 * @param fi file information
+	 */
+	void (*readdirplus) (fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t off, struct fuse_file_info *fi);
+
+	/**
+	 * Copy a range of data from one file to another
+	 *
+	 * Performs an optimized copy between two open files, without
+	 * passing the data through the kernel and back to the
+	 * filesystem with read and write requests.
+	 *
+	 * If this request is answered with an error code of ENOSYS,
+	 * this is treated as a permanent failure with error code
+	 * EOPNOTSUPP, i.e. all future copy_file_range() requests will
+	 * fail with EOPNOTSUPP without being sent to the filesystem
+	 * process.
+	 *
+	 * Introduced in version 2.9
+	 *
+	 * Valid replies:
+	 *   fuse_reply_write
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino_in the inode number of the source file
+	 * @param off_in starting point from where the data should be read
+	 * @param fi_in file information of the source file
+	 * @param ino_out the inode number of the destination file
+	 * @param off_out starting point where the data should be written
+	 * @param fi_out file information of the destination file
+	 * @param len maximum size of the data to copy
+	 * @param flags passed along with the copy_file_range() syscall
+	 */
+	void (*copy_file_range) (fuse_req_t req, fuse_ino_t ino_in,
+				 off_t off_in, struct fuse_file_info *fi_in,
+				 fuse_ino_t ino_out, off_t off_out,
+				 struct fuse_file_info *fi_out, size_t len,
+				 int flags);
+
+	/**
+	 * Allocate requested space
+	 *
+	 * If this function returns success then subsequent writes to
+	 * the specified range shall not fail due to the lack of free
+	 * space on the file system storage media.
+	 *
+	 * If this request is answered with an error code of ENOSYS,
+	 * this is treated as a permanent failure with error code
+	 * EOPNOTSUPP, i.e. all future fallocate() requests will fail
+	 * with EOPNOTSUPP without being sent to the filesystem process.
+	 *
+	 * Introduced in version 2.9
+	 *
+	 * Valid replies:
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param mode determines the operation to be performed on the
+	 *             given range, see fallocate(2)
+	 * @param offset starting point for allocated region
+	 * @param length size of allocated region
+	 * @param fi file information
+	 */
+	void (*fallocate) (fuse_req_t req, fuse_ino_t ino, int mode,
+			   off_t offset, off_t length,
+			   struct fuse_file_info *fi);
+
+	/**
+	 * Find next data or hole after the specified offset
+	 *
+	 * Only SEEK_DATA and SEEK_HOLE are sent to the filesystem, the
+	 * other whence values are handled by the kernel.
+	 *
+	 * If this request is answered with an error code of ENOSYS,
+	 * the kernel stops sending lseek requests and treats the
+	 * whole file as data from then on.
+	 *
+	 * Introduced in version 2.9
+	 *
+	 * Valid replies:
+	 *   fuse_reply_lseek
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param off offset to start search from
+	 * @param whence either SEEK_DATA or SEEK_HOLE
+	 * @param fi file information
+	 */
+	void (*lseek) (fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+		       struct fuse_file_info *fi);
+
+	/**
+	 * Callback function for the retrieve request
+	 *
+	 * Introduced in version 2.9
+	 *
+	 * Valid replies:
+	 *   fuse_reply_none
+	 *
+	 * @param req request handle
+	 * @param cookie user data supplied to fuse_lowlevel_notify_retrieve()
+	 * @param ino the inode number given to the retrieve notification
+	 * @param offset the offset given to the retrieve notification
+	 * @param buf the data retrieved from the cache
+	 * @param size the number of bytes retrieved
+	 */
+	void (*retrieve_reply) (fuse_req_t req, void *cookie, fuse_ino_t ino,
+				off_t offset, const void *buf, size_t size);
 };
 
 /**
@@ -1151,6 +1329,26 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
 			 const char *name, const struct stat *stbuf,
 			 off_t off);
 
+/**
+ * Add a directory entry with attributes to the buffer
+ *
+ * Like fuse_add_direntry(), but for readdirplus.  The entry
+ * parameters are sent to the kernel as if they were a reply to a
+ * lookup of 'name', unless e->ino is zero.  The inode number and type
+ * of the directory entry are taken from e->attr.
+ *
+ * @param req request handle
+ * @param buf the point where the new entry will be added to the buffer
+ * @param bufsize remaining size of the buffer
+ * @param name the name of the entry
+ * @param e the directory entry
+ * @param off the offset of the next entry
+ * @return the space needed for the entry
+ */
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+			      const char *name,
+			      const struct fuse_entry_param *e, off_t off);
+
 /**
  * Reply to ask for data fetch and output buffer preparation.  ioctl
  * will be retried with the specified input data fetched and output
@@ -1205,6 +1403,18 @@ int fuse_reply_ioctl_iov(fuse_req_t req, int result, const struct iovec *iov,
  */
 int fuse_reply_poll(fuse_req_t req, unsigned revents);
 
+/**
+ * Reply with offset
+ *
+ * Possible requests:
+ *   lseek
+ *
+ * @param req request handle
+ * @param off offset of next data or hole
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_reply_lseek(fuse_req_t req, off_t off);
+
 /* ----------------------------------------------------------- *
  * Notification						       *
  * ----------------------------------------------------------- */
@@ -1244,6 +1454,58 @@ int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino,
 int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent,
                                      const char *name, size_t namelen);
 
+/**
+ * Store data to the kernel buffers
+ *
+ * Synchronously store data in the kernel buffers belonging to the
+ * given inode.  The stored data is marked up-to-date (no read will
+ * be performed against it, unless it's invalidated or evicted from
+ * the cache).
+ *
+ * If the stored data overflows the current file size, then the size
+ * is extended, similarly to a write(2) on the filesystem.
+ *
+ * If this function returns an error, then the store wasn't fully
+ * completed, but it may have been partially completed.
+ *
+ * @param ch the channel through which to send the notification
+ * @param ino the inode number
+ * @param offset the starting offset into the file to store to
+ * @param buf the data to store
+ * @param size the number of bytes to store
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_store(struct fuse_chan *ch, fuse_ino_t ino,
+			       off_t offset, const void *buf, size_t size);
+
+/**
+ * Retrieve data from the kernel buffers
+ *
+ * Retrieve data in the kernel buffers belonging to the given inode.
+ * If successful then the retrieve_reply() method will be called with
+ * the returned data.
+ *
+ * Only present pages are returned in the retrieve reply.  Retrieving
+ * stops when it finds a non-present page and only data prior to that
+ * is returned.
+ *
+ * If this function returns an error, then the retrieve will not be
+ * completed and no reply will be sent.
+ *
+ * This function doesn't change the dirty state of pages in the kernel
+ * buffer.  For dirty pages the write() method will be called
+ * regardless of having been retrieved previously.
+ *
+ * @param ch the channel through which to send the notification
+ * @param ino the inode number
+ * @param size the number of bytes to retrieve
+ * @param offset the starting offset into the file to retrieve from
+ * @param cookie user data to supply to the reply callback
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_retrieve(struct fuse_chan *ch, fuse_ino_t ino,
+				  size_t size, off_t offset, void *cookie);
+
 /* ----------------------------------------------------------- *
  * Utility functions					       *
  * ----------------------------------------------------------- */
@@ -32,6 +32,7 @@
 #include <assert.h>
 #include <sys/param.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 
 #define FUSE_DEFAULT_INTR_SIGNAL SIGUSR1
@@ -59,6 +60,10 @@ struct fuse_config {
 	int direct_io;
 	int kernel_cache;
 	int auto_cache;
+	int readlink_cache;
+	int nodeid64;
+	unsigned int node_cache_max;
+	char *nodemap;
 	int intr;
 	int intr_signal;
 	int help;
@@ -92,6 +97,7 @@ struct fuse {
 	size_t name_table_size;
 	struct node **id_table;
 	size_t id_table_size;
+	size_t id_table_count;
 	fuse_ino_t ctr;
 	unsigned int generation;
 	unsigned int hidectr;
@@ -102,6 +108,22 @@ struct fuse {
 	int nullpath_ok;
 	int curr_ticket;
 	struct lock_queue_element *lockq;
+	unsigned long long readlink_hits;
+	unsigned long long readlink_misses;
+	struct node *lru_first;
+	struct node *lru_last;
+	unsigned long long evictions;
+	pthread_t prune_thread;
+	pthread_cond_t prune_cond;
+	int prune_started;
+	int prune_exit;
+	struct fuse_nodemap *nodemap;
+	int handed_off;
+	int private_fh;
+	unsigned int open_dirs;
+	int readdirplus;
+	int writeback;
+	int no_open;
 };
 
 struct lock {
@@ -111,6 +133,9 @@ struct lock {
 	pid_t pid;
 	uint64_t owner;
 	struct lock *next;
+	struct lock *left;
+	struct lock *right;
+	off_t max_end;
 };
 
 struct node {
@@ -127,12 +152,27 @@ struct node {
 	struct timespec mtime;
 	off_t size;
 	struct lock *locks;
+	char *link;
+	struct node *lru_prev;
+	struct node *lru_next;
 	unsigned int is_hidden : 1;
 	unsigned int cache_valid : 1;
+	unsigned int in_lru : 1;
+	unsigned int evicted : 1;
+	unsigned int stored : 1;
 	int treelock;
 	int ticket;
 };
 
+/* Attributes of a buffered directory entry, kept for readdirplus */
+struct fuse_dh_entry {
+	unsigned off;
+	char *name;
+	struct stat stat;
+	ino_t attr_ino;
+	int attr_valid;
+};
+
 struct fuse_dh {
 	pthread_mutex_t lock;
 	struct fuse *fuse;
@@ -146,6 +186,10 @@ struct fuse_dh {
 	uint64_t fh;
 	int error;
 	fuse_ino_t nodeid;
+	int plus;
+	struct fuse_dh_entry *entries;
+	unsigned nentries;
+	unsigned entries_size;
 };
 
 /* old dir handle */
@@ -287,6 +331,7 @@ static struct node *get_node(struct fuse *f, fuse_ino_t nodeid)
 static void free_node(struct node *node)
 {
 	free(node->name);
+	free(node->link);
 	free(node);
 }
 
@@ -298,15 +343,50 @@ static void unhash_id(struct fuse *f, struct node *node)
 	for (; *nodep != NULL; nodep = &(*nodep)->id_next)
 		if (*nodep == node) {
 			*nodep = node->id_next;
+			f->id_table_count--;
 			return;
 		}
 }
 
+/* Keep the ID hash chains short as the number of nodes grows */
+static void rehash_id_table(struct fuse *f)
+{
+	size_t newsize = f->id_table_size * 2 + 1;
+	struct node **newtable;
+	size_t i;
+
+	newtable = (struct node **) calloc(newsize, sizeof(struct node *));
+	if (newtable == NULL)
+		return;
+
+	for (i = 0; i < f->id_table_size; i++) {
+		struct node *node;
+		struct node *next;
+
+		for (node = f->id_table[i]; node != NULL; node = next) {
+			size_t hash = node->nodeid % newsize;
+
+			next = node->id_next;
+			node->id_next = newtable[hash];
+			newtable[hash] = node;
+		}
+	}
+	free(f->id_table);
+	f->id_table = newtable;
+	f->id_table_size = newsize;
+}
+
 static void hash_id(struct fuse *f, struct node *node)
 {
-	size_t hash = node->nodeid % f->id_table_size;
+	size_t hash;
+
+	if (f->id_table_count >= f->id_table_size * 2)
+		rehash_id_table(f);
+
+	hash = node->nodeid % f->id_table_size;
 	node->id_next = f->id_table[hash];
 	f->id_table[hash] = node;
+	f->id_table_count++;
 }
 
 static unsigned int name_hash(struct fuse *f, fuse_ino_t parent,
@@ -336,6 +416,8 @@ static void unhash_name(struct fuse *f, struct node *node)
 				unref_node(f, node->parent);
 				free(node->name);
 				node->name = NULL;
+				free(node->link);
+				node->link = NULL;
 				node->parent = NULL;
 				return;
 			}
@@ -362,6 +444,39 @@ static int hash_name(struct fuse *f, struct node *node, fuse_ino_t parentid,
 	return 0;
 }
 
+static void lru_remove(struct fuse *f, struct node *node)
+{
+	if (!node->in_lru)
+		return;
+
+	if (node->lru_prev)
+		node->lru_prev->lru_next = node->lru_next;
+	else
+		f->lru_first = node->lru_next;
+	if (node->lru_next)
+		node->lru_next->lru_prev = node->lru_prev;
+	else
+		f->lru_last = node->lru_prev;
+	node->lru_prev = node->lru_next = NULL;
+	node->in_lru = 0;
+}
+
+/* Move the node to the recently used end of the LRU list */
+static void lru_touch(struct fuse *f, struct node *node)
+{
+	if (!f->conf.node_cache_max)
+		return;
+
+	lru_remove(f, node);
+	node->lru_prev = f->lru_last;
+	if (f->lru_last)
+		f->lru_last->lru_next = node;
+	else
+		f->lru_first = node;
+	f->lru_last = node;
+	node->in_lru = 1;
+}
+
 static void delete_node(struct fuse *f, struct node *node)
 {
 	if (f->conf.debug)
@@ -371,6 +486,9 @@ static void delete_node(struct fuse *f, struct node *node)
 	assert(node->treelock == 0);
 	assert(!node->name);
 	unhash_id(f, node);
+	lru_remove(f, node);
+	if (node->evicted)
+		f->evictions++;
 	free_node(node);
 }
 
@@ -384,15 +502,46 @@ static void unref_node(struct fuse *f, struct node *node)
 
 static fuse_ino_t next_id(struct fuse *f)
 {
-	do {
-		f->ctr = (f->ctr + 1) & 0xffffffff;
-		if (!f->ctr)
-			f->generation ++;
-	} while (f->ctr == 0 || f->ctr == FUSE_UNKNOWN_INO ||
-		 get_node_nocheck(f, f->ctr) != NULL);
+	if (f->conf.nodeid64) {
+		/* A 64-bit counter never wraps, so there is no need to
+		   check for IDs still in use */
+		do
+			f->ctr++;
+		while (f->ctr == FUSE_ROOT_ID || f->ctr == FUSE_UNKNOWN_INO);
+	} else {
+		/* IDs remembered in the node map are kept for their names */
+		do {
+			f->ctr = (f->ctr + 1) & 0xffffffff;
+			if (!f->ctr)
+				f->generation ++;
+		} while (f->ctr == 0 || f->ctr == FUSE_UNKNOWN_INO ||
+			 get_node_nocheck(f, f->ctr) != NULL ||
+			 (f->nodemap &&
+			  fuse_nodemap_id_used(f->nodemap, f->ctr)));
+	}
+	if (f->nodemap)
+		fuse_nodemap_reserve(f->nodemap, f->ctr, f->generation);
 	return f->ctr;
 }
 
+/* Reuse the ID this name had before, unless something else has it now */
+static int nodemap_find_id(struct fuse *f, struct node *node,
+			   fuse_ino_t parent, const char *name)
+{
+	uint64_t nodeid;
+	unsigned int generation;
+
+	if (fuse_nodemap_lookup(f->nodemap, parent, name, &nodeid,
+				&generation) != 0)
+		return -1;
+	if ((fuse_ino_t) nodeid != nodeid || get_node_nocheck(f, nodeid))
+		return -1;
+
+	node->nodeid = nodeid;
+	node->generation = generation;
+	return 0;
+}
+
 static struct node *lookup_node(struct fuse *f, fuse_ino_t parent,
 				const char *name)
 {
@@ -407,6 +556,137 @@ static struct node *lookup_node(struct fuse *f, fuse_ino_t parent,
 	return NULL;
 }
 
+#define FUSE_PRUNE_BATCH 64
+#define FUSE_PRUNE_SCAN 1024
+
+struct prune_entry {
+	fuse_ino_t parent;
+	char *name;
+};
+
+/*
+ * Only leaves can be evicted, and only if nothing but the kernel's
+ * lookup count keeps them alive.
+ */
+static int node_evictable(struct node *node)
+{
+	return node->name != NULL && node->refctr == 1 &&
+		!node->open_count && !node->locks && !node->treelock &&
+		!node->is_hidden;
+}
+
+/*
+ * Find cold nodes at the head of the LRU list.  Nodes that are only kept
+ * by noforget are dropped right away, for the others the kernel is asked
+ * to drop the dentry, after which it will forget the node.
+ */
+static int prune_collect(struct fuse *f, struct prune_entry *ent)
+{
+	size_t excess = f->id_table_count - f->conf.node_cache_max;
+	struct node *node;
+	struct node *next;
+	int scanned = 0;
+	int n = 0;
+
+	for (node = f->lru_first; node != NULL && n < FUSE_PRUNE_BATCH &&
+		     n < excess && scanned < FUSE_PRUNE_SCAN; node = next) {
+		next = node->lru_next;
+		scanned++;
+		if (!node_evictable(node))
+			continue;
+
+		node->evicted = 1;
+		if (f->conf.noforget && node->nlookup == 1) {
+			node->nlookup = 0;
+			unhash_name(f, node);
+			unref_node(f, node);
+			excess--;
+			/* the parent may have gone too */
+			next = f->lru_first;
+			continue;
+		}
+		ent[n].parent = node->parent->nodeid;
+		ent[n].name = strdup(node->name);
+		if (ent[n].name == NULL)
+			break;
+		n++;
+		lru_touch(f, node);
+	}
+	return n;
+}
+
+static void *fuse_prune_nodes(void *data)
+{
+	struct fuse *f = (struct fuse *) data;
+	struct fuse_chan *ch = fuse_session_next_chan(f->se, NULL);
+	struct prune_entry ent[FUSE_PRUNE_BATCH];
+	struct timespec timeout;
+	struct timeval now;
+	int n;
+	int i;
+
+	pthread_mutex_lock(&f->lock);
+	while (!f->prune_exit) {
+		if (f->id_table_count <= f->conf.node_cache_max) {
+			pthread_cond_wait(&f->prune_cond, &f->lock);
+			continue;
+		}
+
+		n = prune_collect(f, ent);
+		pthread_mutex_unlock(&f->lock);
+		for (i = 0; i < n; i++) {
+			fuse_lowlevel_notify_inval_entry(ch, ent[i].parent,
+							 ent[i].name,
+							 strlen(ent[i].name));
+			free(ent[i].name);
+		}
+		pthread_mutex_lock(&f->lock);
+
+		/* Give the kernel time to send the forgets */
+		gettimeofday(&now, NULL);
+		timeout.tv_sec = now.tv_sec;
+		timeout.tv_nsec = (now.tv_usec + 10000) * 1000;
+		if (timeout.tv_nsec >= 1000000000) {
+			timeout.tv_sec++;
+			timeout.tv_nsec -= 1000000000;
+		}
+		if (!f->prune_exit)
+			pthread_cond_timedwait(&f->prune_cond, &f->lock,
+					       &timeout);
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return NULL;
+}
+
+/* Called with f->lock held */
+static void fuse_prune_start(struct fuse *f)
+{
+	if (!f->prune_started) {
+		sigset_t oldset;
+		sigset_t newset;
+		int res;
+
+		sigemptyset(&newset);
+		sigaddset(&newset, SIGTERM);
+		sigaddset(&newset, SIGINT);
+		sigaddset(&newset, SIGHUP);
+		sigaddset(&newset, SIGQUIT);
+		pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+		res = pthread_create(&f->prune_thread, NULL, fuse_prune_nodes,
+				     f);
+		pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+		if (res != 0) {
+			fprintf(stderr, "fuse: error creating thread: %s\n",
+				strerror(res));
+			f->prune_started = -1;
+			return;
+		}
+		f->prune_started = 1;
+	}
+	pthread_cond_signal(&f->prune_cond);
+}
+
 static struct node *find_node(struct fuse *f, fuse_ino_t parent,
 			      const char *name)
 {
@@ -425,8 +705,15 @@ static struct node *find_node(struct fuse *f, fuse_ino_t parent,
 		if (f->conf.noforget)
 			node->nlookup = 1;
 		node->refctr = 1;
-		node->nodeid = next_id(f);
-		node->generation = f->generation;
+		if (!f->nodemap || !name ||
+		    nodemap_find_id(f, node, parent, name) == -1) {
+			node->nodeid = next_id(f);
+			node->generation = f->generation;
+			if (f->nodemap && name)
+				fuse_nodemap_add(f->nodemap, parent, name,
+						 node->nodeid,
+						 node->generation);
+		}
 		node->open_count = 0;
 		node->is_hidden = 0;
 		node->treelock = 0;
@@ -437,7 +724,12 @@ static struct node *find_node(struct fuse *f, fuse_ino_t parent,
 			goto out_err;
 		}
 		hash_id(f, node);
+		if (f->conf.node_cache_max &&
+		    f->id_table_count > f->conf.node_cache_max &&
+		    f->prune_started >= 0)
+			fuse_prune_start(f);
 	}
+	lru_touch(f, node);
 	node->nlookup ++;
 out_err:
 	pthread_mutex_unlock(&f->lock);
@@ -813,12 +1105,12 @@ static void free_path2(struct fuse *f, fuse_ino_t nodeid1, fuse_ino_t nodeid2,
 	free(path2);
 }
 
-static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
+/* Called with f->lock held */
+static void forget_one(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
 {
 	struct node *node;
 	if (nodeid == FUSE_ROOT_ID)
 		return;
-	pthread_mutex_lock(&f->lock);
 	node = get_node(f, nodeid);
 
 	/*
@@ -843,6 +1135,12 @@ static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
 		unhash_name(f, node);
 		unref_node(f, node);
 	}
+}
+
+static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
+{
+	pthread_mutex_lock(&f->lock);
+	forget_one(f, nodeid, nlookup);
 	pthread_mutex_unlock(&f->lock);
 }
 
@@ -863,6 +1161,8 @@ static void remove_node(struct fuse *f, fuse_ino_t dir, const char *name)
 	node = lookup_node(f, dir, name);
 	if (node != NULL)
 		unlink_node(f, node);
+	if (f->nodemap)
+		fuse_nodemap_remove(f->nodemap, dir, name);
 	pthread_mutex_unlock(&f->lock);
 }
 
@@ -897,6 +1197,14 @@ static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
 	if (hide)
 		node->is_hidden = 1;
 
+	if (f->nodemap) {
+		if (hide)
+			fuse_nodemap_remove(f->nodemap, olddir, oldname);
+		else
+			fuse_nodemap_add(f->nodemap, newdir, newname,
+					 node->nodeid, node->generation);
+	}
+
 out:
 	pthread_mutex_unlock(&f->lock);
 	return err;
@@ -1853,6 +2161,77 @@ int fuse_fs_poll(struct fuse_fs *fs, const char *path,
 		return -ENOSYS;
 }
 
+ssize_t fuse_fs_copy_file_range(struct fuse_fs *fs, const char *path_in,
+				struct fuse_file_info *fi_in, off_t off_in,
+				const char *path_out,
+				struct fuse_file_info *fi_out, off_t off_out,
+				size_t len, int flags)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.copy_file_range) {
+		if (fs->debug)
+			fprintf(stderr, "copy_file_range[%llu] %zu bytes from "
+				"%llu to [%llu] %llu flags: 0x%x\n",
+				(unsigned long long) fi_in->fh, len,
+				(unsigned long long) off_in,
+				(unsigned long long) fi_out->fh,
+				(unsigned long long) off_out, flags);
+
+		return fs->op.copy_file_range(path_in, fi_in, off_in,
+					      path_out, fi_out, off_out,
+					      len, flags);
+	} else
+		return -ENOSYS;
+}
+
+int fuse_fs_fallocate(struct fuse_fs *fs, const char *path, int mode,
+		      off_t offset, off_t length, struct fuse_file_info *fi)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.fallocate) {
+		if (fs->debug)
+			fprintf(stderr, "fallocate[%llu] mode: 0x%x "
+				"offset: %llu length: %llu\n",
+				(unsigned long long) fi->fh, mode,
+				(unsigned long long) offset,
+				(unsigned long long) length);
+
+		return fs->op.fallocate(path, mode, offset, length, fi);
+	} else
+		return -ENOSYS;
+}
+
+off_t fuse_fs_lseek(struct fuse_fs *fs, const char *path, off_t off,
+		    int whence, struct fuse_file_info *fi)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.lseek) {
+		if (fs->debug)
+			fprintf(stderr, "lseek[%llu] offset: %llu whence: %i\n",
+				(unsigned long long) fi->fh,
+				(unsigned long long) off, whence);
+
+		return fs->op.lseek(path, off, whence, fi);
+	} else
+		return -ENOSYS;
+}
+
+void fuse_fs_retrieve_reply(struct fuse_fs *fs, const char *path,
+			    void *cookie, off_t offset, const void *buf,
+			    size_t size)
+{
+	fuse_get_context()->private_data = fs->user_data;
+	if (fs->op.retrieve_reply) {
+		if (fs->debug)
+			fprintf(stderr, "retrieve_reply %s size: %llu "
+				"offset: %llu\n", path ? path : "-",
+				(unsigned long long) size,
+				(unsigned long long) offset);
+
+		fs->op.retrieve_reply(path, cookie, offset, buf, size);
+	}
+}
+
 static int is_open(struct fuse *f, fuse_ino_t dir, const char *name)
 {
 	struct node *node;
@@ -1959,15 +2338,42 @@ static void curr_time(struct timespec *now)
 
 static void update_stat(struct node *node, const struct stat *stbuf)
 {
-	if (node->cache_valid && (!mtime_eq(stbuf, &node->mtime) ||
-				  stbuf->st_size != node->size))
+	if (!mtime_eq(stbuf, &node->mtime) || stbuf->st_size != node->size) {
 		node->cache_valid = 0;
+		free(node->link);
+		node->link = NULL;
+	}
 	node->mtime.tv_sec = stbuf->st_mtime;
 	node->mtime.tv_nsec = ST_MTIM_NSEC(stbuf);
 	node->size = stbuf->st_size;
 	curr_time(&node->stat_updated);
 }
 
+/* Look up the node for a name whose attributes are already in e->attr */
+static int lookup_entry(struct fuse *f, fuse_ino_t nodeid, const char *name,
+			struct fuse_entry_param *e)
+{
+	struct node *node;
+
+	node = find_node(f, nodeid, name);
+	if (node == NULL)
+		return -ENOMEM;
+
+	e->ino = node->nodeid;
+	e->generation = node->generation;
+	e->entry_timeout = f->conf.entry_timeout;
+	e->attr_timeout = f->conf.attr_timeout;
+	if (f->conf.auto_cache || f->conf.readlink_cache) {
+		pthread_mutex_lock(&f->lock);
+		update_stat(node, &e->attr);
+		pthread_mutex_unlock(&f->lock);
+	}
+	set_stat(f, e->ino, &e->attr);
+	if (f->conf.debug)
+		fprintf(stderr, "   NODEID: %lu\n", (unsigned long) e->ino);
+	return 0;
+}
+
 static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
 		       const char *name, const char *path,
 		       struct fuse_entry_param *e, struct fuse_file_info *fi)
@@ -1979,39 +2385,30 @@ static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
 		res = fuse_fs_fgetattr(f->fs, path, &e->attr, fi);
 	else
 		res = fuse_fs_getattr(f->fs, path, &e->attr);
-	if (res == 0) {
-		struct node *node;
-
-		node = find_node(f, nodeid, name);
-		if (node == NULL)
-			res = -ENOMEM;
-		else {
-			e->ino = node->nodeid;
-			e->generation = node->generation;
-			e->entry_timeout = f->conf.entry_timeout;
-			e->attr_timeout = f->conf.attr_timeout;
-			if (f->conf.auto_cache) {
-				pthread_mutex_lock(&f->lock);
-				update_stat(node, &e->attr);
-				pthread_mutex_unlock(&f->lock);
-			}
-			set_stat(f, e->ino, &e->attr);
-			if (f->conf.debug)
-				fprintf(stderr, "   NODEID: %lu\n",
-					(unsigned long) e->ino);
-		}
-	}
+	if (res == 0)
+		res = lookup_entry(f, nodeid, name, e);
 	return res;
 }
 
-static struct fuse_context_i *fuse_get_context_internal(void)
+#ifdef HAVE_TLS
+/*
+ * Per-thread cache of the context registered under fuse_context_key.
+ * The generation guards against using a context that belonged to a
+ * key which has since been deleted.
+ */
+static __thread struct fuse_context_i *fuse_context_tls;
+static __thread unsigned int fuse_context_tls_gen;
+#endif
+static unsigned int fuse_context_gen;
+
+static struct fuse_context_i *fuse_get_context_slow(void)
 {
 	struct fuse_context_i *c;
 
 	c = (struct fuse_context_i *) pthread_getspecific(fuse_context_key);
 	if (c == NULL) {
 		c = (struct fuse_context_i *)
-			malloc(sizeof(struct fuse_context_i));
+			calloc(1, sizeof(struct fuse_context_i));
 		if (c == NULL) {
 			/* This is hard to deal with properly, so just
 			   abort.  If memory is so low that the
@@ -2022,11 +2419,29 @@ static struct fuse_context_i *fuse_get_context_internal(void)
 		}
 		pthread_setspecific(fuse_context_key, c);
 	}
+#ifdef HAVE_TLS
+	fuse_context_tls = c;
+	fuse_context_tls_gen = fuse_context_gen;
+#endif
 	return c;
 }
 
+static inline struct fuse_context_i *fuse_get_context_internal(void)
+{
+#ifdef HAVE_TLS
+	struct fuse_context_i *c = fuse_context_tls;
+	if (c != NULL && fuse_context_tls_gen == fuse_context_gen)
+		return c;
+#endif
+	return fuse_get_context_slow();
+}
+
 static void fuse_freecontext(void *data)
 {
+#ifdef HAVE_TLS
+	if (fuse_context_tls == data)
+		fuse_context_tls = NULL;
+#endif
 	free(data);
 }
 
@@ -2042,6 +2457,7 @@ static int fuse_create_context_key(void)
 			pthread_mutex_unlock(&fuse_context_lock);
 			return -1;
 		}
+		fuse_context_gen++;
 	}
 	fuse_context_ref++;
 	pthread_mutex_unlock(&fuse_context_lock);
@@ -2055,6 +2471,9 @@ static void fuse_delete_context_key(void)
 	if (!fuse_context_ref) {
 		free(pthread_getspecific(fuse_context_key));
 		pthread_key_delete(fuse_context_key);
+#ifdef HAVE_TLS
+		fuse_context_tls = NULL;
+#endif
 	}
 	pthread_mutex_unlock(&fuse_context_lock);
 }
@@ -2099,6 +2518,21 @@ void fuse_fs_init(struct fuse_fs *fs, struct fuse_conn_info *conn)
 		fs->user_data = fs->op.init(conn);
 }
 
+/*
+ * Opens can be left to the kernel if the filesystem keeps no per-open
+ * state and the library needs none either: the kernel then keeps the
+ * page cache and doesn't tell us which files are open, so unlinked
+ * files can't be hidden.
+ */
+static int fuse_can_skip_open(struct fuse *f, struct fuse_conn_info *conn)
+{
+	return (conn->capable & FUSE_CAP_NO_OPEN_SUPPORT) &&
+		!(conn->want & FUSE_CAP_ATOMIC_O_TRUNC) &&
+		!f->fs->op.open && !f->fs->op.release &&
+		f->conf.kernel_cache && !f->conf.auto_cache &&
+		!f->conf.direct_io && f->conf.hard_remove;
+}
+
 static void fuse_lib_init(void *data, struct fuse_conn_info *conn)
 {
 	struct fuse *f = (struct fuse *) data;
@@ -2108,6 +2542,9 @@ static void fuse_lib_init(void *data, struct fuse_conn_info *conn)
 	c->ctx.fuse = f;
 	conn->want |= FUSE_CAP_EXPORT_SUPPORT;
 	fuse_fs_init(f->fs, conn);
+	f->readdirplus = (conn->want & FUSE_CAP_READDIRPLUS) != 0;
+	f->writeback = (conn->want & FUSE_CAP_WRITEBACK_CACHE) != 0;
+	f->no_open = fuse_can_skip_open(f, conn);
 }
 
 void fuse_fs_destroy(struct fuse_fs *fs)
@@ -2199,6 +2636,24 @@ static void fuse_lib_forget(fuse_req_t req, fuse_ino_t ino,
 	fuse_reply_none(req);
 }
 
+static void fuse_lib_forget_multi(fuse_req_t req, size_t count,
+				  struct fuse_forget_data *forgets)
+{
+	struct fuse *f = req_fuse(req);
+	size_t i;
+
+	pthread_mutex_lock(&f->lock);
+	for (i = 0; i < count; i++) {
+		if (f->conf.debug)
+			fprintf(stderr, "FORGET %llu/%llu\n",
+				(unsigned long long) forgets[i].ino,
+				(unsigned long long) forgets[i].nlookup);
+		forget_one(f, forgets[i].ino, forgets[i].nlookup);
+	}
+	pthread_mutex_unlock(&f->lock);
+	fuse_reply_none(req);
+}
+
 static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
 			     struct fuse_file_info *fi)
 {
@@ -2224,7 +2679,7 @@ static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
 		free_path(f, ino, path);
 	}
 	if (!err) {
-		if (f->conf.auto_cache) {
+		if (f->conf.auto_cache || f->conf.readlink_cache) {
 			pthread_mutex_lock(&f->lock);
 			update_stat(get_node(f, ino), &buf);
 			pthread_mutex_unlock(&f->lock);
@@ -2330,7 +2785,7 @@ static void fuse_lib_setattr_x(fuse_req_t req, fuse_ino_t ino,
 		free_path(f, ino, path);
 	}
 	if (!err) {
-		if (f->conf.auto_cache) {
+		if (f->conf.auto_cache || f->conf.readlink_cache) {
 			pthread_mutex_lock(&f->lock);
 			update_stat(get_node(f, ino), &buf);
 			pthread_mutex_unlock(&f->lock);
@@ -2417,14 +2872,33 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 		}
 #else
 		if (!err &&
-		    (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) ==
-		    (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		    (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
 			struct timespec tv[2];
-			tv[0].tv_sec = attr->st_atime;
-			tv[0].tv_nsec = ST_ATIM_NSEC(attr);
-			tv[1].tv_sec = attr->st_mtime;
-			tv[1].tv_nsec = ST_MTIM_NSEC(attr);
-			err = fuse_fs_utimens(f->fs, path, tv);
+			struct stat *atp = attr;
+			struct stat *mtp = attr;
+
+			/* In writeback cache mode the kernel sets mtime
+			   alone, keep the other time as it is */
+			if (!(valid & FUSE_SET_ATTR_ATIME) ||
+			    !(valid & FUSE_SET_ATTR_MTIME)) {
+				if (fi)
+					err = fuse_fs_fgetattr(f->fs, path,
+							       &buf, fi);
+				else
+					err = fuse_fs_getattr(f->fs, path,
+							      &buf);
+				if (!(valid & FUSE_SET_ATTR_ATIME))
+					atp = &buf;
+				else
+					mtp = &buf;
+			}
+			if (!err) {
+				tv[0].tv_sec = atp->st_atime;
+				tv[0].tv_nsec = ST_ATIM_NSEC(atp);
+				tv[1].tv_sec = mtp->st_mtime;
+				tv[1].tv_nsec = ST_MTIM_NSEC(mtp);
+				err = fuse_fs_utimens(f->fs, path, tv);
+			}
 		}
 #endif /* __APPLE__ */
 		if (!err)
@@ -2433,7 +2907,7 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 		free_path(f, ino, path);
 	}
 	if (!err) {
-		if (f->conf.auto_cache) {
+		if (f->conf.auto_cache || f->conf.readlink_cache) {
 			pthread_mutex_lock(&f->lock);
 			update_stat(get_node(f, ino), &buf);
 			pthread_mutex_unlock(&f->lock);
@@ -2462,13 +2936,64 @@ static void fuse_lib_access(fuse_req_t req, fuse_ino_t ino, int mask)
 	reply_err(req, err);
 }
 
+/*
+ * Symlink targets are remembered in the node, together with the
+ * modification time and size the node had when the target was read.
+ * update_stat() drops the target if either changes, and unhash_name()
+ * drops it when the node is renamed or removed.
+ */
+static int readlink_cached(struct fuse *f, fuse_ino_t ino, char *buf,
+			   struct timespec *mtime, off_t *size)
+{
+	struct node *node;
+	int found = 0;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	if (node->link) {
+		strcpy(buf, node->link);
+		f->readlink_hits++;
+		found = 1;
+	} else {
+		*mtime = node->mtime;
+		*size = node->size;
+		f->readlink_misses++;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return found;
+}
+
+static void readlink_store(struct fuse *f, fuse_ino_t ino, const char *link,
+			   const struct timespec *mtime, off_t size)
+{
+	struct node *node;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	/* Don't store a target that was read while the node changed */
+	if (node->link == NULL && node->size == size &&
+	    node->mtime.tv_sec == mtime->tv_sec &&
+	    node->mtime.tv_nsec == mtime->tv_nsec)
+		node->link = strdup(link);
+	pthread_mutex_unlock(&f->lock);
+}
+
 static void fuse_lib_readlink(fuse_req_t req, fuse_ino_t ino)
 {
 	struct fuse *f = req_fuse_prepare(req);
 	char linkname[PATH_MAX + 1];
+	struct timespec mtime = { 0, 0 };
+	off_t size = 0;
 	char *path;
 	int err;
 
+	if (f->conf.readlink_cache &&
+	    readlink_cached(f, ino, linkname, &mtime, &size)) {
+		fuse_reply_readlink(req, linkname);
+		return;
+	}
+
 	err = get_path(f, ino, &path);
 	if (!err) {
 		struct fuse_intr_data d;
@@ -2479,6 +3004,8 @@ static void fuse_lib_readlink(fuse_req_t req, fuse_ino_t ino)
 	}
 	if (!err) {
 		linkname[PATH_MAX] = '\0';
+		if (f->conf.readlink_cache)
+			readlink_store(f, ino, linkname, &mtime, size);
 		fuse_reply_readlink(req, linkname);
 	} else
 		reply_err(req, err);
@@ -2813,6 +3340,35 @@ static void fuse_do_release(struct fuse *f, fuse_ino_t ino, const char *path,
 		fuse_fs_unlink(f->fs, path);
 }
 
+/*
+ * In writeback cache mode the kernel also reads through handles opened
+ * for writing only, to fill partially written pages, and it computes the
+ * offset of appending writes itself.
+ */
+static int writeback_open(struct fuse *f, const char *path, mode_t mode,
+			  struct fuse_file_info *fi, int create)
+{
+	int accmode = fi->flags & O_ACCMODE;
+	int err;
+
+	fi->flags &= ~O_APPEND;
+	if (accmode == O_WRONLY)
+		fi->flags = (fi->flags & ~O_ACCMODE) | O_RDWR;
+
+	for (;;) {
+		if (create)
+			err = fuse_fs_create(f->fs, path, mode, fi);
+		else
+			err = fuse_fs_open(f->fs, path, fi);
+
+		/* Reads on an unreadable file will fail instead */
+		if (err != -EACCES || (fi->flags & O_ACCMODE) == accmode)
+			break;
+		fi->flags = (fi->flags & ~O_ACCMODE) | accmode;
+	}
+	return err;
+}
+
 static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
 			    const char *name, mode_t mode,
 			    struct fuse_file_info *fi)
@@ -2826,7 +3382,10 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
 	err = get_path_name(f, parent, name, &path);
 	if (!err) {
 		fuse_prepare_interrupt(f, req, &d);
-		err = fuse_fs_create(f->fs, path, mode, fi);
+		if (f->writeback)
+			err = writeback_open(f, path, mode, fi, 1);
+		else
+			err = fuse_fs_create(f->fs, path, mode, fi);
 		if (!err) {
 			err = lookup_path(f, parent, name, path, &e, fi);
 			if (err)
@@ -2923,10 +3482,19 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
 	char *path;
 	int err;
 
+	if (f->no_open) {
+		/* Succeeds, and the kernel stops sending open requests */
+		reply_err(req, -ENOSYS);
+		return;
+	}
+
 	err = get_path(f, ino, &path);
 	if (!err) {
 		fuse_prepare_interrupt(f, req, &d);
-		err = fuse_fs_open(f->fs, path, fi);
+		if (f->writeback)
+			err = writeback_open(f, path, 0, fi, 0);
+		else
+			err = fuse_fs_open(f->fs, path, fi);
 		if (!err) {
 			if (f->conf.direct_io)
 				fi->direct_io = 1;
@@ -2939,8 +3507,19 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
 		fuse_finish_interrupt(f, req, &d);
 	}
 	if (!err) {
+		struct node *node;
+
 		pthread_mutex_lock(&f->lock);
-		get_node(f, ino)->open_count++;
+		node = get_node(f, ino);
+		node->open_count++;
+		/* Don't throw away what fuse_notify_store() put there */
+		if (node->stored) {
+			node->stored = 0;
+			fi->keep_cache = 1;
+#ifdef __APPLE__
+			fi->purge_ubc = 0;
+#endif /* __APPLE__ */
+		}
 		pthread_mutex_unlock(&f->lock);
 		if (fuse_reply_open(req, fi) == -ENOENT) {
 			/* The open syscall was interrupted, so it
@@ -2987,6 +3566,29 @@ static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	free(buf);
 }
 
+/*
+ * Data written back from the page cache is already in the cache, so
+ * record the new mtime and size without invalidating it.  Otherwise the
+ * next open would take our own write for an external change.
+ */
+static void writepage_update_stat(struct fuse *f, fuse_ino_t ino,
+				  const char *path, struct fuse_file_info *fi)
+{
+	struct stat stbuf;
+	struct node *node;
+
+	if (fuse_fs_fgetattr(f->fs, path, &stbuf, fi) != 0)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node(f, ino);
+	node->mtime.tv_sec = stbuf.st_mtime;
+	node->mtime.tv_nsec = ST_MTIM_NSEC(&stbuf);
+	node->size = stbuf.st_size;
+	curr_time(&node->stat_updated);
+	pthread_mutex_unlock(&f->lock);
+}
+
 static void fuse_lib_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 			   size_t size, off_t off, struct fuse_file_info *fi)
 {
@@ -3000,6 +3602,8 @@ static void fuse_lib_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 
 		fuse_prepare_interrupt(f, req, &d);
 		res = fuse_fs_write(f->fs, path, buf, size, off, fi);
+		if (res > 0 && fi->writepage && f->conf.auto_cache)
+			writepage_update_stat(f, ino, path, fi);
 		fuse_finish_interrupt(f, req, &d);
 		free_path(f, ino, path);
 	}
@@ -3010,8 +3614,97 @@ static void fuse_lib_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
 		reply_err(req, res);
 }
 
-static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
-			   struct fuse_file_info *fi)
+static void fuse_lib_copy_file_range(fuse_req_t req, fuse_ino_t nodeid_in,
+				     off_t off_in, struct fuse_file_info *fi_in,
+				     fuse_ino_t nodeid_out, off_t off_out,
+				     struct fuse_file_info *fi_out, size_t len,
+				     int flags)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	struct fuse_intr_data d;
+	char *path_in, *path_out;
+	ssize_t res;
+
+	res = get_path2(f, nodeid_in, NULL, nodeid_out, NULL,
+			&path_in, &path_out, NULL, NULL);
+	if (res) {
+		reply_err(req, res);
+		return;
+	}
+
+	fuse_prepare_interrupt(f, req, &d);
+	res = fuse_fs_copy_file_range(f->fs, path_in, fi_in, off_in, path_out,
+				      fi_out, off_out, len, flags);
+	fuse_finish_interrupt(f, req, &d);
+	free_path2(f, nodeid_in, nodeid_out, NULL, NULL, path_in, path_out);
+
+	if (res >= 0)
+		fuse_reply_write(req, res);
+	else
+		reply_err(req, res);
+}
+
+static void fuse_lib_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+			       off_t offset, off_t length,
+			       struct fuse_file_info *fi)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	char *path;
+	int err;
+
+	err = get_path_nullok(f, ino, &path);
+	if (!err) {
+		struct fuse_intr_data d;
+
+		fuse_prepare_interrupt(f, req, &d);
+		err = fuse_fs_fallocate(f->fs, path, mode, offset, length, fi);
+		fuse_finish_interrupt(f, req, &d);
+		free_path(f, ino, path);
+	}
+	reply_err(req, err);
+}
+
+static void fuse_lib_lseek(fuse_req_t req, fuse_ino_t ino, off_t off,
+			   int whence, struct fuse_file_info *fi)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	char *path;
+	off_t res;
+
+	res = get_path_nullok(f, ino, &path);
+	if (res == 0) {
+		struct fuse_intr_data d;
+
+		fuse_prepare_interrupt(f, req, &d);
+		res = fuse_fs_lseek(f->fs, path, off, whence, fi);
+		fuse_finish_interrupt(f, req, &d);
+		free_path(f, ino, path);
+	}
+
+	if (res >= 0)
+		fuse_reply_lseek(req, res);
+	else
+		reply_err(req, res);
+}
+
+static void fuse_lib_retrieve_reply(fuse_req_t req, void *cookie,
+				    fuse_ino_t ino, off_t offset,
+				    const void *buf, size_t size)
+{
+	struct fuse *f = req_fuse_prepare(req);
+	char *path;
+	int err;
+
+	err = get_path(f, ino, &path);
+	fuse_fs_retrieve_reply(f->fs, err ? NULL : path, cookie, offset, buf,
+			       size);
+	if (!err)
+		free_path(f, ino, path);
+	fuse_reply_none(req);
+}
+
+static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			   struct fuse_file_info *fi)
 {
 	struct fuse *f = req_fuse_prepare(req);
 	char *path;
@@ -3075,12 +3768,18 @@ static void fuse_lib_opendir(fuse_req_t req, fuse_ino_t ino,
 		dh->fh = fi.fh;
 	}
 	if (!err) {
+		pthread_mutex_lock(&f->lock);
+		f->open_dirs++;
+		pthread_mutex_unlock(&f->lock);
 		if (fuse_reply_open(req, llfi) == -ENOENT) {
 			/* The opendir syscall was interrupted, so it
 			   must be cancelled */
 			fuse_prepare_interrupt(f, req, &d);
 			fuse_fs_releasedir(f->fs, path, &fi);
 			fuse_finish_interrupt(f, req, &d);
+			pthread_mutex_lock(&f->lock);
+			f->open_dirs--;
+			pthread_mutex_unlock(&f->lock);
 			pthread_mutex_destroy(&dh->lock);
 			free(dh);
 		}
@@ -3117,6 +3816,76 @@ static int extend_contents(struct fuse_dh *dh, unsigned minsize)
 	return 0;
 }
 
+static void free_dh_entries(struct fuse_dh *dh)
+{
+	unsigned i;
+
+	for (i = 0; i < dh->nentries; i++)
+		free(dh->entries[i].name);
+	dh->nentries = 0;
+}
+
+static int add_dh_entry(struct fuse_dh *dh, const char *name,
+			const struct stat *stbuf, const struct stat *statp)
+{
+	struct fuse_dh_entry *de;
+
+	if (dh->nentries == dh->entries_size) {
+		unsigned newsize = dh->entries_size ? dh->entries_size * 2 : 64;
+
+		de = realloc(dh->entries, newsize * sizeof(*de));
+		if (de == NULL) {
+			dh->error = -ENOMEM;
+			return -1;
+		}
+		dh->entries = de;
+		dh->entries_size = newsize;
+	}
+
+	de = &dh->entries[dh->nentries];
+	de->name = strdup(name);
+	if (de->name == NULL) {
+		dh->error = -ENOMEM;
+		return -1;
+	}
+	de->off = dh->len;
+	de->stat = *stbuf;
+	de->attr_ino = statp ? statp->st_ino : 0;
+	de->attr_valid = statp && statp->st_nlink;
+	dh->nentries++;
+	return 0;
+}
+
+static int is_dot_or_dotdot(const char *name)
+{
+	return name[0] == '.' &&
+		(name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/*
+ * Entry parameters for readdirplus.  Only attributes that look like
+ * they came from a real stat (st_nlink is set) are passed on, for other
+ * entries the kernel will send a lookup as usual.
+ */
+static int plus_entry(struct fuse_dh *dh, const char *name,
+		      const struct stat *stbuf, ino_t attr_ino, int attr_valid,
+		      struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->attr = *stbuf;
+	if (attr_valid && !is_dot_or_dotdot(name)) {
+		int err;
+
+		e->attr.st_ino = attr_ino;
+		err = lookup_entry(dh->fuse, dh->nodeid, name, e);
+		if (err) {
+			dh->error = err;
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 		    off_t off)
 {
@@ -3148,17 +3917,38 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
 			return 1;
 
 		dh->filled = 0;
-		newlen = dh->len +
-			fuse_add_direntry(dh->req, dh->contents + dh->len,
-					  dh->needlen - dh->len, name,
-					  &stbuf, off);
-		if (newlen > dh->needlen)
-			return 1;
+		if (dh->plus) {
+			struct fuse_entry_param e;
+
+			newlen = dh->len +
+				fuse_add_direntry_plus(dh->req, NULL, 0, name,
+						       NULL, 0);
+			if (newlen > dh->needlen)
+				return 1;
+			if (plus_entry(dh, name, &stbuf,
+				       statp ? statp->st_ino : 0,
+				       statp && statp->st_nlink, &e) == -1)
+				return 1;
+			fuse_add_direntry_plus(dh->req, dh->contents + dh->len,
+					       dh->needlen - dh->len, name,
+					       &e, off);
+		} else {
+			newlen = dh->len +
+				fuse_add_direntry(dh->req,
+						  dh->contents + dh->len,
+						  dh->needlen - dh->len, name,
+						  &stbuf, off);
+			if (newlen > dh->needlen)
+				return 1;
+		}
 	} else {
 		newlen = dh->len +
 			fuse_add_direntry(dh->req, NULL, 0, name, NULL, 0);
 		if (extend_contents(dh, newlen) == -1)
 			return 1;
+		if (dh->fuse->readdirplus &&
+		    add_dh_entry(dh, name, &stbuf, statp) == -1)
+			return 1;
 
 		fuse_add_direntry(dh->req, dh->contents + dh->len,
 				  dh->size - dh->len, name, &stbuf, newlen);
@@ -3183,6 +3973,7 @@ static int readdir_fill(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
 		dh->needlen = size;
 		dh->filled = 1;
 		dh->req = req;
+		free_dh_entries(dh);
 		fuse_prepare_interrupt(f, req, &d);
 		err = fuse_fs_readdir(f->fs, path, dh, fill_dir, off, fi);
 		fuse_finish_interrupt(f, req, &d);
@@ -3196,8 +3987,63 @@ static int readdir_fill(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
 	return err;
 }
 
-static void fuse_lib_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-			     off_t off, struct fuse_file_info *llfi)
+/*
+ * Reply to readdirplus from the buffered directory.  Offsets are those
+ * of the plain directory entries, so readdir and readdirplus can be
+ * mixed on the same handle.
+ */
+static void readdirplus_buffered(fuse_req_t req, struct fuse_dh *dh,
+				 size_t size, off_t off)
+{
+	unsigned lo = 0;
+	unsigned hi = dh->nentries;
+	unsigned i;
+	size_t len = 0;
+	char *buf;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (dh->entries[mid].off < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		reply_err(req, -ENOMEM);
+		return;
+	}
+
+	for (i = lo; i < dh->nentries; i++) {
+		struct fuse_dh_entry *de = &dh->entries[i];
+		off_t next = i + 1 < dh->nentries ?
+			dh->entries[i + 1].off : dh->len;
+		struct fuse_entry_param e;
+		size_t entlen;
+
+		entlen = fuse_add_direntry_plus(req, NULL, 0, de->name, NULL, 0);
+		if (len + entlen > size)
+			break;
+		if (plus_entry(dh, de->name, &de->stat, de->attr_ino,
+			       de->attr_valid, &e) == -1) {
+			if (!len) {
+				free(buf);
+				reply_err(req, dh->error);
+				return;
+			}
+			break;
+		}
+		fuse_add_direntry_plus(req, buf + len, size - len, de->name,
+				       &e, next);
+		len += entlen;
+	}
+	fuse_reply_buf(req, buf, len);
+	free(buf);
+}
+
+static void readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
+			   off_t off, struct fuse_file_info *llfi, int plus)
 {
 	struct fuse *f = req_fuse_prepare(req);
 	struct fuse_file_info fi;
@@ -3210,13 +4056,21 @@ static void fuse_lib_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 		dh->filled = 0;
 
 	if (!dh->filled) {
-		int err = readdir_fill(f, req, ino, size, off, dh, &fi);
+		int err;
+
+		dh->plus = plus;
+		err = readdir_fill(f, req, ino, size, off, dh, &fi);
+		dh->plus = 0;
 		if (err) {
 			reply_err(req, err);
 			goto out;
 		}
 	}
 	if (dh->filled) {
+		if (plus) {
+			readdirplus_buffered(req, dh, size, off);
+			goto out;
+		}
 		if (off < dh->len) {
 			if (off + size > dh->len)
 				size = dh->len - off;
@@ -3231,6 +4085,18 @@ out:
 	pthread_mutex_unlock(&dh->lock);
 }
 
+static void fuse_lib_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t off, struct fuse_file_info *llfi)
+{
+	readdir_common(req, ino, size, off, llfi, 0);
+}
+
+static void fuse_lib_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+				 off_t off, struct fuse_file_info *llfi)
+{
+	readdir_common(req, ino, size, off, llfi, 1);
+}
+
 static void fuse_lib_releasedir(fuse_req_t req, fuse_ino_t ino,
 				struct fuse_file_info *llfi)
 {
@@ -3246,9 +4112,15 @@ static void fuse_lib_releasedir(fuse_req_t req, fuse_ino_t ino,
 	fuse_finish_interrupt(f, req, &d);
 	free_path(f, ino, path);
 
+	pthread_mutex_lock(&f->lock);
+	f->open_dirs--;
+	pthread_mutex_unlock(&f->lock);
+
 	pthread_mutex_lock(&dh->lock);
 	pthread_mutex_unlock(&dh->lock);
 	pthread_mutex_destroy(&dh->lock);
+	free_dh_entries(dh);
+	free(dh->entries);
 	free(dh->contents);
 	free(dh);
 	reply_err(req, 0);
@@ -3454,103 +4326,230 @@ static void fuse_lib_removexattr(fuse_req_t req, fuse_ino_t ino,
 	reply_err(req, err);
 }
 
-static struct lock *locks_conflict(struct node *node, const struct lock *lock)
+/*
+ * The POSIX locks of a node are kept in a treap ordered by start offset,
+ * with each lock also recording the largest end offset in its subtree.
+ * Conflict checks and the lookup of an owner's neighbouring locks can
+ * then skip every subtree that ends before the range of interest.
+ */
+static unsigned int lock_prio(const struct lock *l)
+{
+	return (unsigned int) ((uintptr_t) l >> 4) * 2654435761U;
+}
+
+static int lock_less(const struct lock *a, const struct lock *b)
+{
+	if (a->start != b->start)
+		return a->start < b->start;
+	return (uintptr_t) a < (uintptr_t) b;
+}
+
+static void lock_update(struct lock *l)
+{
+	l->max_end = l->end;
+	if (l->left && l->left->max_end > l->max_end)
+		l->max_end = l->left->max_end;
+	if (l->right && l->right->max_end > l->max_end)
+		l->max_end = l->right->max_end;
+}
+
+static struct lock *lock_tree_insert(struct lock *t, struct lock *lock)
 {
 	struct lock *l;
 
-	for (l = node->locks; l; l = l->next)
-		if (l->owner != lock->owner &&
-		    lock->start <= l->end && l->start <= lock->end &&
-		    (l->type == F_WRLCK || lock->type == F_WRLCK))
-			break;
+	if (t == NULL) {
+		lock->left = lock->right = NULL;
+		lock->max_end = lock->end;
+		return lock;
+	}
+	if (lock_less(lock, t)) {
+		t->left = lock_tree_insert(t->left, lock);
+		if (lock_prio(t->left) > lock_prio(t)) {
+			l = t->left;
+			t->left = l->right;
+			l->right = t;
+			lock_update(t);
+			t = l;
+		}
+	} else {
+		t->right = lock_tree_insert(t->right, lock);
+		if (lock_prio(t->right) > lock_prio(t)) {
+			l = t->right;
+			t->right = l->left;
+			l->left = t;
+			lock_update(t);
+			t = l;
+		}
+	}
+	lock_update(t);
+	return t;
+}
 
-	return l;
+static struct lock *lock_tree_join(struct lock *a, struct lock *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (lock_prio(a) > lock_prio(b)) {
+		a->right = lock_tree_join(a->right, b);
+		lock_update(a);
+		return a;
+	} else {
+		b->left = lock_tree_join(a, b->left);
+		lock_update(b);
+		return b;
+	}
 }
 
-static void delete_lock(struct lock **lockp)
+static struct lock *lock_tree_remove(struct lock *t, struct lock *lock)
 {
-	struct lock *l = *lockp;
-	*lockp = l->next;
-	free(l);
+	if (t == lock)
+		return lock_tree_join(t->left, t->right);
+	if (lock_less(lock, t))
+		t->left = lock_tree_remove(t->left, lock);
+	else
+		t->right = lock_tree_remove(t->right, lock);
+	lock_update(t);
+	return t;
 }
 
-static void insert_lock(struct lock **pos, struct lock *lock)
+static struct lock *lock_tree_conflict(struct lock *t, const struct lock *lock)
 {
-	lock->next = *pos;
-	*pos = lock;
+	struct lock *l;
+
+	if (t == NULL || t->max_end < lock->start)
+		return NULL;
+	l = lock_tree_conflict(t->left, lock);
+	if (l != NULL || lock->end < t->start)
+		return l;
+	if (t->owner != lock->owner && lock->start <= t->end &&
+	    (t->type == F_WRLCK || lock->type == F_WRLCK))
+		return t;
+	return lock_tree_conflict(t->right, lock);
 }
 
-static int locks_insert(struct node *node, struct lock *lock)
+/*
+ * Collect the locks of the same owner which are merged with (same type,
+ * overlapping or adjacent) or overridden by (other type, overlapping)
+ * the new lock.
+ */
+static void lock_tree_collect(struct lock *t, const struct lock *lock,
+			      struct lock **list)
 {
-	struct lock **lp;
-	struct lock *newl1 = NULL;
-	struct lock *newl2 = NULL;
+	if (t == NULL || t->max_end < lock->start - 1)
+		return;
+	lock_tree_collect(t->left, lock, list);
+	if (lock->end < t->start - 1)
+		return;
+	if (t->owner == lock->owner && lock->start - 1 <= t->end &&
+	    (t->type == lock->type ||
+	     (lock->start <= t->end && t->start <= lock->end))) {
+		t->next = *list;
+		*list = t;
+	}
+	lock_tree_collect(t->right, lock, list);
+}
 
-	if (lock->type != F_UNLCK || lock->start != 0 ||
-	    lock->end != OFFSET_MAX) {
-		newl1 = malloc(sizeof(struct lock));
-		newl2 = malloc(sizeof(struct lock));
+static struct lock *locks_conflict(struct node *node, const struct lock *lock)
+{
+	return lock_tree_conflict(node->locks, lock);
+}
 
-		if (!newl1 || !newl2) {
-			free(newl1);
-			free(newl2);
-			return -ENOLCK;
+static struct lock *get_lock(struct lock **spare, struct lock **alloc)
+{
+	struct lock *l = *spare ? *spare : *alloc;
+
+	if (l == *spare)
+		*spare = l->next;
+	else
+		*alloc = l->next;
+	return l;
+}
+
+static int locks_insert(struct node *node, struct lock *lock)
+{
+	const off_t start = lock->start;
+	const off_t end = lock->end;
+	struct lock *list = NULL;
+	struct lock *spare = NULL;
+	struct lock *alloc = NULL;
+	struct lock *next;
+	struct lock *l;
+	int need = lock->type != F_UNLCK;
+	int reusable = 0;
+
+	lock_tree_collect(node->locks, lock, &list);
+	for (l = list; l; l = l->next) {
+		if (l->type == lock->type) {
+			if (l->start <= start && end <= l->end)
+				return 0;
+			reusable++;
+		} else if (start <= l->start && l->end <= end) {
+			reusable++;
+		} else if (l->start < start && end < l->end) {
+			need++;
 		}
 	}
 
-	for (lp = &node->locks; *lp;) {
-		struct lock *l = *lp;
-		if (l->owner != lock->owner)
-			goto skip;
+	/* Only allocate what cannot be taken from the replaced locks */
+	for (; need > reusable; need--) {
+		l = malloc(sizeof(struct lock));
+		if (l == NULL) {
+			while (alloc) {
+				l = alloc;
+				alloc = l->next;
+				free(l);
+			}
+			return -ENOLCK;
+		}
+		l->next = alloc;
+		alloc = l;
+	}
 
-		if (lock->type == l->type) {
-			if (l->end < lock->start - 1)
-				goto skip;
-			if (lock->end < l->start - 1)
-				break;
-			if (l->start <= lock->start && lock->end <= l->end)
-				goto out;
+	for (l = list; l; l = next) {
+		next = l->next;
+		node->locks = lock_tree_remove(node->locks, l);
+		if (l->type == lock->type) {
 			if (l->start < lock->start)
 				lock->start = l->start;
 			if (lock->end < l->end)
 				lock->end = l->end;
-			goto delete;
+		} else if (start <= l->start && l->end <= end) {
+			/* fully overridden */
 		} else {
-			if (l->end < lock->start)
-				goto skip;
-			if (lock->end < l->start)
-				break;
-			if (lock->start <= l->start && l->end <= lock->end)
-				goto delete;
-			if (l->end <= lock->end) {
-				l->end = lock->start - 1;
-				goto skip;
-			}
-			if (lock->start <= l->start) {
-				l->start = lock->end + 1;
-				break;
+			if (end < l->end) {
+				struct lock *r = l;
+
+				if (l->start < start) {
+					r = get_lock(&spare, &alloc);
+					*r = *l;
+					l->end = start - 1;
+					node->locks = lock_tree_insert(node->locks, l);
+				}
+				r->start = end + 1;
+				node->locks = lock_tree_insert(node->locks, r);
+			} else {
+				l->end = start - 1;
+				node->locks = lock_tree_insert(node->locks, l);
 			}
-			*newl2 = *l;
-			newl2->start = lock->end + 1;
-			l->end = lock->start - 1;
-			insert_lock(&l->next, newl2);
-			newl2 = NULL;
+			continue;
 		}
-	skip:
-		lp = &l->next;
-		continue;
-
-	delete:
-		delete_lock(lp);
+		l->next = spare;
+		spare = l;
 	}
+
 	if (lock->type != F_UNLCK) {
-		*newl1 = *lock;
-		insert_lock(lp, newl1);
-		newl1 = NULL;
+		l = get_lock(&spare, &alloc);
+		*l = *lock;
+		node->locks = lock_tree_insert(node->locks, l);
+	}
+
+	while (spare) {
+		l = spare;
+		spare = l->next;
+		free(l);
 	}
-out:
-	free(newl1);
-	free(newl2);
 	return 0;
 }
 
@@ -3727,12 +4726,13 @@ static void fuse_lib_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
 }
 
 static void fuse_lib_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
-			   struct fuse_file_info *fi, unsigned int flags,
+			   struct fuse_file_info *llfi, unsigned int flags,
 			   const void *in_buf, size_t in_bufsz,
 			   size_t out_bufsz)
 {
 	struct fuse *f = req_fuse_prepare(req);
 	struct fuse_intr_data d;
+	struct fuse_file_info fi;
 	char *path, *out_buf = NULL;
 	int err;
 
@@ -3740,6 +4740,11 @@ static void fuse_lib_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
 	if (flags & FUSE_IOCTL_UNRESTRICTED)
 		goto err;
 
+	if (flags & FUSE_IOCTL_DIR)
+		get_dirhandle(llfi, &fi);
+	else
+		fi = *llfi;
+
 	if (out_bufsz) {
 		err = -ENOMEM;
 		out_buf = malloc(out_bufsz);
@@ -3757,7 +4762,7 @@ static void fuse_lib_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
 
 	fuse_prepare_interrupt(f, req, &d);
 
-	err = fuse_fs_ioctl(f->fs, path, cmd, arg, fi, flags,
+	err = fuse_fs_ioctl(f->fs, path, cmd, arg, &fi, flags,
 			    out_buf ?: (void *)in_buf);
 
 	fuse_finish_interrupt(f, req, &d);
@@ -3836,7 +4841,12 @@ static struct fuse_lowlevel_ops fuse_path_ops = {
 	.getxtimes = fuse_lib_getxtimes,
 	.setattr_x = fuse_lib_setattr_x,
 #endif
-
+	.forget_multi = fuse_lib_forget_multi,
+	.readdirplus = fuse_lib_readdirplus,
+	.copy_file_range = fuse_lib_copy_file_range,
+	.fallocate = fuse_lib_fallocate,
+	.lseek = fuse_lib_lseek,
+	.retrieve_reply = fuse_lib_retrieve_reply,
 };
 
 int fuse_notify_poll(struct fuse_pollhandle *ph)
@@ -3916,6 +4926,75 @@ int fuse_invalidate(struct fuse *f, const char *path)
 	return -EINVAL;
 }
 
+static int lookup_path_nodeid(struct fuse *f, const char *path,
+			      fuse_ino_t *nodeid)
+{
+	char *tmp;
+	char *name;
+	char *saveptr;
+	int err = 0;
+
+	tmp = strdup(path);
+	if (tmp == NULL)
+		return -ENOMEM;
+
+	*nodeid = FUSE_ROOT_ID;
+	pthread_mutex_lock(&f->lock);
+	for (name = strtok_r(tmp, "/", &saveptr); name != NULL;
+	     name = strtok_r(NULL, "/", &saveptr)) {
+		struct node *node = lookup_node(f, *nodeid, name);
+		if (node == NULL) {
+			err = -ENOENT;
+			break;
+		}
+		*nodeid = node->nodeid;
+	}
+	pthread_mutex_unlock(&f->lock);
+	free(tmp);
+
+	return err;
+}
+
+int fuse_notify_store(struct fuse *f, const char *path, off_t offset,
+		      const void *buf, size_t size)
+{
+	struct fuse_chan *ch = fuse_session_next_chan(f->se, NULL);
+	struct node *node;
+	fuse_ino_t nodeid;
+	int err;
+
+	err = lookup_path_nodeid(f, path, &nodeid);
+	if (err)
+		return err;
+
+	err = fuse_lowlevel_notify_store(ch, nodeid, offset, buf, size);
+	if (err)
+		return err;
+
+	pthread_mutex_lock(&f->lock);
+	node = get_node_nocheck(f, nodeid);
+	if (node != NULL)
+		node->stored = 1;
+	pthread_mutex_unlock(&f->lock);
+
+	return 0;
+}
+
+int fuse_notify_retrieve(struct fuse *f, const char *path, size_t size,
+			 off_t offset, void *cookie)
+{
+	struct fuse_chan *ch = fuse_session_next_chan(f->se, NULL);
+	fuse_ino_t nodeid;
+	int err;
+
+	err = lookup_path_nodeid(f, path, &nodeid);
+	if (err)
+		return err;
+
+	return fuse_lowlevel_notify_retrieve(ch, nodeid, size, offset,
+					     cookie);
+}
+
 void fuse_exit(struct fuse *f)
 {
 	fuse_session_exit(f->se);
@@ -3941,18 +5020,24 @@ FUSE_SYMVER(".symver fuse_get_context_compat22,fuse_get_context@FUSE_2.2");
 int fuse_getgroups(int size, gid_t list[])
 {
 	fuse_req_t req = fuse_get_context_internal()->req;
+	/* Not called on behalf of a request, e.g. from a module's thread */
+	if (!req)
+		return -ENOSYS;
 	return fuse_req_getgroups(req, size, list);
 }
 
 int fuse_interrupted(void)
 {
-	return fuse_req_interrupted(fuse_get_context_internal()->req);
+	fuse_req_t req = fuse_get_context_internal()->req;
+	if (!req)
+		return 0;
+	return fuse_req_interrupted(req);
 }
 
 void fuse_set_getcontext_func(struct fuse_context *(*func)(void))
 {
 	(void) func;
-	/* no-op */
+	/* no-op: the context is always the library's own per-thread one */
 }
 
 enum {
@@ -3975,6 +5060,11 @@ static const struct fuse_opt fuse_lib_opts[] = {
 	FUSE_LIB_OPT("kernel_cache",	      kernel_cache, 1),
 	FUSE_LIB_OPT("auto_cache",	      auto_cache, 1),
 	FUSE_LIB_OPT("noauto_cache",	      auto_cache, 0),
+	FUSE_LIB_OPT("readlink_cache",	      readlink_cache, 1),
+	FUSE_LIB_OPT("noreadlink_cache",      readlink_cache, 0),
+	FUSE_LIB_OPT("nodeid64",	      nodeid64, 1),
+	FUSE_LIB_OPT("node_cache_max=%u",     node_cache_max, 0),
+	FUSE_LIB_OPT("nodemap=%s",	      nodemap, 0),
 	FUSE_LIB_OPT("umask=",		      set_mode, 1),
 	FUSE_LIB_OPT("umask=%o",	      umask, 0),
 	FUSE_LIB_OPT("uid=",		      set_uid, 1),
@@ -4002,6 +5092,10 @@ static void fuse_lib_help(void)
 "    -o direct_io           use direct I/O\n"
 "    -o kernel_cache        cache files in kernel\n"
 "    -o [no]auto_cache      enable caching based on modification times (off)\n"
+"    -o [no]readlink_cache  cache symlink targets (off)\n"
+"    -o nodeid64            use 64-bit node IDs, never reused\n"
+"    -o node_cache_max=N    evict unused nodes beyond N (unlimited)\n"
+"    -o nodemap=FILE        keep node IDs for names in FILE across mounts\n"
 "    -o umask=M             set file permissions (octal)\n"
 "    -o uid=N               set file owner\n"
 "    -o gid=N               set file group\n"
@@ -4108,6 +5202,8 @@ static int fuse_push_module(struct fuse *f, const char *module,
 	newfs->m = m;
 	f->fs = newfs;
 	f->nullpath_ok = newfs->op.flag_nullpath_ok && f->nullpath_ok;
+	if (newfs->op.flag_private_fh)
+		f->private_fh = 1;
 	return 0;
 }
 
@@ -4161,6 +5257,7 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 	fs->compat = compat;
 	f->fs = fs;
 	f->nullpath_ok = fs->op.flag_nullpath_ok;
+	f->private_fh = fs->op.flag_private_fh;
 
 	/* Oh f**k, this is ugly! */
 	if (!fs->op.lock) {
@@ -4195,6 +5292,11 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 	if (!f->conf.ac_attr_timeout_set)
 		f->conf.ac_attr_timeout = f->conf.attr_timeout;
 
+	if (f->conf.nodeid64 && sizeof(fuse_ino_t) < sizeof(uint64_t)) {
+		fprintf(stderr, "fuse: nodeid64 needs a 64-bit fuse_ino_t\n");
+		goto out_free_fs;
+	}
+
 #if ( __FreeBSD__ || __APPLE__ )
 	/*
 	 * In FreeBSD, we always use these settings as inode numbers
@@ -4224,13 +5326,29 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 	f->fs->debug = f->conf.debug;
 	f->ctr = 0;
 	f->generation = 0;
+	if (f->conf.nodemap) {
+		uint64_t ctr;
+
+		f->nodemap = fuse_nodemap_open(f->conf.nodemap);
+		if (f->nodemap == NULL)
+			goto out_free_session;
+
+		/* Continue above the IDs handed out by earlier mounts */
+		fuse_nodemap_next_id(f->nodemap, &ctr, &f->generation);
+		if (f->conf.nodeid64 || ctr <= 0xffffffff) {
+			f->ctr = ctr;
+		} else {
+			f->ctr = 0;
+			f->generation ++;
+		}
+	}
 	/* FIXME: Dynamic hash table */
 	f->name_table_size = 14057;
 	f->name_table = (struct node **)
 		calloc(1, sizeof(struct node *) * f->name_table_size);
 	if (f->name_table == NULL) {
 		fprintf(stderr, "fuse: memory allocation failed\n");
-		goto out_free_session;
+		goto out_close_nodemap;
 	}
 
 	f->id_table_size = 14057;
@@ -4242,6 +5360,7 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 	}
 
 	fuse_mutex_init(&f->lock);
+	pthread_cond_init(&f->prune_cond, NULL);
 
 	root = (struct node *) calloc(1, sizeof(struct node));
 	if (root == NULL) {
@@ -4277,6 +5396,9 @@ out_free_id_table:
 	free(f->id_table);
 out_free_name_table:
 	free(f->name_table);
+out_close_nodemap:
+	if (f->nodemap)
+		fuse_nodemap_close(f->nodemap);
 out_free_session:
 	fuse_session_destroy(f->se);
 out_free_fs:
@@ -4285,6 +5407,7 @@ out_free_fs:
 	fs->op.destroy = NULL;
 	fuse_fs_destroy(f->fs);
 	free(f->conf.modules);
+	free(f->conf.nodemap);
 out_free:
 	free(f);
 out_delete_context_key:
@@ -4300,6 +5423,11 @@ struct fuse *fuse_new(struct fuse_chan *ch, struct fuse_args *args,
 	return fuse_new_common(ch, args, op, op_size, user_data, 0);
 }
 
+int fuse_is_handed_off(struct fuse *f)
+{
+	return f->handed_off;
+}
+
 void fuse_destroy(struct fuse *f)
 {
 	size_t i;
@@ -4307,7 +5435,25 @@ void fuse_destroy(struct fuse *f)
 	if (f->conf.intr && f->intr_installed)
 		fuse_restore_intr_signal(f->conf.intr_signal);
 
-	if (f->fs) {
+	if (f->conf.debug && f->conf.readlink_cache)
+		fprintf(stderr, "readlink cache: %llu hits, %llu misses\n",
+			f->readlink_hits, f->readlink_misses);
+
+	if (f->prune_started > 0) {
+		pthread_mutex_lock(&f->lock);
+		f->prune_exit = 1;
+		pthread_cond_signal(&f->prune_cond);
+		pthread_mutex_unlock(&f->lock);
+		pthread_join(f->prune_thread, NULL);
+	}
+	if (f->conf.debug && f->conf.node_cache_max)
+		fprintf(stderr, "node cache: %llu nodes, budget %u, "
+			"%llu evictions\n",
+			(unsigned long long) f->id_table_count,
+			f->conf.node_cache_max, f->evictions);
+
+	/* Hidden files are still in use by the process we handed off to */
+	if (f->fs && !f->handed_off) {
 		struct fuse_context_i *c = fuse_get_context_internal();
 
 		memset(c, 0, sizeof(*c));
@@ -4339,13 +5485,545 @@ void fuse_destroy(struct fuse *f)
 	}
 	free(f->id_table);
 	free(f->name_table);
+	if (f->nodemap)
+		fuse_nodemap_close(f->nodemap);
+	pthread_cond_destroy(&f->prune_cond);
 	pthread_mutex_destroy(&f->lock);
 	fuse_session_destroy(f->se);
 	free(f->conf.modules);
+	free(f->conf.nodemap);
 	free(f);
 	fuse_delete_context_key();
 }
 
+#define FUSE_HANDOFF_MAGIC 0x46554844
+#define FUSE_HANDOFF_VERSION 1
+
+struct handoff_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t conn_size;
+	uint32_t padding;
+	uint64_t len;
+};
+
+struct handoff_state {
+	uint64_t ctr;
+	uint64_t nnodes;
+	uint32_t generation;
+	uint32_t hidectr;
+};
+
+/* Followed by the name with a terminating zero and by the locks */
+struct handoff_node {
+	uint64_t nodeid;
+	uint64_t parent;
+	uint64_t nlookup;
+	uint32_t generation;
+	uint32_t open_count;
+	uint32_t is_hidden;
+	uint32_t namelen;
+	uint32_t nlocks;
+	uint32_t padding;
+};
+
+struct handoff_lock {
+	int64_t start;
+	int64_t end;
+	uint64_t owner;
+	int32_t type;
+	int32_t pid;
+};
+
+struct handoff_buf {
+	char *data;
+	size_t len;
+	size_t size;
+	int failed;
+};
+
+static void handoff_put(struct handoff_buf *b, const void *data, size_t len)
+{
+	if (b->failed)
+		return;
+
+	if (b->len + len > b->size) {
+		size_t size = b->size ? b->size * 2 : 65536;
+		char *newdata;
+
+		while (b->len + len > size)
+			size *= 2;
+		newdata = realloc(b->data, size);
+		if (newdata == NULL) {
+			b->failed = 1;
+			return;
+		}
+		b->data = newdata;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static int handoff_get(const char *data, size_t len, size_t *off, void *buf,
+		       size_t size)
+{
+	if (len - *off < size)
+		return -1;
+
+	memcpy(buf, data + *off, size);
+	*off += size;
+	return 0;
+}
+
+static uint32_t handoff_count_locks(struct lock *t)
+{
+	if (t == NULL)
+		return 0;
+
+	return 1 + handoff_count_locks(t->left) + handoff_count_locks(t->right);
+}
+
+static void handoff_put_locks(struct handoff_buf *b, struct lock *t)
+{
+	struct handoff_lock hl;
+
+	if (t == NULL)
+		return;
+
+	handoff_put_locks(b, t->left);
+	memset(&hl, 0, sizeof(hl));
+	hl.start = t->start;
+	hl.end = t->end;
+	hl.owner = t->owner;
+	hl.type = t->type;
+	hl.pid = t->pid;
+	handoff_put(b, &hl, sizeof(hl));
+	handoff_put_locks(b, t->right);
+}
+
+static int handoff_write(int sock, const char *data, size_t len)
+{
+	while (len) {
+		ssize_t res = write(sock, data, len);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int handoff_read(int sock, char *data, size_t len)
+{
+	while (len) {
+		ssize_t res = read(sock, data, len);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (res == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+		data += res;
+		len -= res;
+	}
+	return 0;
+}
+
+static int handoff_send_fd(int sock, int fd, const void *data, size_t len)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char ccmsg[CMSG_SPACE(sizeof(fd))];
+	ssize_t res;
+
+	iov.iov_base = (void *) data;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ccmsg;
+	msg.msg_controllen = sizeof(ccmsg);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+	msg.msg_controllen = cmsg->cmsg_len;
+
+	do
+		res = sendmsg(sock, &msg, 0);
+	while (res == -1 && errno == EINTR);
+	if (res == -1)
+		return -1;
+
+	return handoff_write(sock, (const char *) data + res, len - res);
+}
+
+static int handoff_receive_fd(int sock, void *data, size_t len)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char ccmsg[CMSG_SPACE(sizeof(int))];
+	ssize_t res;
+	int fd;
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ccmsg;
+	msg.msg_controllen = sizeof(ccmsg);
+
+	do
+		res = recvmsg(sock, &msg, 0);
+	while (res == -1 && errno == EINTR);
+	if (res <= 0)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS) {
+		fprintf(stderr, "fuse: no device fd in handoff message\n");
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+	if (handoff_read(sock, (char *) data + res, len - res) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Directory handles point to a struct fuse_dh of this process, and so
+ * may the file handles of some filesystems and modules.  None of these
+ * mean anything to the new process, so refuse while any are open.
+ */
+static int handoff_check_handles(struct fuse *f)
+{
+	unsigned int open_dirs;
+	unsigned int open_files = 0;
+	size_t i;
+
+	pthread_mutex_lock(&f->lock);
+	open_dirs = f->open_dirs;
+	for (i = 0; i < f->id_table_size; i++) {
+		struct node *node;
+
+		for (node = f->id_table[i]; node != NULL;
+		     node = node->id_next)
+			open_files += node->open_count;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	if (open_dirs) {
+		fprintf(stderr, "fuse: cannot hand off with %u open directories\n",
+			open_dirs);
+		return -1;
+	}
+	if (f->private_fh && open_files) {
+		fprintf(stderr, "fuse: cannot hand off with %u open files\n",
+			open_files);
+		return -1;
+	}
+	return 0;
+}
+
+int fuse_handoff_send(struct fuse *f, int sock)
+{
+	struct fuse_ll *ll = (struct fuse_ll *) fuse_session_data(f->se);
+	struct fuse_chan *ch = fuse_session_next_chan(f->se, NULL);
+	struct handoff_header hdr;
+	struct handoff_state st;
+	struct handoff_buf b;
+	size_t stoff;
+	size_t i;
+	char ack;
+	int res;
+
+	if (!ll->got_init) {
+		fprintf(stderr, "fuse: cannot hand off before init\n");
+		return -1;
+	}
+	res = handoff_check_handles(f);
+	if (res == -1)
+		return -1;
+
+	memset(&b, 0, sizeof(b));
+	memset(&st, 0, sizeof(st));
+	handoff_put(&b, &ll->conn, sizeof(ll->conn));
+	stoff = b.len;
+	handoff_put(&b, &st, sizeof(st));
+
+	pthread_mutex_lock(&f->lock);
+	st.ctr = f->ctr;
+	st.generation = f->generation;
+	st.hidectr = f->hidectr;
+	for (i = 0; i < f->id_table_size; i++) {
+		struct node *node;
+
+		for (node = f->id_table[i]; node != NULL;
+		     node = node->id_next) {
+			struct handoff_node hn;
+			const char *name = node->parent ? node->name : "";
+
+			memset(&hn, 0, sizeof(hn));
+			hn.nodeid = node->nodeid;
+			hn.parent = node->parent ? node->parent->nodeid : 0;
+			hn.nlookup = node->nlookup;
+			hn.generation = node->generation;
+			hn.open_count = node->open_count;
+			hn.is_hidden = node->is_hidden;
+			hn.namelen = strlen(name);
+			hn.nlocks = handoff_count_locks(node->locks);
+			handoff_put(&b, &hn, sizeof(hn));
+			handoff_put(&b, name, hn.namelen + 1);
+			handoff_put_locks(&b, node->locks);
+			st.nnodes++;
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	if (b.failed) {
+		fprintf(stderr, "fuse: memory allocation failed\n");
+		free(b.data);
+		return -1;
+	}
+	memcpy(b.data + stoff, &st, sizeof(st));
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FUSE_HANDOFF_MAGIC;
+	hdr.version = FUSE_HANDOFF_VERSION;
+	hdr.conn_size = sizeof(ll->conn);
+	hdr.len = b.len;
+	res = handoff_send_fd(sock, fuse_chan_fd(ch), &hdr, sizeof(hdr));
+	if (res != -1)
+		res = handoff_write(sock, b.data, b.len);
+	if (res != -1)
+		res = handoff_read(sock, &ack, 1);
+	free(b.data);
+	if (res == -1) {
+		perror("fuse: filesystem handoff failed");
+		fuse_session_reset(f->se);
+		return -1;
+	}
+
+	if (f->conf.debug)
+		fprintf(stderr, "handoff: sent %llu nodes, %llu bytes\n",
+			(unsigned long long) st.nnodes,
+			(unsigned long long) hdr.len);
+	f->handed_off = 1;
+	return 0;
+}
+
+static int handoff_restore(struct fuse *f, const char *data, size_t len,
+			   struct fuse_conn_info *conn)
+{
+	struct handoff_state st;
+	struct node **nodes;
+	const char **names;
+	uint64_t *parents;
+	size_t off = 0;
+	size_t n = 0;
+	size_t i;
+	int res = -1;
+
+	if (handoff_get(data, len, &off, conn, sizeof(*conn)) == -1 ||
+	    handoff_get(data, len, &off, &st, sizeof(st)) == -1 ||
+	    st.nnodes > len / sizeof(struct handoff_node))
+		return -1;
+
+	nodes = calloc(st.nnodes, sizeof(struct node *));
+	names = calloc(st.nnodes, sizeof(char *));
+	parents = calloc(st.nnodes, sizeof(uint64_t));
+	if (!nodes || !names || !parents)
+		goto out_free;
+
+	pthread_mutex_lock(&f->lock);
+	for (i = 0; i < st.nnodes; i++) {
+		struct handoff_node hn;
+		struct node *node;
+		uint32_t j;
+
+		if (handoff_get(data, len, &off, &hn, sizeof(hn)) == -1 ||
+		    len - off <= hn.namelen || data[off + hn.namelen] != '\0')
+			goto out_unlock;
+
+		if (hn.nodeid == FUSE_ROOT_ID) {
+			node = get_node(f, FUSE_ROOT_ID);
+		} else {
+			if (!hn.nodeid || (fuse_ino_t) hn.nodeid != hn.nodeid ||
+			    get_node_nocheck(f, hn.nodeid))
+				goto out_unlock;
+			node = (struct node *) calloc(1, sizeof(struct node));
+			if (node == NULL)
+				goto out_unlock;
+			node->nodeid = hn.nodeid;
+			node->generation = hn.generation;
+			node->refctr = 1;
+			hash_id(f, node);
+			lru_touch(f, node);
+			if (hn.parent) {
+				nodes[n] = node;
+				names[n] = data + off;
+				parents[n] = hn.parent;
+				n++;
+			}
+		}
+		node->nlookup = hn.nlookup;
+		node->open_count = hn.open_count;
+		node->is_hidden = hn.is_hidden;
+		off += hn.namelen + 1;
+
+		for (j = 0; j < hn.nlocks; j++) {
+			struct handoff_lock hl;
+			struct lock l;
+
+			if (handoff_get(data, len, &off, &hl, sizeof(hl)) == -1)
+				goto out_unlock;
+			memset(&l, 0, sizeof(l));
+			l.type = hl.type;
+			l.start = hl.start;
+			l.end = hl.end;
+			l.pid = hl.pid;
+			l.owner = hl.owner;
+			if (locks_insert(node, &l) != 0)
+				goto out_unlock;
+		}
+	}
+
+	/* Parents may come after their children, so link them up last */
+	for (i = 0; i < n; i++) {
+		if ((fuse_ino_t) parents[i] != parents[i] ||
+		    !get_node_nocheck(f, parents[i]) ||
+		    hash_name(f, nodes[i], parents[i], names[i]) == -1)
+			goto out_unlock;
+	}
+	f->ctr = st.ctr;
+	f->generation = st.generation;
+	f->hidectr = st.hidectr;
+	res = 0;
+
+out_unlock:
+	pthread_mutex_unlock(&f->lock);
+out_free:
+	free(nodes);
+	free(names);
+	free(parents);
+	return res;
+}
+
+struct fuse *fuse_handoff_receive(int sock, struct fuse_args *args,
+				  const struct fuse_operations *op,
+				  size_t op_size, void *user_data)
+{
+	struct handoff_header hdr;
+	struct fuse_conn_info conn;
+	struct fuse_context_i *c;
+	struct fuse_chan *ch;
+	struct fuse_ll *ll;
+	struct fuse *f;
+	char *data;
+	char ack = 0;
+	int fd;
+
+	fd = handoff_receive_fd(sock, &hdr, sizeof(hdr));
+	if (fd == -1) {
+		perror("fuse: failed to receive filesystem handoff");
+		return NULL;
+	}
+	if (hdr.magic != FUSE_HANDOFF_MAGIC ||
+	    hdr.version != FUSE_HANDOFF_VERSION ||
+	    hdr.conn_size != sizeof(struct fuse_conn_info) ||
+	    hdr.len != (size_t) hdr.len) {
+		fprintf(stderr, "fuse: incompatible handoff message\n");
+		goto out_close;
+	}
+
+	data = malloc(hdr.len);
+	if (data == NULL) {
+		fprintf(stderr, "fuse: memory allocation failed\n");
+		goto out_close;
+	}
+	if (handoff_read(sock, data, hdr.len) == -1) {
+		perror("fuse: failed to receive filesystem handoff");
+		goto out_free_data;
+	}
+
+	ch = fuse_kern_chan_new(fd);
+	if (ch == NULL)
+		goto out_free_data;
+
+	f = fuse_new_common(ch, args, op, op_size, user_data, 0);
+	if (f == NULL) {
+		fuse_chan_destroy(ch);
+		free(data);
+		return NULL;
+	}
+
+	/* Until the handoff is complete, don't touch the filesystem on
+	   destroy */
+	f->handed_off = 1;
+	if (handoff_restore(f, data, hdr.len, &conn) == -1) {
+		fprintf(stderr, "fuse: invalid handoff state\n");
+		goto out_destroy;
+	}
+	/* The kernel sends writes of up to the max_write it was told,
+	   which the new channel's default buffer may be too small for */
+	if (conn.max_write > UINT_MAX - 4096) {
+		fprintf(stderr, "fuse: invalid handoff state\n");
+		goto out_destroy;
+	}
+	fuse_chan_grow_bufsize(ch, conn.max_write + 4096);
+	if (handoff_write(sock, &ack, 1) == -1) {
+		perror("fuse: failed to acknowledge filesystem handoff");
+		goto out_destroy;
+	}
+	free(data);
+
+	if (f->conf.debug)
+		fprintf(stderr, "handoff: received %llu nodes, %llu bytes\n",
+			(unsigned long long) f->id_table_count,
+			(unsigned long long) hdr.len);
+
+	/* The kernel won't send INIT again, so initialize the filesystem
+	   with the parameters negotiated by the previous process */
+	ll = (struct fuse_ll *) fuse_session_data(f->se);
+	ll->conn = conn;
+	ll->got_init = 1;
+	c = fuse_get_context_internal();
+	memset(c, 0, sizeof(*c));
+	c->ctx.fuse = f;
+	fuse_fs_init(f->fs, &conn);
+	f->readdirplus = (ll->conn.want & FUSE_CAP_READDIRPLUS) != 0;
+	f->writeback = (ll->conn.want & FUSE_CAP_WRITEBACK_CACHE) != 0;
+	f->no_open = fuse_can_skip_open(f, &ll->conn);
+	f->handed_off = 0;
+	return f;
+
+out_destroy:
+	fuse_destroy(f);
+	free(data);
+	return NULL;
+
+out_free_data:
+	free(data);
+out_close:
+	close(fd);
+	return NULL;
+}
+
 static struct fuse *fuse_new_common_compat25(int fd, struct fuse_args *args,
 					     const struct fuse_operations *op,
 					     size_t op_size, int compat)
@@ -20,6 +20,10 @@ struct fuse_session {
 	volatile int exited;
 
 	struct fuse_chan *ch;
+
+	/* The event loop reallocates its buffers when the channel's
+	   buffer size grows */
+	int bufsize_follows;
 };
 
 struct fuse_req {
@@ -30,6 +34,7 @@ struct fuse_req {
 	struct fuse_ctx ctx;
 	struct fuse_chan *ch;
 	int interrupted;
+	unsigned int ioctl_64bit : 1;
 	union {
 		struct {
 			uint64_t unique;
@@ -43,12 +48,23 @@ struct fuse_req {
 	struct fuse_req *prev;
 };
 
+struct fuse_notify_req {
+	uint64_t unique;
+	void *cookie;
+	struct fuse_notify_req *next;
+	struct fuse_notify_req *prev;
+};
+
 struct fuse_ll {
 	int debug;
 	int allow_root;
 	int atomic_o_trunc;
 	int no_remote_lock;
 	int big_writes;
+	int no_readdirplus;
+	int no_readdirplus_auto;
+	int writeback_cache;
+	int parallel_dirops;
 	struct fuse_lowlevel_ops op;
 	int got_init;
 	struct cuse_data *cuse_data;
@@ -59,6 +75,8 @@ struct fuse_ll {
 	struct fuse_req interrupts;
 	pthread_mutex_t lock;
 	int got_destroy;
+	struct fuse_notify_req notify_list;
+	uint64_t notify_ctr;
 };
 
 struct fuse_cmd {
@@ -83,10 +101,15 @@ void fuse_kern_unmount_compat22(const char *mountpoint);
 void fuse_kern_unmount(const char *mountpoint, int fd);
 int fuse_kern_mount(const char *mountpoint, struct fuse_args *args);
 
+void *fuse_chan_buf_alloc(size_t bufsize);
+void fuse_chan_grow_bufsize(struct fuse_chan *ch, size_t bufsize);
+
 int fuse_send_reply_iov_nofree(fuse_req_t req, int error, struct iovec *iov,
 			       int count);
 void fuse_free_req(fuse_req_t req);
 
+int fuse_is_handed_off(struct fuse *f);
+
 
 struct fuse *fuse_setup_common(int argc, char *argv[],
 			       const struct fuse_operations *op,
@@ -98,3 +121,21 @@ struct fuse *fuse_setup_common(int argc, char *argv[],
 			       int compat);
 
 void cuse_lowlevel_init(fuse_req_t req, fuse_ino_t nodeide, const void *inarg);
+
+struct fuse_nodemap;
+
+struct fuse_nodemap *fuse_nodemap_open(const char *path);
+void fuse_nodemap_close(struct fuse_nodemap *map);
+void fuse_nodemap_next_id(struct fuse_nodemap *map, uint64_t *nodeid,
+			  unsigned int *generation);
+void fuse_nodemap_reserve(struct fuse_nodemap *map, uint64_t nodeid,
+			  unsigned int generation);
+int fuse_nodemap_lookup(struct fuse_nodemap *map, uint64_t parent,
+			const char *name, uint64_t *nodeid,
+			unsigned int *generation);
+int fuse_nodemap_id_used(struct fuse_nodemap *map, uint64_t nodeid);
+void fuse_nodemap_add(struct fuse_nodemap *map, uint64_t parent,
+		      const char *name, uint64_t nodeid,
+		      unsigned int generation);
+void fuse_nodemap_remove(struct fuse_nodemap *map, uint64_t parent,
+			 const char *name);
@@ -6,7 +6,7 @@
   See the file COPYING.LIB
 */
 
-#include "fuse_lowlevel.h"
+#include "fuse_i.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,14 +17,26 @@ int fuse_session_loop(struct fuse_session *se)
 	int res = 0;
 	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
 	size_t bufsize = fuse_chan_bufsize(ch);
-	char *buf = (char *) malloc(bufsize);
+	char *buf = (char *) fuse_chan_buf_alloc(bufsize);
 	if (!buf) {
 		fprintf(stderr, "fuse: failed to allocate read buffer\n");
 		return -1;
 	}
 
+	se->bufsize_follows = 1;
 	while (!fuse_session_exited(se)) {
 		struct fuse_chan *tmpch = ch;
+		if (bufsize < fuse_chan_bufsize(ch)) {
+			/* Grown by INIT */
+			free(buf);
+			bufsize = fuse_chan_bufsize(ch);
+			buf = (char *) fuse_chan_buf_alloc(bufsize);
+			if (!buf) {
+				fprintf(stderr, "fuse: failed to allocate read buffer\n");
+				res = -ENOMEM;
+				break;
+			}
+		}
 		res = fuse_chan_recv(&tmpch, buf, bufsize);
 		if (res == -EINTR)
 			continue;
@@ -6,7 +6,7 @@
   See the file COPYING.LIB.
 */
 
-#include "fuse_lowlevel.h"
+#include "fuse_i.h"
 #include "fuse_misc.h"
 #include "fuse_kernel.h"
 
@@ -73,9 +73,23 @@ static void *fuse_do_work(void *data)
 
 	while (!fuse_session_exited(mt->se)) {
 		int isforget = 0;
+		uint32_t opcode;
 		struct fuse_chan *ch = mt->prevch;
 		int res;
 
+		if (w->bufsize < fuse_chan_bufsize(ch)) {
+			/* Grown by INIT */
+			free(w->buf);
+			w->bufsize = fuse_chan_bufsize(ch);
+			w->buf = fuse_chan_buf_alloc(w->bufsize);
+			if (!w->buf) {
+				fprintf(stderr, "fuse: failed to allocate read buffer\n");
+				fuse_session_exit(mt->se);
+				mt->error = -1;
+				break;
+			}
+		}
+
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 		res = fuse_chan_recv(&ch, w->buf, w->bufsize);
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
@@ -99,12 +113,15 @@ static void *fuse_do_work(void *data)
 		 * This disgusting hack is needed so that zillions of threads
 		 * are not created on a burst of FORGET messages
 		 */
-		if (((struct fuse_in_header *) w->buf)->opcode == FUSE_FORGET)
+		opcode = ((struct fuse_in_header *) w->buf)->opcode;
+		if (opcode == FUSE_FORGET || opcode == FUSE_BATCH_FORGET)
 			isforget = 1;
 
 		if (!isforget)
 			mt->numavail--;
-		if (mt->numavail == 0)
+		/* A thread started now would read the first requests after
+		   INIT with a buffer of the size before INIT */
+		if (mt->numavail == 0 && opcode != FUSE_INIT)
 			fuse_start_thread(mt);
 		pthread_mutex_unlock(&mt->lock);
 
@@ -150,7 +167,7 @@ static int fuse_start_thread(struct fuse_mt *mt)
 	}
 	memset(w, 0, sizeof(struct fuse_worker));
 	w->bufsize = fuse_chan_bufsize(mt->prevch);
-	w->buf = malloc(w->bufsize);
+	w->buf = fuse_chan_buf_alloc(w->bufsize);
 	w->mt = mt;
 	if (!w->buf) {
 		fprintf(stderr, "fuse: failed to allocate read buffer\n");
@@ -214,6 +231,7 @@ int fuse_session_loop_mt(struct fuse_session *se)
 	mt.main.prev = mt.main.next = &mt.main;
 	sem_init(&mt.finish, 0, 0);
 	fuse_mutex_init(&mt.lock);
+	se->bufsize_follows = 1;
 
 	pthread_mutex_lock(&mt.lock);
 	err = fuse_start_thread(&mt);
@@ -24,6 +24,11 @@
 #define PARAM(inarg) (((char *)(inarg)) + sizeof(*(inarg)))
 #define OFFSET_MAX 0x7fffffffffffffffLL
 
+/* Limits of the kernel on the number of pages in a request, with and
+   without FUSE_MAX_PAGES */
+#define FUSE_DEFAULT_MAX_PAGES 256
+#define FUSE_OLD_MAX_PAGES 32
+
 struct fuse_pollhandle {
 	uint64_t kh;
 	struct fuse_chan *ch;
@@ -142,6 +147,47 @@ static void list_add_req(struct fuse_req *req, struct fuse_req *next)
 	next->prev = req;
 }
 
+static void list_init_nreq(struct fuse_notify_req *nreq)
+{
+	nreq->next = nreq;
+	nreq->prev = nreq;
+}
+
+static void list_del_nreq(struct fuse_notify_req *nreq)
+{
+	struct fuse_notify_req *prev = nreq->prev;
+	struct fuse_notify_req *next = nreq->next;
+	prev->next = next;
+	next->prev = prev;
+}
+
+static void list_add_nreq(struct fuse_notify_req *nreq,
+			  struct fuse_notify_req *next)
+{
+	struct fuse_notify_req *prev = next->prev;
+	nreq->next = next;
+	nreq->prev = prev;
+	prev->next = nreq;
+	next->prev = nreq;
+}
+
+static struct fuse_req *fuse_ll_alloc_req(struct fuse_ll *f)
+{
+	struct fuse_req *req;
+
+	req = (struct fuse_req *) calloc(1, sizeof(struct fuse_req));
+	if (req == NULL) {
+		fprintf(stderr, "fuse: failed to allocate request\n");
+	} else {
+		req->f = f;
+		req->ctr = 1;
+		list_init_req(req);
+		fuse_mutex_init(&req->lock);
+	}
+
+	return req;
+}
+
 static void destroy_req(fuse_req_t req)
 {
 	pthread_mutex_destroy(&req->lock);
@@ -335,6 +381,32 @@ static void fill_entry(struct fuse_entry_out *arg,
 	convert_stat(&e->attr, &arg->attr);
 }
 
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+			      const char *name,
+			      const struct fuse_entry_param *e, off_t off)
+{
+	struct fuse_direntplus *dp = (struct fuse_direntplus *) buf;
+	size_t namelen = strlen(name);
+	size_t entlen = FUSE_NAME_OFFSET_DIRENTPLUS + namelen;
+	size_t entsize = FUSE_DIRENT_ALIGN(entlen);
+
+	(void) req;
+	if (buf == NULL || entsize > bufsize)
+		return entsize;
+
+	memset(&dp->entry_out, 0, sizeof(dp->entry_out));
+	fill_entry(&dp->entry_out, e);
+	dp->dirent.ino = e->attr.st_ino;
+	dp->dirent.off = off;
+	dp->dirent.namelen = namelen;
+	dp->dirent.type = (e->attr.st_mode & 0170000) >> 12;
+	memcpy(dp->dirent.name, name, namelen);
+	if (entsize > entlen)
+		memset(buf + entlen, 0, entsize - entlen);
+
+	return entsize;
+}
+
 static void fill_open(struct fuse_open_out *arg,
 		      const struct fuse_file_info *f)
 {
@@ -495,13 +567,34 @@ int fuse_reply_bmap(fuse_req_t req, uint64_t idx)
 	return send_reply_ok(req, &arg, sizeof(arg));
 }
 
+static struct fuse_ioctl_iovec *fuse_ioctl_iovec_copy(const struct iovec *iov,
+						      size_t count)
+{
+	struct fuse_ioctl_iovec *fiov;
+	size_t i;
+
+	fiov = malloc(sizeof(fiov[0]) * count);
+	if (!fiov)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		fiov[i].base = (uintptr_t) iov[i].iov_base;
+		fiov[i].len = iov[i].iov_len;
+	}
+
+	return fiov;
+}
+
 int fuse_reply_ioctl_retry(fuse_req_t req,
 			   const struct iovec *in_iov, size_t in_count,
 			   const struct iovec *out_iov, size_t out_count)
 {
 	struct fuse_ioctl_out arg;
+	struct fuse_ioctl_iovec *in_fiov = NULL;
+	struct fuse_ioctl_iovec *out_fiov = NULL;
 	struct iovec iov[4];
 	size_t count = 1;
+	int res;
 
 	memset(&arg, 0, sizeof(arg));
 	arg.flags |= FUSE_IOCTL_RETRY;
@@ -511,19 +604,55 @@ int fuse_reply_ioctl_retry(fuse_req_t req,
 	iov[count].iov_len = sizeof(arg);
 	count++;
 
-	if (in_count) {
-		iov[count].iov_base = (void *)in_iov;
-		iov[count].iov_len = sizeof(in_iov[0]) * in_count;
-		count++;
-	}
+	if (req->f->conn.proto_minor < 16) {
+		if (in_count) {
+			iov[count].iov_base = (void *)in_iov;
+			iov[count].iov_len = sizeof(in_iov[0]) * in_count;
+			count++;
+		}
 
-	if (out_count) {
-		iov[count].iov_base = (void *)out_iov;
-		iov[count].iov_len = sizeof(out_iov[0]) * out_count;
-		count++;
+		if (out_count) {
+			iov[count].iov_base = (void *)out_iov;
+			iov[count].iov_len = sizeof(out_iov[0]) * out_count;
+			count++;
+		}
+	} else {
+		/* Can't handle non-compat 64bit ioctls on 32bit */
+		if (sizeof(void *) == 4 && req->ioctl_64bit) {
+			res = fuse_reply_err(req, EINVAL);
+			goto out;
+		}
+
+		if (in_count) {
+			in_fiov = fuse_ioctl_iovec_copy(in_iov, in_count);
+			if (!in_fiov)
+				goto enomem;
+
+			iov[count].iov_base = (void *)in_fiov;
+			iov[count].iov_len = sizeof(in_fiov[0]) * in_count;
+			count++;
+		}
+		if (out_count) {
+			out_fiov = fuse_ioctl_iovec_copy(out_iov, out_count);
+			if (!out_fiov)
+				goto enomem;
+
+			iov[count].iov_base = (void *)out_fiov;
+			iov[count].iov_len = sizeof(out_fiov[0]) * out_count;
+			count++;
+		}
 	}
 
-	return send_reply_iov(req, 0, iov, count);
+	res = send_reply_iov(req, 0, iov, count);
+out:
+	free(in_fiov);
+	free(out_fiov);
+
+	return res;
+
+enomem:
+	res = fuse_reply_err(req, ENOMEM);
+	goto out;
 }
 
 int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size)
@@ -581,6 +710,16 @@ int fuse_reply_poll(fuse_req_t req, unsigned revents)
 	return send_reply_ok(req, &arg, sizeof(arg));
 }
 
+int fuse_reply_lseek(fuse_req_t req, off_t off)
+{
+	struct fuse_lseek_out arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.offset = off;
+
+	return send_reply_ok(req, &arg, sizeof(arg));
+}
+
 static void do_lookup(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
 	char *name = (char *) inarg;
@@ -601,6 +740,40 @@ static void do_forget(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		fuse_reply_none(req);
 }
 
+static void do_batch_forget(fuse_req_t req, fuse_ino_t nodeid,
+			    const void *inarg)
+{
+	struct fuse_batch_forget_in *arg = (struct fuse_batch_forget_in *) inarg;
+	struct fuse_forget_one *param = (struct fuse_forget_one *) PARAM(arg);
+	unsigned int i;
+
+	(void) nodeid;
+
+	if (req->f->op.forget_multi) {
+		req->f->op.forget_multi(req, arg->count,
+					(struct fuse_forget_data *) param);
+	} else if (req->f->op.forget) {
+		for (i = 0; i < arg->count; i++) {
+			struct fuse_forget_one *forget = &param[i];
+			struct fuse_req *dummy_req;
+
+			dummy_req = fuse_ll_alloc_req(req->f);
+			if (dummy_req == NULL)
+				break;
+
+			dummy_req->unique = req->unique;
+			dummy_req->ctx = req->ctx;
+			dummy_req->ch = NULL;
+
+			req->f->op.forget(dummy_req, forget->nodeid,
+					  forget->nlookup);
+		}
+		fuse_reply_none(req);
+	} else {
+		fuse_reply_none(req);
+	}
+}
+
 static void do_getattr(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
 	struct fuse_file_info *fip = NULL;
@@ -865,6 +1038,28 @@ static void do_read(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		fuse_reply_err(req, ENOSYS);
 }
 
+static void do_copy_file_range(fuse_req_t req, fuse_ino_t nodeid_in,
+			       const void *inarg)
+{
+	struct fuse_copy_file_range_in *arg =
+		(struct fuse_copy_file_range_in *) inarg;
+
+	if (req->f->op.copy_file_range) {
+		struct fuse_file_info fi_in, fi_out;
+
+		memset(&fi_in, 0, sizeof(fi_in));
+		fi_in.fh = arg->fh_in;
+		fi_in.fh_old = fi_in.fh;
+		memset(&fi_out, 0, sizeof(fi_out));
+		fi_out.fh = arg->fh_out;
+		fi_out.fh_old = fi_out.fh;
+		req->f->op.copy_file_range(req, nodeid_in, arg->off_in, &fi_in,
+					   arg->nodeid_out, arg->off_out,
+					   &fi_out, arg->len, arg->flags);
+	} else
+		fuse_reply_err(req, ENOSYS);
+}
+
 static void do_write(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
 	struct fuse_write_in *arg = (struct fuse_write_in *) inarg;
@@ -973,6 +1168,23 @@ static void do_readdir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		fuse_reply_err(req, ENOSYS);
 }
 
+static void do_readdirplus(fuse_req_t req, fuse_ino_t nodeid,
+			   const void *inarg)
+{
+	struct fuse_read_in *arg = (struct fuse_read_in *) inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+	fi.fh_old = fi.fh;
+
+	if (req->f->op.readdirplus)
+		req->f->op.readdirplus(req, nodeid, arg->size, arg->offset,
+				       &fi);
+	else
+		fuse_reply_err(req, ENOSYS);
+}
+
 static void do_releasedir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
 	struct fuse_release_in *arg = (struct fuse_release_in *) inarg;
@@ -1233,6 +1445,11 @@ static void do_ioctl(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	fi.fh = arg->fh;
 	fi.fh_old = fi.fh;
 
+	if (sizeof(void *) == 4 && req->f->conn.proto_minor >= 16 &&
+	    !(flags & FUSE_IOCTL_32BIT)) {
+		req->ioctl_64bit = 1;
+	}
+
 	if (req->f->op.ioctl)
 		req->f->op.ioctl(req, nodeid, arg->cmd,
 				 (void *)(uintptr_t)arg->arg, &fi, flags,
@@ -1241,6 +1458,38 @@ static void do_ioctl(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		fuse_reply_err(req, ENOSYS);
 }
 
+static void do_fallocate(fuse_req_t req, fuse_ino_t nodeid,
+			 const void *inarg)
+{
+	struct fuse_fallocate_in *arg = (struct fuse_fallocate_in *) inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+	fi.fh_old = fi.fh;
+
+	if (req->f->op.fallocate)
+		req->f->op.fallocate(req, nodeid, arg->mode, arg->offset,
+				     arg->length, &fi);
+	else
+		fuse_reply_err(req, ENOSYS);
+}
+
+static void do_lseek(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
+{
+	struct fuse_lseek_in *arg = (struct fuse_lseek_in *) inarg;
+	struct fuse_file_info fi;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.fh = arg->fh;
+	fi.fh_old = fi.fh;
+
+	if (req->f->op.lseek)
+		req->f->op.lseek(req, nodeid, arg->offset, arg->whence, &fi);
+	else
+		fuse_reply_err(req, ENOSYS);
+}
+
 void fuse_pollhandle_destroy(struct fuse_pollhandle *ph)
 {
 	free(ph);
@@ -1275,12 +1524,46 @@ static void do_poll(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 	}
 }
 
+static void do_notify_reply(fuse_req_t req, fuse_ino_t nodeid,
+			    const void *inarg)
+{
+	struct fuse_notify_retrieve_in *arg =
+		(struct fuse_notify_retrieve_in *) inarg;
+	struct fuse_ll *f = req->f;
+	struct fuse_notify_req *head = &f->notify_list;
+	struct fuse_notify_req *nreq;
+
+	pthread_mutex_lock(&f->lock);
+	for (nreq = head->next; nreq != head; nreq = nreq->next) {
+		if (nreq->unique == req->unique) {
+			list_del_nreq(nreq);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	if (nreq == head) {
+		fuse_reply_none(req);
+		return;
+	}
+
+	if (f->op.retrieve_reply)
+		f->op.retrieve_reply(req, nreq->cookie, nodeid, arg->offset,
+				     PARAM(arg), arg->size);
+	else
+		fuse_reply_none(req);
+	free(nreq);
+}
+
 static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
 	struct fuse_init_in *arg = (struct fuse_init_in *) inarg;
 	struct fuse_init_out outarg;
+	size_t outargsize = sizeof(outarg);
 	struct fuse_ll *f = req->f;
-	size_t bufsize = fuse_chan_bufsize(req->ch);
+	struct fuse_session *se = fuse_chan_session(req->ch);
+	size_t max_pages = FUSE_OLD_MAX_PAGES;
+	size_t bufsize;
 
 	(void) nodeid;
 	if (f->debug) {
@@ -1330,6 +1613,18 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 			f->conn.capable |= FUSE_CAP_BIG_WRITES;
 		if (arg->flags & FUSE_DONT_MASK)
 			f->conn.capable |= FUSE_CAP_DONT_MASK;
+		if (arg->flags & FUSE_DO_READDIRPLUS)
+			f->conn.capable |= FUSE_CAP_READDIRPLUS;
+		if (arg->flags & FUSE_READDIRPLUS_AUTO)
+			f->conn.capable |= FUSE_CAP_READDIRPLUS_AUTO;
+		if (arg->flags & FUSE_WRITEBACK_CACHE)
+			f->conn.capable |= FUSE_CAP_WRITEBACK_CACHE;
+		if (arg->flags & FUSE_PARALLEL_DIROPS)
+			f->conn.capable |= FUSE_CAP_PARALLEL_DIROPS;
+		if (arg->flags & FUSE_NO_OPEN_SUPPORT)
+			f->conn.capable |= FUSE_CAP_NO_OPEN_SUPPORT;
+		if (arg->flags & FUSE_NO_OPENDIR_SUPPORT)
+			f->conn.capable |= FUSE_CAP_NO_OPENDIR_SUPPORT;
 	} else {
 		f->conn.async_read = 0;
 		f->conn.max_readahead = 0;
@@ -1341,7 +1636,31 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		f->conn.want |= FUSE_CAP_POSIX_LOCKS;
 	if (f->big_writes)
 		f->conn.want |= FUSE_CAP_BIG_WRITES;
-
+	if (f->op.readdirplus && !f->no_readdirplus) {
+		f->conn.want |= f->conn.capable & FUSE_CAP_READDIRPLUS;
+		if (!f->no_readdirplus_auto)
+			f->conn.want |= f->conn.capable &
+				FUSE_CAP_READDIRPLUS_AUTO;
+	}
+	if (f->writeback_cache)
+		f->conn.want |= f->conn.capable & FUSE_CAP_WRITEBACK_CACHE;
+	if (f->parallel_dirops)
+		f->conn.want |= f->conn.capable & FUSE_CAP_PARALLEL_DIROPS;
+
+	/*
+	 * Only grow the buffer to what this kernel can actually send, and
+	 * only if the event loop reallocates its buffers to follow.  No
+	 * other request arrives before INIT is answered, so the loop can
+	 * do that before reading the next one.
+	 */
+	if (arg->minor >= 28 && (arg->flags & FUSE_MAX_PAGES))
+		max_pages = FUSE_DEFAULT_MAX_PAGES;
+	if (f->conn.max_write > max_pages * getpagesize())
+		f->conn.max_write = max_pages * getpagesize();
+	if (se->bufsize_follows)
+		fuse_chan_grow_bufsize(req->ch, f->conn.max_write + 4096);
+
+	bufsize = fuse_chan_bufsize(req->ch);
 	if (bufsize < FUSE_MIN_READ_BUFFER) {
 		fprintf(stderr, "fuse: warning: buffer size too small: %zu\n",
 			bufsize);
@@ -1368,8 +1687,21 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		outarg.flags |= FUSE_BIG_WRITES;
 	if (f->conn.want & FUSE_CAP_DONT_MASK)
 		outarg.flags |= FUSE_DONT_MASK;
+	if (f->conn.want & FUSE_CAP_READDIRPLUS)
+		outarg.flags |= FUSE_DO_READDIRPLUS;
+	if (f->conn.want & FUSE_CAP_READDIRPLUS_AUTO)
+		outarg.flags |= FUSE_READDIRPLUS_AUTO;
+	if (f->conn.want & FUSE_CAP_WRITEBACK_CACHE)
+		outarg.flags |= FUSE_WRITEBACK_CACHE;
+	if (f->conn.want & FUSE_CAP_PARALLEL_DIROPS)
+		outarg.flags |= FUSE_PARALLEL_DIROPS;
 	outarg.max_readahead = f->conn.max_readahead;
 	outarg.max_write = f->conn.max_write;
+	if (arg->minor >= 28 && (arg->flags & FUSE_MAX_PAGES)) {
+		max_pages = (outarg.max_write - 1) / getpagesize() + 1;
+		outarg.flags |= FUSE_MAX_PAGES;
+		outarg.max_pages = max_pages > 0xffff ? 0xffff : max_pages;
+	}
 
 #ifdef __APPLE__
 	if (f->conn.enable.setvolname)
@@ -1384,9 +1716,15 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 		fprintf(stderr, "   max_readahead=0x%08x\n",
 			outarg.max_readahead);
 		fprintf(stderr, "   max_write=0x%08x\n", outarg.max_write);
+		if (outarg.flags & FUSE_MAX_PAGES)
+			fprintf(stderr, "   max_pages=%u\n", outarg.max_pages);
 	}
 
-	send_reply_ok(req, &outarg, arg->minor < 5 ? 8 : sizeof(outarg));
+	if (arg->minor < 5)
+		outargsize = FUSE_COMPAT_INIT_OUT_SIZE;
+	else if (arg->minor < 23)
+		outargsize = FUSE_COMPAT_22_INIT_OUT_SIZE;
+	send_reply_ok(req, &outarg, outargsize);
 }
 
 static void do_destroy(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
@@ -1488,6 +1826,86 @@ int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent,
 	return send_notify_iov(f, ch, FUSE_NOTIFY_INVAL_ENTRY, iov, 3);
 }
 
+int fuse_lowlevel_notify_store(struct fuse_chan *ch, fuse_ino_t ino,
+			       off_t offset, const void *buf, size_t size)
+{
+	struct fuse_notify_store_out outarg;
+	struct fuse_ll *f;
+	struct iovec iov[3];
+
+	if (!ch)
+		return -EINVAL;
+
+	f = (struct fuse_ll *)fuse_session_data(fuse_chan_session(ch));
+	if (!f)
+		return -ENODEV;
+
+	if (f->conn.proto_minor < 15)
+		return -ENOSYS;
+
+	memset(&outarg, 0, sizeof(outarg));
+	outarg.nodeid = ino;
+	outarg.offset = offset;
+	outarg.size = size;
+
+	iov[1].iov_base = &outarg;
+	iov[1].iov_len = sizeof(outarg);
+	iov[2].iov_base = (void *)buf;
+	iov[2].iov_len = size;
+
+	return send_notify_iov(f, ch, FUSE_NOTIFY_STORE, iov, 3);
+}
+
+int fuse_lowlevel_notify_retrieve(struct fuse_chan *ch, fuse_ino_t ino,
+				  size_t size, off_t offset, void *cookie)
+{
+	struct fuse_notify_retrieve_out outarg;
+	struct fuse_notify_req *nreq;
+	struct fuse_ll *f;
+	struct iovec iov[2];
+	int err;
+
+	if (!ch)
+		return -EINVAL;
+
+	f = (struct fuse_ll *)fuse_session_data(fuse_chan_session(ch));
+	if (!f)
+		return -ENODEV;
+
+	if (f->conn.proto_minor < 15)
+		return -ENOSYS;
+
+	nreq = (struct fuse_notify_req *) malloc(sizeof(*nreq));
+	if (nreq == NULL)
+		return -ENOMEM;
+
+	/* The reply may be processed before the send returns */
+	pthread_mutex_lock(&f->lock);
+	nreq->unique = f->notify_ctr++;
+	nreq->cookie = cookie;
+	list_add_nreq(nreq, &f->notify_list);
+	pthread_mutex_unlock(&f->lock);
+
+	memset(&outarg, 0, sizeof(outarg));
+	outarg.notify_unique = nreq->unique;
+	outarg.nodeid = ino;
+	outarg.offset = offset;
+	outarg.size = size;
+
+	iov[1].iov_base = &outarg;
+	iov[1].iov_len = sizeof(outarg);
+
+	err = send_notify_iov(f, ch, FUSE_NOTIFY_RETRIEVE, iov, 2);
+	if (err) {
+		pthread_mutex_lock(&f->lock);
+		list_del_nreq(nreq);
+		pthread_mutex_unlock(&f->lock);
+		free(nreq);
+	}
+
+	return err;
+}
+
 void *fuse_req_userdata(fuse_req_t req)
 {
 	return req->f->userdata;
@@ -1576,7 +1994,13 @@ static struct {
 	[FUSE_BMAP]	   = { do_bmap,	       "BMAP"	     },
 	[FUSE_IOCTL]	   = { do_ioctl,       "IOCTL"	     },
 	[FUSE_POLL]	   = { do_poll,        "POLL"	     },
+	[FUSE_NOTIFY_REPLY] = { do_notify_reply, "NOTIFY_REPLY" },
 	[FUSE_DESTROY]	   = { do_destroy,     "DESTROY"     },
+	[FUSE_BATCH_FORGET] = { do_batch_forget, "BATCH_FORGET" },
+	[FUSE_FALLOCATE]   = { do_fallocate,   "FALLOCATE"   },
+	[FUSE_READDIRPLUS] = { do_readdirplus, "READDIRPLUS" },
+	[FUSE_LSEEK]	   = { do_lseek,       "LSEEK"	     },
+	[FUSE_COPY_FILE_RANGE] = { do_copy_file_range, "COPY_FILE_RANGE" },
 #ifdef __APPLE__
 	[FUSE_SETVOLNAME]  = { do_setvolname,  "SETVOLNAME"  },
 	[FUSE_EXCHANGE]    = { do_exchange,    "EXCHANGE"    },
@@ -1611,7 +2035,7 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
 			opname((enum fuse_opcode) in->opcode), in->opcode,
 			(unsigned long) in->nodeid, len);
 
-	req = (struct fuse_req *) calloc(1, sizeof(struct fuse_req));
+	req = fuse_ll_alloc_req(f);
 	if (req == NULL) {
 		struct fuse_out_header out = {
 			.unique = in->unique,
@@ -1623,20 +2047,15 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
 			.iov_len = sizeof(struct fuse_out_header),
 		};
 
-		fprintf(stderr, "fuse: failed to allocate request\n");
 		fuse_chan_send(ch, &iov, 1);
 		return;
 	}
 
-	req->f = f;
 	req->unique = in->unique;
 	req->ctx.uid = in->uid;
 	req->ctx.gid = in->gid;
 	req->ctx.pid = in->pid;
 	req->ch = ch;
-	req->ctr = 1;
-	list_init_req(req);
-	fuse_mutex_init(&req->lock);
 
 	err = EIO;
 	if (!f->got_init) {
@@ -1653,7 +2072,9 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
 		 in->opcode != FUSE_INIT && in->opcode != FUSE_READ &&
 		 in->opcode != FUSE_WRITE && in->opcode != FUSE_FSYNC &&
 		 in->opcode != FUSE_RELEASE && in->opcode != FUSE_READDIR &&
-		 in->opcode != FUSE_FSYNCDIR && in->opcode != FUSE_RELEASEDIR)
+		 in->opcode != FUSE_READDIRPLUS &&
+		 in->opcode != FUSE_FSYNCDIR && in->opcode != FUSE_RELEASEDIR &&
+		 in->opcode != FUSE_NOTIFY_REPLY)
 		goto reply_err;
 
 	err = ENOSYS;
@@ -1691,6 +2112,10 @@ static struct fuse_opt fuse_ll_opts[] = {
 	{ "atomic_o_trunc", offsetof(struct fuse_ll, atomic_o_trunc), 1},
 	{ "no_remote_lock", offsetof(struct fuse_ll, no_remote_lock), 1},
 	{ "big_writes", offsetof(struct fuse_ll, big_writes), 1},
+	{ "no_readdirplus", offsetof(struct fuse_ll, no_readdirplus), 1},
+	{ "no_readdirplus_auto", offsetof(struct fuse_ll, no_readdirplus_auto), 1},
+	{ "writeback_cache", offsetof(struct fuse_ll, writeback_cache), 1},
+	{ "parallel_dirops", offsetof(struct fuse_ll, parallel_dirops), 1},
 	FUSE_OPT_KEY("max_read=", FUSE_OPT_KEY_DISCARD),
 	FUSE_OPT_KEY("-h", KEY_HELP),
 	FUSE_OPT_KEY("--help", KEY_HELP),
@@ -1719,7 +2144,11 @@ static void fuse_ll_help(void)
 "    -o sync_read           perform reads synchronously\n"
 "    -o atomic_o_trunc      enable atomic open+truncate support\n"
 "    -o big_writes          enable larger than 4kB writes\n"
-"    -o no_remote_lock      disable remote file locking\n");
+"    -o no_remote_lock      disable remote file locking\n"
+"    -o no_readdirplus      disable readdirplus\n"
+"    -o no_readdirplus_auto use readdirplus for all directory reads\n"
+"    -o writeback_cache     enable caching of writes in the kernel\n"
+"    -o parallel_dirops     allow parallel lookups and readdirs\n");
 }
 
 static int fuse_ll_opt_proc(void *data, const char *arg, int key,
@@ -1757,6 +2186,12 @@ static void fuse_ll_destroy(void *data)
 			f->op.destroy(f->userdata);
 	}
 
+	while (f->notify_list.next != &f->notify_list) {
+		struct fuse_notify_req *nreq = f->notify_list.next;
+		list_del_nreq(nreq);
+		free(nreq);
+	}
+
 	pthread_mutex_destroy(&f->lock);
 	free(f->cuse_data);
 	free(f);
@@ -1795,6 +2230,8 @@ struct fuse_session *fuse_lowlevel_new_common(struct fuse_args *args,
 	f->atomic_o_trunc = 0;
 	list_init_req(&f->list);
 	list_init_req(&f->interrupts);
+	list_init_nreq(&f->notify_list);
+	f->notify_ctr = 1;
 	fuse_mutex_init(&f->lock);
 
 	if (fuse_opt_parse(args, f, fuse_ll_opts, fuse_ll_opt_proc) == -1)
@@ -0,0 +1,517 @@
+/*
+  FUSE: Filesystem in Userspace
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+/*
+ * Persistent map of (parent node ID, name) to (node ID, generation).
+ *
+ * The map is an append-only log of records in a memory mapped file.  A
+ * record either assigns a node ID to a name, replacing any earlier
+ * assignment of the same name or the same ID, or removes the name.  The
+ * log is replayed into hash tables on open, and rewritten without the
+ * superseded records if they outnumber the live ones.
+ *
+ * The header keeps a high-water mark of allocated node IDs, which is
+ * advanced in steps, so that IDs handed out before a crash are not
+ * reused even if the last records did not make it to disk.
+ */
+
+#include "fuse_i.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NODEMAP_MAGIC "FUSEMAP1"
+#define NODEMAP_MIN_SIZE (1 << 20)
+#define NODEMAP_RESERVE 4096
+#define NODEMAP_TABLE_SIZE 1024
+
+#define NODEMAP_REMOVED 1
+
+struct nodemap_header {
+	char magic[8];
+	uint64_t reserved_id;
+	uint64_t generation;
+	uint64_t end;
+};
+
+/* Followed by the name, and padded to a multiple of 8 bytes */
+struct nodemap_rec {
+	uint64_t nodeid;
+	uint64_t parent;
+	uint32_t generation;
+	uint16_t namelen;
+	uint16_t flags;
+};
+
+struct nodemap_entry {
+	struct nodemap_entry *name_next;
+	struct nodemap_entry *id_next;
+	uint64_t nodeid;
+	uint64_t parent;
+	unsigned int generation;
+	size_t off;
+};
+
+struct fuse_nodemap {
+	int fd;
+	char *base;
+	size_t size;
+	struct nodemap_entry **name_table;
+	struct nodemap_entry **id_table;
+	size_t table_size;
+	size_t count;
+	size_t dead;
+};
+
+static struct nodemap_header *nodemap_header(struct fuse_nodemap *map)
+{
+	return (struct nodemap_header *) map->base;
+}
+
+static struct nodemap_rec *nodemap_rec(struct fuse_nodemap *map, size_t off)
+{
+	return (struct nodemap_rec *) (map->base + off);
+}
+
+static size_t rec_len(size_t namelen)
+{
+	return (sizeof(struct nodemap_rec) + namelen + 7) & ~(size_t) 7;
+}
+
+static size_t name_hash(uint64_t parent, const char *name, size_t len,
+			size_t size)
+{
+	uint64_t hash = parent;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash << 5) - hash + (unsigned char) name[i];
+
+	return hash % size;
+}
+
+static int entry_matches(struct fuse_nodemap *map, struct nodemap_entry *e,
+			 uint64_t parent, const char *name, size_t len)
+{
+	struct nodemap_rec *rec = nodemap_rec(map, e->off);
+
+	return e->parent == parent && rec->namelen == len &&
+		memcmp(rec + 1, name, len) == 0;
+}
+
+static struct nodemap_entry **find_name(struct fuse_nodemap *map,
+					uint64_t parent, const char *name,
+					size_t len)
+{
+	struct nodemap_entry **ep;
+
+	ep = &map->name_table[name_hash(parent, name, len, map->table_size)];
+	for (; *ep; ep = &(*ep)->name_next)
+		if (entry_matches(map, *ep, parent, name, len))
+			break;
+
+	return ep;
+}
+
+static struct nodemap_entry **find_id(struct fuse_nodemap *map,
+				      uint64_t nodeid)
+{
+	struct nodemap_entry **ep = &map->id_table[nodeid % map->table_size];
+
+	for (; *ep; ep = &(*ep)->id_next)
+		if ((*ep)->nodeid == nodeid)
+			break;
+
+	return ep;
+}
+
+static void delete_entry(struct fuse_nodemap *map, struct nodemap_entry *e)
+{
+	struct nodemap_rec *rec = nodemap_rec(map, e->off);
+	struct nodemap_entry **ep;
+
+	ep = find_name(map, e->parent, (char *) (rec + 1), rec->namelen);
+	*ep = e->name_next;
+	ep = find_id(map, e->nodeid);
+	*ep = e->id_next;
+	free(e);
+	map->count--;
+	map->dead++;
+}
+
+static void rehash(struct fuse_nodemap *map)
+{
+	size_t newsize = map->table_size * 2;
+	struct nodemap_entry **name_table;
+	struct nodemap_entry **id_table;
+	size_t i;
+
+	name_table = calloc(newsize, sizeof(struct nodemap_entry *));
+	id_table = calloc(newsize, sizeof(struct nodemap_entry *));
+	if (name_table == NULL || id_table == NULL) {
+		free(name_table);
+		free(id_table);
+		return;
+	}
+
+	for (i = 0; i < map->table_size; i++) {
+		struct nodemap_entry *e;
+		struct nodemap_entry *next;
+
+		for (e = map->id_table[i]; e; e = next) {
+			struct nodemap_rec *rec = nodemap_rec(map, e->off);
+			size_t hash = name_hash(e->parent, (char *) (rec + 1),
+						rec->namelen, newsize);
+
+			next = e->id_next;
+			e->name_next = name_table[hash];
+			name_table[hash] = e;
+			e->id_next = id_table[e->nodeid % newsize];
+			id_table[e->nodeid % newsize] = e;
+		}
+	}
+	free(map->name_table);
+	free(map->id_table);
+	map->name_table = name_table;
+	map->id_table = id_table;
+	map->table_size = newsize;
+}
+
+/* Bring the hash tables up to date with the record at 'off' */
+static int apply_rec(struct fuse_nodemap *map, size_t off)
+{
+	struct nodemap_rec *rec = nodemap_rec(map, off);
+	const char *name = (char *) (rec + 1);
+	struct nodemap_entry *e;
+	struct nodemap_entry **ep;
+
+	e = *find_name(map, rec->parent, name, rec->namelen);
+	if (e)
+		delete_entry(map, e);
+	if (rec->flags & NODEMAP_REMOVED) {
+		map->dead++;
+		return 0;
+	}
+
+	e = *find_id(map, rec->nodeid);
+	if (e)
+		delete_entry(map, e);
+
+	e = malloc(sizeof(struct nodemap_entry));
+	if (e == NULL)
+		return -1;
+
+	e->nodeid = rec->nodeid;
+	e->parent = rec->parent;
+	e->generation = rec->generation;
+	e->off = off;
+	if (map->count >= map->table_size * 2)
+		rehash(map);
+	ep = &map->name_table[name_hash(e->parent, name, rec->namelen,
+					map->table_size)];
+	e->name_next = *ep;
+	*ep = e;
+	ep = &map->id_table[e->nodeid % map->table_size];
+	e->id_next = *ep;
+	*ep = e;
+	map->count++;
+
+	return 0;
+}
+
+static void free_tables(struct fuse_nodemap *map)
+{
+	size_t i;
+
+	if (map->id_table) {
+		for (i = 0; i < map->table_size; i++) {
+			struct nodemap_entry *e;
+			struct nodemap_entry *next;
+
+			for (e = map->id_table[i]; e; e = next) {
+				next = e->id_next;
+				free(e);
+			}
+		}
+	}
+	free(map->name_table);
+	free(map->id_table);
+}
+
+static int nodemap_resize(struct fuse_nodemap *map, size_t size)
+{
+	char *base;
+
+	if (ftruncate(map->fd, size) == -1) {
+		perror("fuse: failed to resize node map");
+		return -1;
+	}
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+	if (base == MAP_FAILED) {
+		perror("fuse: failed to map node map");
+		return -1;
+	}
+	if (map->base)
+		munmap(map->base, map->size);
+	map->base = base;
+	map->size = size;
+
+	return 0;
+}
+
+static int append_rec(struct fuse_nodemap *map, uint64_t parent,
+		      const char *name, uint64_t nodeid,
+		      unsigned int generation, int flags)
+{
+	struct nodemap_header *hdr = nodemap_header(map);
+	size_t namelen = strlen(name);
+	size_t len = rec_len(namelen);
+	struct nodemap_rec *rec;
+	size_t off = hdr->end;
+
+	if (namelen > 0xffff)
+		return -1;
+
+	if (off + len > map->size) {
+		size_t size = map->size;
+
+		while (off + len > size)
+			size *= 2;
+		if (nodemap_resize(map, size) == -1)
+			return -1;
+		hdr = nodemap_header(map);
+	}
+
+	rec = nodemap_rec(map, off);
+	rec->nodeid = nodeid;
+	rec->parent = parent;
+	rec->generation = generation;
+	rec->namelen = namelen;
+	rec->flags = flags;
+	memcpy(rec + 1, name, namelen);
+	hdr->end = off + len;
+
+	return apply_rec(map, off);
+}
+
+/* Write the live records to a new file, and replace the map with it */
+static int nodemap_compact(struct fuse_nodemap *map, const char *path)
+{
+	struct nodemap_header hdr = *nodemap_header(map);
+	size_t pathlen = strlen(path);
+	char *tmppath;
+	FILE *fp;
+	size_t i;
+	int res = -1;
+
+	tmppath = malloc(pathlen + 5);
+	if (tmppath == NULL)
+		return -1;
+	memcpy(tmppath, path, pathlen);
+	strcpy(tmppath + pathlen, ".tmp");
+
+	fp = fopen(tmppath, "w");
+	if (fp == NULL)
+		goto out_free;
+
+	hdr.end = sizeof(hdr);
+	for (i = 0; i < map->table_size; i++) {
+		struct nodemap_entry *e;
+
+		for (e = map->id_table[i]; e; e = e->id_next)
+			hdr.end += rec_len(nodemap_rec(map, e->off)->namelen);
+	}
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (i = 0; i < map->table_size; i++) {
+		struct nodemap_entry *e;
+
+		for (e = map->id_table[i]; e; e = e->id_next) {
+			struct nodemap_rec *rec = nodemap_rec(map, e->off);
+			fwrite(rec, rec_len(rec->namelen), 1, fp);
+		}
+	}
+	if (fflush(fp) == 0 && !ferror(fp) && fsync(fileno(fp)) == 0)
+		res = 0;
+	if (fclose(fp) != 0)
+		res = -1;
+	if (res == 0)
+		res = rename(tmppath, path);
+	if (res == -1)
+		unlink(tmppath);
+out_free:
+	free(tmppath);
+	return res;
+}
+
+static struct fuse_nodemap *nodemap_load(const char *path, int compact)
+{
+	struct fuse_nodemap *map;
+	struct nodemap_header *hdr;
+	struct stat stbuf;
+	size_t size;
+	size_t off;
+
+	map = calloc(1, sizeof(struct fuse_nodemap));
+	if (map == NULL) {
+		fprintf(stderr, "fuse: memory allocation failed\n");
+		return NULL;
+	}
+	map->table_size = NODEMAP_TABLE_SIZE;
+	map->name_table = calloc(map->table_size, sizeof(struct nodemap_entry *));
+	map->id_table = calloc(map->table_size, sizeof(struct nodemap_entry *));
+	if (map->name_table == NULL || map->id_table == NULL) {
+		fprintf(stderr, "fuse: memory allocation failed\n");
+		goto out_free;
+	}
+
+	map->fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (map->fd == -1) {
+		fprintf(stderr, "fuse: failed to open node map %s: %s\n",
+			path, strerror(errno));
+		goto out_free;
+	}
+	if (fstat(map->fd, &stbuf) == -1) {
+		perror("fuse: failed to stat node map");
+		goto out_close;
+	}
+
+	size = stbuf.st_size;
+	if (size < NODEMAP_MIN_SIZE)
+		size = NODEMAP_MIN_SIZE;
+	if (nodemap_resize(map, size) == -1)
+		goto out_close;
+
+	hdr = nodemap_header(map);
+	if (memcmp(hdr->magic, NODEMAP_MAGIC, sizeof(hdr->magic)) != 0) {
+		if (stbuf.st_size != 0) {
+			fprintf(stderr, "fuse: %s is not a node map\n", path);
+			goto out_unmap;
+		}
+		memcpy(hdr->magic, NODEMAP_MAGIC, sizeof(hdr->magic));
+		hdr->reserved_id = FUSE_ROOT_ID;
+		hdr->generation = 0;
+		hdr->end = sizeof(struct nodemap_header);
+	}
+
+	/* Replay the log, dropping a torn record at the end */
+	off = sizeof(struct nodemap_header);
+	while (off + sizeof(struct nodemap_rec) <= hdr->end &&
+	       off + sizeof(struct nodemap_rec) <= map->size) {
+		struct nodemap_rec *rec = nodemap_rec(map, off);
+		size_t len = rec_len(rec->namelen);
+
+		if (!rec->namelen || off + len > hdr->end ||
+		    off + len > map->size)
+			break;
+		if (apply_rec(map, off) == -1) {
+			fprintf(stderr, "fuse: memory allocation failed\n");
+			goto out_unmap;
+		}
+		off += len;
+	}
+	hdr->end = off;
+
+	if (compact && map->dead > 1024 && map->dead > map->count &&
+	    nodemap_compact(map, path) == 0) {
+		fuse_nodemap_close(map);
+		return nodemap_load(path, 0);
+	}
+
+	return map;
+
+out_unmap:
+	munmap(map->base, map->size);
+out_close:
+	close(map->fd);
+out_free:
+	free_tables(map);
+	free(map);
+	return NULL;
+}
+
+struct fuse_nodemap *fuse_nodemap_open(const char *path)
+{
+	return nodemap_load(path, 1);
+}
+
+void fuse_nodemap_close(struct fuse_nodemap *map)
+{
+	munmap(map->base, map->size);
+	close(map->fd);
+	free_tables(map);
+	free(map);
+}
+
+void fuse_nodemap_next_id(struct fuse_nodemap *map, uint64_t *nodeid,
+			  unsigned int *generation)
+{
+	struct nodemap_header *hdr = nodemap_header(map);
+
+	*nodeid = hdr->reserved_id;
+	*generation = hdr->generation;
+}
+
+void fuse_nodemap_reserve(struct fuse_nodemap *map, uint64_t nodeid,
+			  unsigned int generation)
+{
+	struct nodemap_header *hdr = nodemap_header(map);
+
+	if (nodeid < hdr->reserved_id && generation == hdr->generation)
+		return;
+
+	hdr->reserved_id = nodeid + NODEMAP_RESERVE;
+	hdr->generation = generation;
+	msync(map->base, sizeof(struct nodemap_header), MS_SYNC);
+}
+
+int fuse_nodemap_lookup(struct fuse_nodemap *map, uint64_t parent,
+			const char *name, uint64_t *nodeid,
+			unsigned int *generation)
+{
+	struct nodemap_entry *e;
+
+	e = *find_name(map, parent, name, strlen(name));
+	if (e == NULL)
+		return -ENOENT;
+
+	*nodeid = e->nodeid;
+	*generation = e->generation;
+	return 0;
+}
+
+int fuse_nodemap_id_used(struct fuse_nodemap *map, uint64_t nodeid)
+{
+	return *find_id(map, nodeid) != NULL;
+}
+
+void fuse_nodemap_add(struct fuse_nodemap *map, uint64_t parent,
+		      const char *name, uint64_t nodeid,
+		      unsigned int generation)
+{
+	struct nodemap_entry *e;
+
+	e = *find_id(map, nodeid);
+	if (e && e->parent == parent && e->generation == generation &&
+	    entry_matches(map, e, parent, name, strlen(name)))
+		return;
+
+	append_rec(map, parent, name, nodeid, generation, 0);
+}
+
+void fuse_nodemap_remove(struct fuse_nodemap *map, uint64_t parent,
+			 const char *name)
+{
+	if (*find_name(map, parent, name, strlen(name)) != NULL)
+		append_rec(map, parent, name, 0, 0, NODEMAP_REMOVED);
+}
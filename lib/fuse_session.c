@@ -16,10 +16,15 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <sys/mman.h>
 #ifdef __APPLE__
 #include <sys/param.h>
 #endif /* __APPLE__ */
 
+/* Environment var for backing receive buffers with huge pages */
+#define ENVNAME_HUGE_BUFFERS "FUSE_HUGE_BUFFERS"
+#define HUGE_PAGE_SIZE 0x200000
+
 struct fuse_chan {
 	struct fuse_chan_ops op;
 
@@ -162,6 +167,30 @@ size_t fuse_chan_bufsize(struct fuse_chan *ch)
 	return ch->bufsize;
 }
 
+void fuse_chan_grow_bufsize(struct fuse_chan *ch, size_t bufsize)
+{
+	if (ch->bufsize < bufsize)
+		ch->bufsize = bufsize;
+}
+
+void *fuse_chan_buf_alloc(size_t bufsize)
+{
+#ifdef MADV_HUGEPAGE
+	if (getenv(ENVNAME_HUGE_BUFFERS)) {
+		size_t size = (bufsize + HUGE_PAGE_SIZE - 1) &
+			~((size_t) HUGE_PAGE_SIZE - 1);
+		void *buf;
+
+		if (posix_memalign(&buf, HUGE_PAGE_SIZE, size) != 0)
+			return NULL;
+		/* Only a hint, transparent huge pages may be disabled */
+		madvise(buf, size, MADV_HUGEPAGE);
+		return buf;
+	}
+#endif
+	return malloc(bufsize);
+}
+
 void *fuse_chan_data(struct fuse_chan *ch)
 {
 	return ch->data;
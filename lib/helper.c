@@ -353,7 +353,8 @@ static void fuse_teardown_common(struct fuse *fuse, char *mountpoint)
 	struct fuse_session *se = fuse_get_session(fuse);
 	struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
 	fuse_remove_signal_handlers(se);
-	fuse_unmount_common(mountpoint, ch);
+	if (!fuse_is_handed_off(fuse))
+		fuse_unmount_common(mountpoint, ch);
 	fuse_destroy(fuse);
 	free(mountpoint);
 }
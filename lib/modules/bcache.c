@@ -0,0 +1,971 @@
+/*
+  fuse bcache module: cache file data in userspace
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define BCACHE_SHARDS 16
+#define BCACHE_FILE_HASH 64
+#define BCACHE_BLOCK_HASH 1024
+
+struct bcache_file;
+
+struct bcache_block {
+	struct bcache_block *hash_next;
+	struct bcache_block *lru_prev;
+	struct bcache_block *lru_next;
+	struct bcache_block *file_prev;
+	struct bcache_block *file_next;
+	struct bcache_file *file;
+	uint64_t idx;
+	size_t len;
+	char *data;
+};
+
+/* All cached blocks of one path */
+struct bcache_file {
+	struct bcache_file *next;
+	struct bcache_block *blocks;
+	char *path;
+};
+
+/*
+ * Files are spread over the shards by the hash of their path, so all
+ * blocks of one file live in the same shard and can be dropped under a
+ * single lock.
+ */
+struct bcache_shard {
+	pthread_mutex_t lock;
+	struct bcache_file *files[BCACHE_FILE_HASH];
+	struct bcache_block *blocks[BCACHE_BLOCK_HASH];
+	struct bcache_block lru;
+	size_t nblocks;
+	size_t maxblocks;
+	unsigned long long gen;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	unsigned long long invalidations;
+};
+
+struct bcache {
+	struct fuse_fs *next;
+	unsigned int bsize;
+	unsigned int nblocks;
+	int stats;
+	struct bcache_shard shards[BCACHE_SHARDS];
+};
+
+static struct bcache *bcache_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static unsigned int bcache_hash_path(const char *path)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *path; path++)
+		hash = (hash ^ (unsigned char) *path) * 16777619U;
+
+	return hash;
+}
+
+static struct bcache_shard *bcache_shard(struct bcache *bc, unsigned int hash)
+{
+	return &bc->shards[hash % BCACHE_SHARDS];
+}
+
+static size_t bcache_block_hash(struct bcache_file *file, uint64_t idx)
+{
+	uint64_t hash = (uintptr_t) file ^ (idx * 0x9e3779b97f4a7c15ULL);
+
+	return (hash ^ (hash >> 32)) % BCACHE_BLOCK_HASH;
+}
+
+static struct bcache_file *bcache_find_file(struct bcache_shard *sh,
+					    const char *path,
+					    unsigned int hash)
+{
+	struct bcache_file *file;
+
+	file = sh->files[(hash / BCACHE_SHARDS) % BCACHE_FILE_HASH];
+	for (; file != NULL; file = file->next)
+		if (strcmp(file->path, path) == 0)
+			break;
+
+	return file;
+}
+
+static struct bcache_block *bcache_find_block(struct bcache_shard *sh,
+					      struct bcache_file *file,
+					      uint64_t idx)
+{
+	struct bcache_block *blk;
+
+	blk = sh->blocks[bcache_block_hash(file, idx)];
+	for (; blk != NULL; blk = blk->hash_next)
+		if (blk->file == file && blk->idx == idx)
+			break;
+
+	return blk;
+}
+
+static void bcache_lru_del(struct bcache_block *blk)
+{
+	blk->lru_prev->lru_next = blk->lru_next;
+	blk->lru_next->lru_prev = blk->lru_prev;
+}
+
+static void bcache_lru_add(struct bcache_shard *sh, struct bcache_block *blk)
+{
+	blk->lru_next = sh->lru.lru_next;
+	blk->lru_prev = &sh->lru;
+	sh->lru.lru_next->lru_prev = blk;
+	sh->lru.lru_next = blk;
+}
+
+static void bcache_remove_file(struct bcache_shard *sh,
+			       struct bcache_file *file)
+{
+	struct bcache_file **filep;
+	unsigned int hash = bcache_hash_path(file->path);
+
+	filep = &sh->files[(hash / BCACHE_SHARDS) % BCACHE_FILE_HASH];
+	for (; *filep != NULL; filep = &(*filep)->next) {
+		if (*filep == file) {
+			*filep = file->next;
+			break;
+		}
+	}
+	free(file->path);
+	free(file);
+}
+
+static void bcache_remove_block(struct bcache_shard *sh,
+				struct bcache_block *blk)
+{
+	struct bcache_file *file = blk->file;
+	struct bcache_block **blkp;
+
+	blkp = &sh->blocks[bcache_block_hash(file, blk->idx)];
+	for (; *blkp != NULL; blkp = &(*blkp)->hash_next) {
+		if (*blkp == blk) {
+			*blkp = blk->hash_next;
+			break;
+		}
+	}
+	bcache_lru_del(blk);
+	if (blk->file_prev)
+		blk->file_prev->file_next = blk->file_next;
+	else
+		file->blocks = blk->file_next;
+	if (blk->file_next)
+		blk->file_next->file_prev = blk->file_prev;
+	sh->nblocks--;
+
+	if (file->blocks == NULL)
+		bcache_remove_file(sh, file);
+	free(blk->data);
+	free(blk);
+}
+
+static void bcache_insert_block(struct bcache_shard *sh, const char *path,
+				unsigned int hash, uint64_t idx, char *data,
+				size_t len)
+{
+	struct bcache_file *file;
+	struct bcache_block *blk;
+	size_t bh;
+
+	blk = calloc(1, sizeof(struct bcache_block));
+	if (blk == NULL)
+		goto out_free;
+
+	file = bcache_find_file(sh, path, hash);
+	if (file == NULL) {
+		size_t fh = (hash / BCACHE_SHARDS) % BCACHE_FILE_HASH;
+
+		file = calloc(1, sizeof(struct bcache_file));
+		if (file == NULL)
+			goto out_free_blk;
+		file->path = strdup(path);
+		if (file->path == NULL) {
+			free(file);
+			goto out_free_blk;
+		}
+		file->next = sh->files[fh];
+		sh->files[fh] = file;
+	} else if (bcache_find_block(sh, file, idx) != NULL) {
+		/* somebody else got there first */
+		goto out_free_blk;
+	}
+
+	while (sh->nblocks >= sh->maxblocks && sh->lru.lru_prev != &sh->lru) {
+		struct bcache_block *old = sh->lru.lru_prev;
+
+		/* never free the file we are adding to */
+		if (old->file == file && file->blocks == old &&
+		    old->file_next == NULL) {
+			bcache_lru_del(old);
+			bcache_lru_add(sh, old);
+			break;
+		}
+		bcache_remove_block(sh, old);
+		sh->evictions++;
+	}
+
+	blk->file = file;
+	blk->idx = idx;
+	blk->len = len;
+	blk->data = data;
+	blk->file_next = file->blocks;
+	if (file->blocks)
+		file->blocks->file_prev = blk;
+	file->blocks = blk;
+	bh = bcache_block_hash(file, idx);
+	blk->hash_next = sh->blocks[bh];
+	sh->blocks[bh] = blk;
+	bcache_lru_add(sh, blk);
+	sh->nblocks++;
+	return;
+
+out_free_blk:
+	free(blk);
+out_free:
+	free(data);
+}
+
+/* Drop all cached blocks of a file, called with the shard locked */
+static void bcache_drop_file(struct bcache_shard *sh,
+			     struct bcache_file *file)
+{
+	sh->invalidations++;
+	while (file->blocks->file_next != NULL)
+		bcache_remove_block(sh, file->blocks);
+	/* removing the last block frees the file too */
+	bcache_remove_block(sh, file->blocks);
+}
+
+static void bcache_invalidate(struct bcache *bc, const char *path)
+{
+	unsigned int hash;
+	struct bcache_shard *sh;
+	struct bcache_file *file;
+
+	if (path == NULL)
+		return;
+
+	hash = bcache_hash_path(path);
+	sh = bcache_shard(bc, hash);
+	pthread_mutex_lock(&sh->lock);
+	/* Fills that started before this point must not be inserted */
+	sh->gen++;
+	file = bcache_find_file(sh, path, hash);
+	if (file != NULL)
+		bcache_drop_file(sh, file);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/*
+ * Invalidate 'path' and, if it is a directory, everything below it.
+ * Files under a directory are spread over all the shards, so each one
+ * has to be searched.
+ */
+static void bcache_invalidate_tree(struct bcache *bc, const char *path)
+{
+	size_t len;
+	int i;
+
+	if (path == NULL)
+		return;
+
+	bcache_invalidate(bc, path);
+	len = strlen(path);
+	for (i = 0; i < BCACHE_SHARDS; i++) {
+		struct bcache_shard *sh = &bc->shards[i];
+		int j;
+
+		pthread_mutex_lock(&sh->lock);
+		sh->gen++;
+		for (j = 0; j < BCACHE_FILE_HASH; j++) {
+			struct bcache_file *file;
+			struct bcache_file *next;
+
+			for (file = sh->files[j]; file != NULL; file = next) {
+				next = file->next;
+				if (strncmp(file->path, path, len) == 0 &&
+				    file->path[len] == '/')
+					bcache_drop_file(sh, file);
+			}
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
+
+/*
+ * Copy data from block 'idx' into 'buf', starting at 'boff' within the
+ * block, reading the whole block from the next filesystem on a miss.
+ * Returns the number of bytes copied and sets '*eof' if the block was
+ * short, or a negative error.
+ */
+static int bcache_read_block(struct bcache *bc, const char *path,
+			     unsigned int hash, uint64_t idx, size_t boff,
+			     char *buf, size_t size, int *eof,
+			     struct fuse_file_info *fi)
+{
+	struct bcache_shard *sh = bcache_shard(bc, hash);
+	struct bcache_file *file;
+	struct bcache_block *blk = NULL;
+	unsigned long long gen;
+	size_t len;
+	char *data;
+	int res;
+
+	pthread_mutex_lock(&sh->lock);
+	file = bcache_find_file(sh, path, hash);
+	if (file != NULL)
+		blk = bcache_find_block(sh, file, idx);
+	if (blk != NULL) {
+		sh->hits++;
+		bcache_lru_del(blk);
+		bcache_lru_add(sh, blk);
+		len = 0;
+		if (boff < blk->len) {
+			len = blk->len - boff;
+			if (len > size)
+				len = size;
+			memcpy(buf, blk->data + boff, len);
+		}
+		*eof = blk->len < bc->bsize;
+		pthread_mutex_unlock(&sh->lock);
+		return len;
+	}
+	sh->misses++;
+	gen = sh->gen;
+	pthread_mutex_unlock(&sh->lock);
+
+	data = malloc(bc->bsize);
+	if (data == NULL)
+		return -ENOMEM;
+
+	res = fuse_fs_read(bc->next, path, data, bc->bsize,
+			   (off_t) idx * bc->bsize, fi);
+	if (res < 0) {
+		free(data);
+		return res;
+	}
+
+	len = 0;
+	if (boff < (size_t) res) {
+		len = res - boff;
+		if (len > size)
+			len = size;
+		memcpy(buf, data + boff, len);
+	}
+	*eof = (size_t) res < bc->bsize;
+
+	pthread_mutex_lock(&sh->lock);
+	if (sh->gen == gen)
+		bcache_insert_block(sh, path, hash, idx, data, res);
+	else
+		free(data);
+	pthread_mutex_unlock(&sh->lock);
+
+	return len;
+}
+
+static int bcache_getattr(const char *path, struct stat *stbuf)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_getattr(bc->next, path, stbuf);
+}
+
+static int bcache_fgetattr(const char *path, struct stat *stbuf,
+			   struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_fgetattr(bc->next, path, stbuf, fi);
+}
+
+static int bcache_access(const char *path, int mask)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_access(bc->next, path, mask);
+}
+
+static int bcache_readlink(const char *path, char *buf, size_t size)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_readlink(bc->next, path, buf, size);
+}
+
+static int bcache_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_opendir(bc->next, path, fi);
+}
+
+static int bcache_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_readdir(bc->next, path, buf, filler, offset, fi);
+}
+
+static int bcache_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_releasedir(bc->next, path, fi);
+}
+
+static int bcache_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_mknod(bc->next, path, mode, rdev);
+}
+
+static int bcache_mkdir(const char *path, mode_t mode)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_mkdir(bc->next, path, mode);
+}
+
+static int bcache_rmdir(const char *path)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_rmdir(bc->next, path);
+}
+
+static int bcache_symlink(const char *from, const char *path)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_symlink(bc->next, from, path);
+}
+
+static int bcache_link(const char *from, const char *to)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_link(bc->next, from, to);
+}
+
+#ifdef __APPLE__
+
+static int bcache_setvolname(const char *volname)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_setvolname(bc->next, volname);
+}
+
+static int bcache_chflags(const char *path, uint32_t flags)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_chflags(bc->next, path, flags);
+}
+
+static int bcache_getxtimes(const char *path, struct timespec *bkuptime,
+			    struct timespec *crtime)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_getxtimes(bc->next, path, bkuptime, crtime);
+}
+
+static int bcache_setbkuptime(const char *path, const struct timespec *bkuptime)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_setbkuptime(bc->next, path, bkuptime);
+}
+
+static int bcache_setchgtime(const char *path, const struct timespec *chgtime)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_setchgtime(bc->next, path, chgtime);
+}
+
+static int bcache_setcrtime(const char *path, const struct timespec *crtime)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_setcrtime(bc->next, path, crtime);
+}
+
+#endif /* __APPLE__ */
+
+static int bcache_chmod(const char *path, mode_t mode)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_chmod(bc->next, path, mode);
+}
+
+static int bcache_chown(const char *path, uid_t uid, gid_t gid)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_chown(bc->next, path, uid, gid);
+}
+
+static int bcache_utimens(const char *path, const struct timespec ts[2])
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_utimens(bc->next, path, ts);
+}
+
+static int bcache_statfs(const char *path, struct statvfs *stbuf)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_statfs(bc->next, path, stbuf);
+}
+
+static int bcache_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_flush(bc->next, path, fi);
+}
+
+static int bcache_fsync(const char *path, int isdatasync,
+			struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_fsync(bc->next, path, isdatasync, fi);
+}
+
+static int bcache_fsyncdir(const char *path, int isdatasync,
+			   struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_fsyncdir(bc->next, path, isdatasync, fi);
+}
+
+#ifdef __APPLE__
+static int bcache_setxattr(const char *path, const char *name,
+		       const char *value, size_t size, int flags,
+		       uint32_t position)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_setxattr(bc->next, path, name, value, size, flags,
+				position);
+}
+
+static int bcache_getxattr(const char *path, const char *name, char *value,
+		       size_t size, uint32_t position)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_getxattr(bc->next, path, name, value, size, position);
+}
+#else
+static int bcache_setxattr(const char *path, const char *name,
+		       const char *value, size_t size, int flags)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_setxattr(bc->next, path, name, value, size, flags);
+}
+
+static int bcache_getxattr(const char *path, const char *name, char *value,
+		       size_t size)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_getxattr(bc->next, path, name, value, size);
+}
+#endif /* __APPLE__ */
+
+static int bcache_listxattr(const char *path, char *list, size_t size)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_listxattr(bc->next, path, list, size);
+}
+
+static int bcache_removexattr(const char *path, const char *name)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_removexattr(bc->next, path, name);
+}
+
+static int bcache_lock(const char *path, struct fuse_file_info *fi, int cmd,
+		       struct flock *lock)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_lock(bc->next, path, fi, cmd, lock);
+}
+
+static int bcache_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_bmap(bc->next, path, blocksize, idx);
+}
+
+static int bcache_ioctl(const char *path, int cmd, void *arg,
+			struct fuse_file_info *fi, unsigned int flags,
+			void *data)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_ioctl(bc->next, path, cmd, arg, fi, flags, data);
+}
+
+static int bcache_poll(const char *path, struct fuse_file_info *fi,
+		       struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_poll(bc->next, path, fi, ph, reventsp);
+}
+
+static int bcache_unlink(const char *path)
+{
+	struct bcache *bc = bcache_get();
+	int err = fuse_fs_unlink(bc->next, path);
+	bcache_invalidate(bc, path);
+	return err;
+}
+
+static int bcache_rename(const char *from, const char *to)
+{
+	struct bcache *bc = bcache_get();
+	int err = fuse_fs_rename(bc->next, from, to);
+	bcache_invalidate_tree(bc, from);
+	bcache_invalidate_tree(bc, to);
+	return err;
+}
+
+#ifdef __APPLE__
+
+static int bcache_exchange(const char *path1, const char *path2,
+			   unsigned long options)
+{
+	struct bcache *bc = bcache_get();
+	int err = fuse_fs_exchange(bc->next, path1, path2, options);
+	bcache_invalidate_tree(bc, path1);
+	bcache_invalidate_tree(bc, path2);
+	return err;
+}
+
+static int bcache_setattr_x(const char *path, struct setattr_x *attr)
+{
+	struct bcache *bc = bcache_get();
+	int err = fuse_fs_setattr_x(bc->next, path, attr);
+	if (SETATTR_WANTS_SIZE(attr))
+		bcache_invalidate(bc, path);
+	return err;
+}
+
+static int bcache_fsetattr_x(const char *path, struct setattr_x *attr,
+			     struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	int err = fuse_fs_fsetattr_x(bc->next, path, attr, fi);
+	if (SETATTR_WANTS_SIZE(attr))
+		bcache_invalidate(bc, path);
+	return err;
+}
+
+#endif /* __APPLE__ */
+
+static int bcache_truncate(const char *path, off_t size)
+{
+	struct bcache *bc = bcache_get();
+	int err = fuse_fs_truncate(bc->next, path, size);
+	bcache_invalidate(bc, path);
+	return err;
+}
+
+static int bcache_ftruncate(const char *path, off_t size,
+			    struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	int err = fuse_fs_ftruncate(bc->next, path, size, fi);
+	bcache_invalidate(bc, path);
+	return err;
+}
+
+static int bcache_create(const char *path, mode_t mode,
+			 struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	int err = fuse_fs_create(bc->next, path, mode, fi);
+	bcache_invalidate(bc, path);
+	return err;
+}
+
+static int bcache_open(const char *path, struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	int err = fuse_fs_open(bc->next, path, fi);
+	if (fi->flags & O_TRUNC)
+		bcache_invalidate(bc, path);
+	return err;
+}
+
+static int bcache_read(const char *path, char *buf, size_t size, off_t offset,
+		       struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	unsigned int hash;
+	size_t done = 0;
+
+	if (path == NULL)
+		return fuse_fs_read(bc->next, path, buf, size, offset, fi);
+
+	hash = bcache_hash_path(path);
+	while (done < size) {
+		off_t pos = offset + done;
+		int eof;
+		int res;
+
+		res = bcache_read_block(bc, path, hash, pos / bc->bsize,
+					pos % bc->bsize, buf + done,
+					size - done, &eof, fi);
+		if (res < 0)
+			return done ? (int) done : res;
+		done += res;
+		if (eof)
+			break;
+	}
+	return done;
+}
+
+static int bcache_write(const char *path, const char *buf, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	int res = fuse_fs_write(bc->next, path, buf, size, offset, fi);
+	bcache_invalidate(bc, path);
+	return res;
+}
+
+static int bcache_release(const char *path, struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	bcache_invalidate(bc, path);
+	return fuse_fs_release(bc->next, path, fi);
+}
+
+static ssize_t bcache_copy_file_range(const char *path_in,
+				      struct fuse_file_info *fi_in,
+				      off_t off_in, const char *path_out,
+				      struct fuse_file_info *fi_out,
+				      off_t off_out, size_t len, int flags)
+{
+	struct bcache *bc = bcache_get();
+	ssize_t res = fuse_fs_copy_file_range(bc->next, path_in, fi_in, off_in,
+					      path_out, fi_out, off_out, len,
+					      flags);
+	bcache_invalidate(bc, path_out);
+	return res;
+}
+
+static int bcache_fallocate(const char *path, int mode, off_t offset,
+			    off_t length, struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	int res = fuse_fs_fallocate(bc->next, path, mode, offset, length, fi);
+	bcache_invalidate(bc, path);
+	return res;
+}
+
+static off_t bcache_lseek(const char *path, off_t off, int whence,
+			  struct fuse_file_info *fi)
+{
+	struct bcache *bc = bcache_get();
+	return fuse_fs_lseek(bc->next, path, off, whence, fi);
+}
+
+static void bcache_retrieve_reply(const char *path, void *cookie,
+				  off_t offset, const void *buf, size_t size)
+{
+	struct bcache *bc = bcache_get();
+	fuse_fs_retrieve_reply(bc->next, path, cookie, offset, buf, size);
+}
+
+static void *bcache_init(struct fuse_conn_info *conn)
+{
+	struct bcache *bc = bcache_get();
+	fuse_fs_init(bc->next, conn);
+	return bc;
+}
+
+static void bcache_destroy(void *data)
+{
+	struct bcache *bc = data;
+	unsigned long long hits = 0;
+	unsigned long long misses = 0;
+	unsigned long long evictions = 0;
+	unsigned long long invalidations = 0;
+	int i;
+
+	fuse_fs_destroy(bc->next);
+	for (i = 0; i < BCACHE_SHARDS; i++) {
+		struct bcache_shard *sh = &bc->shards[i];
+
+		hits += sh->hits;
+		misses += sh->misses;
+		evictions += sh->evictions;
+		invalidations += sh->invalidations;
+		while (sh->lru.lru_next != &sh->lru)
+			bcache_remove_block(sh, sh->lru.lru_next);
+		pthread_mutex_destroy(&sh->lock);
+	}
+	if (bc->stats)
+		fprintf(stderr, "fuse-bcache: %llu hits, %llu misses (%.1f%% hit ratio), %llu evictions, %llu invalidations\n",
+			hits, misses,
+			hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+			evictions, invalidations);
+	free(bc);
+}
+
+static struct fuse_operations bcache_oper = {
+	.destroy	= bcache_destroy,
+	.init		= bcache_init,
+	.getattr	= bcache_getattr,
+	.fgetattr	= bcache_fgetattr,
+	.access		= bcache_access,
+	.readlink	= bcache_readlink,
+	.opendir	= bcache_opendir,
+	.readdir	= bcache_readdir,
+	.releasedir	= bcache_releasedir,
+	.mknod		= bcache_mknod,
+	.mkdir		= bcache_mkdir,
+	.unlink		= bcache_unlink,
+	.rmdir		= bcache_rmdir,
+	.symlink	= bcache_symlink,
+	.rename		= bcache_rename,
+	.link		= bcache_link,
+	.chmod		= bcache_chmod,
+	.chown		= bcache_chown,
+	.truncate	= bcache_truncate,
+	.ftruncate	= bcache_ftruncate,
+	.utimens	= bcache_utimens,
+	.create		= bcache_create,
+	.open		= bcache_open,
+	.read		= bcache_read,
+	.write		= bcache_write,
+	.statfs		= bcache_statfs,
+	.flush		= bcache_flush,
+	.release	= bcache_release,
+	.fsync		= bcache_fsync,
+	.fsyncdir	= bcache_fsyncdir,
+	.setxattr	= bcache_setxattr,
+	.getxattr	= bcache_getxattr,
+	.listxattr	= bcache_listxattr,
+	.removexattr	= bcache_removexattr,
+	.lock		= bcache_lock,
+	.bmap		= bcache_bmap,
+	.ioctl		= bcache_ioctl,
+	.poll		= bcache_poll,
+	.copy_file_range = bcache_copy_file_range,
+	.fallocate	= bcache_fallocate,
+	.lseek		= bcache_lseek,
+	.retrieve_reply = bcache_retrieve_reply,
+#ifdef __APPLE__
+	.setvolname	= bcache_setvolname,
+	.exchange	= bcache_exchange,
+	.setattr_x	= bcache_setattr_x,
+	.fsetattr_x	= bcache_fsetattr_x,
+	.chflags	= bcache_chflags,
+	.getxtimes	= bcache_getxtimes,
+	.setbkuptime	= bcache_setbkuptime,
+	.setchgtime	= bcache_setchgtime,
+	.setcrtime	= bcache_setcrtime,
+#endif /* __APPLE__ */
+
+	.flag_nullpath_ok = 1,
+};
+
+static struct fuse_opt bcache_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "bcache_block_size=%u", offsetof(struct bcache, bsize), 0 },
+	{ "bcache_blocks=%u", offsetof(struct bcache, nblocks), 0 },
+	{ "bcache_stats", offsetof(struct bcache, stats), 1 },
+	FUSE_OPT_END
+};
+
+static void bcache_help(void)
+{
+	fprintf(stderr,
+"    -o bcache_block_size=N size of a cached block in bytes (default: 65536)\n"
+"    -o bcache_blocks=N     maximum number of cached blocks (default: 1024)\n"
+"    -o bcache_stats        print cache statistics on unmount\n");
+}
+
+static int bcache_opt_proc(void *data, const char *arg, int key,
+			   struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		bcache_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *bcache_new(struct fuse_args *args,
+				  struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct bcache *bc;
+	int i;
+
+	bc = calloc(1, sizeof(struct bcache));
+	if (bc == NULL) {
+		fprintf(stderr, "fuse-bcache: memory allocation failed\n");
+		return NULL;
+	}
+
+	bc->bsize = 65536;
+	bc->nblocks = 1024;
+	if (fuse_opt_parse(args, bc, bcache_opts, bcache_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-bcache: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	if (!bc->bsize || bc->bsize > INT_MAX) {
+		fprintf(stderr, "fuse-bcache: invalid block size: %u\n",
+			bc->bsize);
+		goto out_free;
+	}
+
+	if (!bc->nblocks) {
+		fprintf(stderr, "fuse-bcache: cache must hold at least one block\n");
+		goto out_free;
+	}
+
+	for (i = 0; i < BCACHE_SHARDS; i++) {
+		struct bcache_shard *sh = &bc->shards[i];
+
+		pthread_mutex_init(&sh->lock, NULL);
+		sh->lru.lru_next = sh->lru.lru_prev = &sh->lru;
+		sh->maxblocks = (bc->nblocks + BCACHE_SHARDS - 1) /
+			BCACHE_SHARDS;
+	}
+
+	bc->next = next[0];
+	fs = fuse_fs_new(&bcache_oper, sizeof(bcache_oper), bc);
+	if (!fs)
+		goto out_destroy;
+
+	return fs;
+
+out_destroy:
+	for (i = 0; i < BCACHE_SHARDS; i++)
+		pthread_mutex_destroy(&bc->shards[i].lock);
+out_free:
+	free(bc);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(bcache, bcache_new);
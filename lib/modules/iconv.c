@@ -19,17 +19,31 @@
 #include <locale.h>
 #include <langinfo.h>
 
+#define ICONV_CACHE_SIZE 64
+
+struct iconv_cache_ent {
+	char *name;
+	const char *conv;
+};
+
+/* Conversion state private to one thread, so no locking is needed */
+struct iconv_thread {
+	iconv_t tofs;
+	iconv_t fromfs;
+	struct iconv_cache_ent cache[ICONV_CACHE_SIZE];
+};
+
 struct iconv {
 	struct fuse_fs *next;
-	pthread_mutex_t lock;
+	pthread_key_t key;
 	char *from_code;
 	char *to_code;
-	iconv_t tofs;
-	iconv_t fromfs;
+	int ascii_compat;
 };
 
 struct iconv_dh {
 	struct iconv *ic;
+	struct iconv_thread *ict;
 	void *prev_buf;
 	fuse_fill_dir_t prev_filler;
 };
@@ -39,9 +53,97 @@ static struct iconv *iconv_get(void)
 	return fuse_get_context()->private_data;
 }
 
+static void iconv_thread_free(void *data)
+{
+	struct iconv_thread *ict = data;
+	int i;
+
+	iconv_close(ict->tofs);
+	iconv_close(ict->fromfs);
+	for (i = 0; i < ICONV_CACHE_SIZE; i++)
+		free(ict->cache[i].name);
+	free(ict);
+}
+
+static struct iconv_thread *iconv_thread_new(const char *from, const char *to)
+{
+	struct iconv_thread *ict = calloc(1, sizeof(struct iconv_thread));
+	if (ict == NULL)
+		return NULL;
+
+	ict->tofs = iconv_open(from, to);
+	if (ict->tofs == (iconv_t) -1)
+		goto out_free;
+	ict->fromfs = iconv_open(to, from);
+	if (ict->fromfs == (iconv_t) -1)
+		goto out_iconv_close_to;
+
+	return ict;
+
+out_iconv_close_to:
+	iconv_close(ict->tofs);
+out_free:
+	free(ict);
+	return NULL;
+}
+
+static struct iconv_thread *iconv_thread_get(struct iconv *ic)
+{
+	struct iconv_thread *ict = pthread_getspecific(ic->key);
+	if (ict == NULL) {
+		ict = iconv_thread_new(ic->from_code, ic->to_code);
+		if (ict == NULL)
+			return NULL;
+		pthread_setspecific(ic->key, ict);
+	}
+	return ict;
+}
+
+/* Check for 7-bit input a word at a time */
+static int iconv_is_ascii(const char *s, size_t len)
+{
+	const unsigned long high = ((unsigned long) -1 / 0xff) * 0x80;
+	unsigned long w;
+
+	for (; len >= sizeof(w); s += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, s, sizeof(w));
+		if (w & high)
+			return 0;
+	}
+	for (; len; s++, len--) {
+		if (*s & 0x80)
+			return 0;
+	}
+	return 1;
+}
+
+/* Does the conversion leave 7-bit characters unchanged? */
+static int iconv_ascii_identity(iconv_t cd)
+{
+	char in[127];
+	char out[127 * 4];
+	char *inp = in;
+	char *outp = out;
+	size_t inleft = sizeof(in);
+	size_t outleft = sizeof(out);
+	size_t res;
+	int i;
+
+	for (i = 0; i < 127; i++)
+		in[i] = i + 1;
+
+	res = iconv(cd, &inp, &inleft, &outp, &outleft);
+	iconv(cd, NULL, NULL, NULL, NULL);
+
+	return res != (size_t) -1 && inleft == 0 &&
+		outp - out == sizeof(in) && memcmp(in, out, sizeof(in)) == 0;
+}
+
 static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 			  int fromfs)
 {
+	struct iconv_thread *ict;
+	iconv_t cd;
 	size_t pathlen;
 	size_t newpathlen;
 	char *newpath;
@@ -56,6 +158,16 @@ static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 	}
 
 	pathlen = strlen(path);
+	if (ic->ascii_compat && iconv_is_ascii(path, pathlen)) {
+		*newpathp = (char *) path;
+		return 0;
+	}
+
+	ict = iconv_thread_get(ic);
+	if (!ict)
+		return -ENOMEM;
+	cd = fromfs ? ict->fromfs : ict->tofs;
+
 	newpathlen = pathlen * 4;
 	newpath = malloc(newpathlen + 1);
 	if (!newpath)
@@ -63,13 +175,12 @@ static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 
 	plen = newpathlen;
 	p = newpath;
-	pthread_mutex_lock(&ic->lock);
 	do {
-		res = iconv(fromfs ? ic->fromfs : ic->tofs, (char **) &path,
-			    &pathlen, &p, &plen);
+		res = iconv(cd, (char **) &path, &pathlen, &p, &plen);
 		if (res == (size_t) -1) {
 			char *tmp;
 			size_t inc;
+			size_t done;
 
 			err = -EILSEQ;
 			if (errno != E2BIG)
@@ -77,28 +188,89 @@ static int iconv_convpath(struct iconv *ic, const char *path, char **newpathp,
 
 			inc = (pathlen + 1) * 4;
 			newpathlen += inc;
+			done = p - newpath;
 			tmp = realloc(newpath, newpathlen + 1);
 			err = -ENOMEM;
 			if (!tmp)
 				goto err;
 
-			p = tmp + (p - newpath);
+			p = tmp + done;
 			plen += inc;
 			newpath = tmp;
 		}
 	} while (res == (size_t) -1);
-	pthread_mutex_unlock(&ic->lock);
 	*p = '\0';
 	*newpathp = newpath;
 	return 0;
 
 err:
-	iconv(fromfs ? ic->fromfs : ic->tofs, NULL, NULL, NULL, NULL);
-	pthread_mutex_unlock(&ic->lock);
+	iconv(cd, NULL, NULL, NULL, NULL);
 	free(newpath);
 	return err;
 }
 
+static void iconv_putpath(const char *path, char *newpath)
+{
+	if (newpath != path)
+		free(newpath);
+}
+
+static unsigned int iconv_name_hash(const char *name)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *name; name++)
+		hash = (hash ^ (unsigned char) *name) * 16777619U;
+
+	return hash % ICONV_CACHE_SIZE;
+}
+
+/*
+ * Convert a directory entry name, remembering the result.  The
+ * returned name is owned by the cache (or is the original name) and
+ * stays valid until the next call in the same thread.
+ */
+static int iconv_convname(struct iconv *ic, struct iconv_thread *ict,
+			  const char *name, const char **newnamep)
+{
+	struct iconv_cache_ent *ent;
+	size_t namelen = strlen(name);
+	char *newname;
+	char *entname;
+	size_t len;
+	int err;
+
+	if (ic->ascii_compat && iconv_is_ascii(name, namelen)) {
+		*newnamep = name;
+		return 0;
+	}
+
+	ent = &ict->cache[iconv_name_hash(name)];
+	if (ent->name && strcmp(ent->name, name) == 0) {
+		*newnamep = ent->conv;
+		return 0;
+	}
+
+	err = iconv_convpath(ic, name, &newname, 1);
+	if (err)
+		return err;
+
+	len = strlen(newname);
+	entname = realloc(ent->name, namelen + 1 + len + 1);
+	if (entname == NULL) {
+		/* keep the old entry, which is still intact */
+		free(newname);
+		return -ENOMEM;
+	}
+	memcpy(entname, name, namelen + 1);
+	memcpy(entname + namelen + 1, newname, len + 1);
+	free(newname);
+	ent->name = entname;
+	ent->conv = entname + namelen + 1;
+	*newnamep = ent->conv;
+	return 0;
+}
+
 static int iconv_getattr(const char *path, struct stat *stbuf)
 {
 	struct iconv *ic = iconv_get();
@@ -106,7 +278,7 @@ static int iconv_getattr(const char *path, struct stat *stbuf)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_getattr(ic->next, newpath, stbuf);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -119,7 +291,7 @@ static int iconv_fgetattr(const char *path, struct stat *stbuf,
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_fgetattr(ic->next, newpath, stbuf, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -131,7 +303,7 @@ static int iconv_access(const char *path, int mask)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_access(ic->next, newpath, mask);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -146,13 +318,13 @@ static int iconv_readlink(const char *path, char *buf, size_t size)
 		if (!err) {
 			char *newlink;
 			err = iconv_convpath(ic, buf, &newlink, 1);
-			if (!err) {
+			if (!err && newlink != buf) {
 				strncpy(buf, newlink, size - 1);
 				buf[size - 1] = '\0';
 				free(newlink);
 			}
 		}
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -164,7 +336,7 @@ static int iconv_opendir(const char *path, struct fuse_file_info *fi)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_opendir(ic->next, newpath, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -173,12 +345,10 @@ static int iconv_dir_fill(void *buf, const char *name,
 			  const struct stat *stbuf, off_t off)
 {
 	struct iconv_dh *dh = buf;
-	char *newname;
+	const char *newname;
 	int res = 0;
-	if (iconv_convpath(dh->ic, name, &newname, 1) == 0) {
+	if (iconv_convname(dh->ic, dh->ict, name, &newname) == 0)
 		res = dh->prev_filler(dh->prev_buf, newname, stbuf, off);
-		free(newname);
-	}
 	return res;
 }
 
@@ -191,11 +361,14 @@ static int iconv_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	if (!err) {
 		struct iconv_dh dh;
 		dh.ic = ic;
+		dh.ict = iconv_thread_get(ic);
 		dh.prev_buf = buf;
 		dh.prev_filler = filler;
-		err = fuse_fs_readdir(ic->next, newpath, &dh, iconv_dir_fill,
-				      offset, fi);
-		free(newpath);
+		err = -ENOMEM;
+		if (dh.ict)
+			err = fuse_fs_readdir(ic->next, newpath, &dh,
+					      iconv_dir_fill, offset, fi);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -207,7 +380,7 @@ static int iconv_releasedir(const char *path, struct fuse_file_info *fi)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_releasedir(ic->next, newpath, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -219,7 +392,7 @@ static int iconv_mknod(const char *path, mode_t mode, dev_t rdev)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_mknod(ic->next, newpath, mode, rdev);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -231,7 +404,7 @@ static int iconv_mkdir(const char *path, mode_t mode)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_mkdir(ic->next, newpath, mode);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -243,7 +416,7 @@ static int iconv_unlink(const char *path)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_unlink(ic->next, newpath);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -255,7 +428,7 @@ static int iconv_rmdir(const char *path)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_rmdir(ic->next, newpath);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -270,9 +443,9 @@ static int iconv_symlink(const char *from, const char *to)
 		err = iconv_convpath(ic, to, &newto, 0);
 		if (!err) {
 			err = fuse_fs_symlink(ic->next, newfrom, newto);
-			free(newto);
+			iconv_putpath(to, newto);
 		}
-		free(newfrom);
+		iconv_putpath(from, newfrom);
 	}
 	return err;
 }
@@ -286,7 +459,7 @@ static int iconv_setvolname(const char *volname)
 	int err = iconv_convpath(ic, volname, &newvolname, 0);
 	if (!err) {
 		err = fuse_fs_setvolname(ic->next, newvolname);
-		free(newvolname);
+		iconv_putpath(volname, newvolname);
 	}
 	return err;
 }
@@ -302,9 +475,9 @@ static int iconv_exchange(const char *path1, const char *path2,
 		err = iconv_convpath(ic, path2, &new2, 0);
 		if (!err) {
 			err = fuse_fs_exchange(ic->next, new1, new2, options);
-			free(new1);
+			iconv_putpath(path2, new2);
 		}
-		free(new2);
+		iconv_putpath(path1, new1);
 	}
 	return err;
 }
@@ -321,9 +494,9 @@ static int iconv_rename(const char *from, const char *to)
 		err = iconv_convpath(ic, to, &newto, 0);
 		if (!err) {
 			err = fuse_fs_rename(ic->next, newfrom, newto);
-			free(newto);
+			iconv_putpath(to, newto);
 		}
-		free(newfrom);
+		iconv_putpath(from, newfrom);
 	}
 	return err;
 }
@@ -338,9 +511,9 @@ static int iconv_link(const char *from, const char *to)
 		err = iconv_convpath(ic, to, &newto, 0);
 		if (!err) {
 			err = fuse_fs_link(ic->next, newfrom, newto);
-			free(newto);
+			iconv_putpath(to, newto);
 		}
-		free(newfrom);
+		iconv_putpath(from, newfrom);
 	}
 	return err;
 }
@@ -354,7 +527,7 @@ static int iconv_setattr_x(const char *path, struct setattr_x *attr)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_setattr_x(ic->next, newpath, attr);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -367,7 +540,7 @@ static int iconv_fsetattr_x(const char *path, struct setattr_x *attr,
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_fsetattr_x(ic->next, newpath, attr, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -379,7 +552,7 @@ static int iconv_chflags(const char *path, uint32_t flags)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_chflags(ic->next, newpath, flags);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -392,7 +565,7 @@ static int iconv_getxtimes(const char *path, struct timespec *bkuptime,
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_getxtimes(ic->next, newpath, bkuptime, crtime);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -404,7 +577,7 @@ static int iconv_setbkuptime(const char *path, const struct timespec *bkuptime)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_setbkuptime(ic->next, newpath, bkuptime);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -416,7 +589,7 @@ static int iconv_setchgtime(const char *path, const struct timespec *chgtime)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_setchgtime(ic->next, newpath, chgtime);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -428,7 +601,7 @@ static int iconv_setcrtime(const char *path, const struct timespec *crtime)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_setcrtime(ic->next, newpath, crtime);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -442,7 +615,7 @@ static int iconv_chmod(const char *path, mode_t mode)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_chmod(ic->next, newpath, mode);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -454,7 +627,7 @@ static int iconv_chown(const char *path, uid_t uid, gid_t gid)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_chown(ic->next, newpath, uid, gid);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -466,7 +639,7 @@ static int iconv_truncate(const char *path, off_t size)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_truncate(ic->next, newpath, size);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -479,7 +652,7 @@ static int iconv_ftruncate(const char *path, off_t size,
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_ftruncate(ic->next, newpath, size, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -491,7 +664,7 @@ static int iconv_utimens(const char *path, const struct timespec ts[2])
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_utimens(ic->next, newpath, ts);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -504,7 +677,7 @@ static int iconv_create(const char *path, mode_t mode,
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_create(ic->next, newpath, mode, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -516,7 +689,7 @@ static int iconv_open_file(const char *path, struct fuse_file_info *fi)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_open(ic->next, newpath, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -529,7 +702,7 @@ static int iconv_read(const char *path, char *buf, size_t size, off_t offset,
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_read(ic->next, newpath, buf, size, offset, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -542,7 +715,7 @@ static int iconv_write(const char *path, const char *buf, size_t size,
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_write(ic->next, newpath, buf, size, offset, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -554,7 +727,7 @@ static int iconv_statfs(const char *path, struct statvfs *stbuf)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_statfs(ic->next, newpath, stbuf);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -566,7 +739,7 @@ static int iconv_flush(const char *path, struct fuse_file_info *fi)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_flush(ic->next, newpath, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -578,7 +751,7 @@ static int iconv_release(const char *path, struct fuse_file_info *fi)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_release(ic->next, newpath, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -591,7 +764,7 @@ static int iconv_fsync(const char *path, int isdatasync,
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_fsync(ic->next, newpath, isdatasync, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -604,7 +777,7 @@ static int iconv_fsyncdir(const char *path, int isdatasync,
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_fsyncdir(ic->next, newpath, isdatasync, fi);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -628,7 +801,7 @@ static int iconv_setxattr(const char *path, const char *name,
 		err = fuse_fs_setxattr(ic->next, newpath, name, value, size,
 				       flags);
 #endif /* __APPLE__ */
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -650,7 +823,7 @@ static int iconv_getxattr(const char *path, const char *name, char *value,
 #else
 		err = fuse_fs_getxattr(ic->next, newpath, name, value, size);
 #endif /* __APPLE__ */
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -662,7 +835,7 @@ static int iconv_listxattr(const char *path, char *list, size_t size)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_listxattr(ic->next, newpath, list, size);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -674,7 +847,7 @@ static int iconv_removexattr(const char *path, const char *name)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_removexattr(ic->next, newpath, name);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -687,7 +860,7 @@ static int iconv_lock(const char *path, struct fuse_file_info *fi, int cmd,
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_lock(ic->next, newpath, fi, cmd, lock);
-		free(newpath);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
@@ -699,11 +872,73 @@ static int iconv_bmap(const char *path, size_t blocksize, uint64_t *idx)
 	int err = iconv_convpath(ic, path, &newpath, 0);
 	if (!err) {
 		err = fuse_fs_bmap(ic->next, newpath, blocksize, idx);
-		free(newpath);
+		iconv_putpath(path, newpath);
+	}
+	return err;
+}
+
+static ssize_t iconv_copy_file_range(const char *path_in,
+				     struct fuse_file_info *fi_in,
+				     off_t off_in, const char *path_out,
+				     struct fuse_file_info *fi_out,
+				     off_t off_out, size_t len, int flags)
+{
+	struct iconv *ic = iconv_get();
+	char *newin;
+	char *newout;
+	ssize_t err = iconv_convpath(ic, path_in, &newin, 0);
+	if (!err) {
+		err = iconv_convpath(ic, path_out, &newout, 0);
+		if (!err) {
+			err = fuse_fs_copy_file_range(ic->next, newin, fi_in,
+						      off_in, newout, fi_out,
+						      off_out, len, flags);
+			iconv_putpath(path_out, newout);
+		}
+		iconv_putpath(path_in, newin);
+	}
+	return err;
+}
+
+static int iconv_fallocate(const char *path, int mode, off_t offset,
+			   off_t length, struct fuse_file_info *fi)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	int err = iconv_convpath(ic, path, &newpath, 0);
+	if (!err) {
+		err = fuse_fs_fallocate(ic->next, newpath, mode, offset,
+					length, fi);
+		iconv_putpath(path, newpath);
 	}
 	return err;
 }
 
+static off_t iconv_lseek(const char *path, off_t off, int whence,
+			 struct fuse_file_info *fi)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath;
+	off_t res = iconv_convpath(ic, path, &newpath, 0);
+	if (!res) {
+		res = fuse_fs_lseek(ic->next, newpath, off, whence, fi);
+		iconv_putpath(path, newpath);
+	}
+	return res;
+}
+
+static void iconv_retrieve_reply(const char *path, void *cookie,
+				 off_t offset, const void *buf, size_t size)
+{
+	struct iconv *ic = iconv_get();
+	char *newpath = NULL;
+	if (path && iconv_convpath(ic, path, &newpath, 0) != 0)
+		newpath = NULL;
+	fuse_fs_retrieve_reply(ic->next, newpath, cookie, offset, buf, size);
+	if (newpath)
+		iconv_putpath(path, newpath);
+}
+
 static void *iconv_init(struct fuse_conn_info *conn)
 {
 	struct iconv *ic = iconv_get();
@@ -714,10 +949,13 @@ static void *iconv_init(struct fuse_conn_info *conn)
 static void iconv_destroy(void *data)
 {
 	struct iconv *ic = data;
+	struct iconv_thread *ict;
+
 	fuse_fs_destroy(ic->next);
-	iconv_close(ic->tofs);
-	iconv_close(ic->fromfs);
-	pthread_mutex_destroy(&ic->lock);
+	ict = pthread_getspecific(ic->key);
+	if (ict)
+		iconv_thread_free(ict);
+	pthread_key_delete(ic->key);
 	free(ic->from_code);
 	free(ic->to_code);
 	free(ic);
@@ -760,6 +998,10 @@ static struct fuse_operations iconv_oper = {
 	.removexattr	= iconv_removexattr,
 	.lock		= iconv_lock,
 	.bmap		= iconv_bmap,
+	.copy_file_range = iconv_copy_file_range,
+	.fallocate	= iconv_fallocate,
+	.lseek		= iconv_lseek,
+	.retrieve_reply = iconv_retrieve_reply,
 #ifdef __APPLE__
 	.setvolname	= iconv_setvolname,
 	.exchange	= iconv_exchange,
@@ -814,9 +1056,9 @@ static struct fuse_fs *iconv_new(struct fuse_args *args,
 {
 	struct fuse_fs *fs;
 	struct iconv *ic;
+	struct iconv_thread *ict;
 	char *old = NULL;
-	const char *from;
-	const char *to;
+	int err;
 
 	ic = calloc(1, sizeof(struct iconv));
 	if (ic == NULL) {
@@ -832,39 +1074,51 @@ static struct fuse_fs *iconv_new(struct fuse_args *args,
 		goto out_free;
 	}
 
-	from = ic->from_code ? ic->from_code : "UTF-8";
-	to = ic->to_code ? ic->to_code : "";
+	if (!ic->from_code)
+		ic->from_code = strdup("UTF-8");
 	/* FIXME: detect charset equivalence? */
-	if (!to[0])
+	if (!ic->to_code || !ic->to_code[0]) {
+		/* Resolve the locale's charset now, since the per-thread
+		   descriptors are opened later, from other threads */
 		old = strdup(setlocale(LC_CTYPE, ""));
-	ic->tofs = iconv_open(from, to);
-	if (ic->tofs == (iconv_t) -1) {
-		fprintf(stderr, "fuse-iconv: cannot convert from %s to %s\n",
-			to, from);
+		free(ic->to_code);
+		ic->to_code = strdup(nl_langinfo(CODESET));
+		setlocale(LC_CTYPE, old);
+		free(old);
+	}
+	if (!ic->from_code || !ic->to_code) {
+		fprintf(stderr, "fuse-iconv: memory allocation failed\n");
 		goto out_free;
 	}
-	ic->fromfs = iconv_open(to, from);
-	if (ic->tofs == (iconv_t) -1) {
-		fprintf(stderr, "fuse-iconv: cannot convert from %s to %s\n",
-			from, to);
-		goto out_iconv_close_to;
+
+	ict = iconv_thread_new(ic->from_code, ic->to_code);
+	if (ict == NULL) {
+		fprintf(stderr, "fuse-iconv: cannot convert between %s and %s\n",
+			ic->from_code, ic->to_code);
+		goto out_free;
 	}
-	if (old) {
-		setlocale(LC_CTYPE, old);
-		free(old);
+	ic->ascii_compat = iconv_ascii_identity(ict->tofs) &&
+		iconv_ascii_identity(ict->fromfs);
+
+	err = pthread_key_create(&ic->key, iconv_thread_free);
+	if (err) {
+		fprintf(stderr, "fuse-iconv: failed to create thread specific key: %s\n",
+			strerror(err));
+		goto out_thread_free;
 	}
+	pthread_setspecific(ic->key, ict);
 
 	ic->next = next[0];
 	fs = fuse_fs_new(&iconv_oper, sizeof(iconv_oper), ic);
 	if (!fs)
-		goto out_iconv_close_from;
+		goto out_key_delete;
 
 	return fs;
 
-out_iconv_close_from:
-	iconv_close(ic->fromfs);
-out_iconv_close_to:
-	iconv_close(ic->tofs);
+out_key_delete:
+	pthread_key_delete(ic->key);
+out_thread_free:
+	iconv_thread_free(ict);
 out_free:
 	free(ic->from_code);
 	free(ic->to_code);
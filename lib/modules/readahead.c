@@ -0,0 +1,979 @@
+/*
+  fuse readahead module: prefetch sequentially read files
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define RA_EMPTY	0
+#define RA_PENDING	1
+#define RA_READY	2
+
+/* Sequential reads needed before prefetching starts */
+#define RA_SEQ_THRESHOLD 2
+
+struct readahead_buf {
+	int state;
+	char *data;
+	/* Path of the file at the time the prefetch was scheduled */
+	char *path;
+	size_t size;
+	off_t off;
+	size_t len;
+	int err;
+};
+
+/*
+ * Per open file state.  The module replaces the filesystem's file
+ * handle with a pointer to this, and hands the original down.
+ */
+struct readahead_file {
+	struct fuse_file_info fi;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct readahead_buf buf[2];
+	struct fuse_context ctx;
+	unsigned long gen;
+	unsigned long pending_gen;
+	off_t next_off;
+	off_t eof;
+	size_t window;
+	int seq;
+	int queued;
+	struct readahead_file *queue_next;
+};
+
+struct readahead {
+	struct fuse_fs *next;
+	unsigned int min_window;
+	unsigned int max_window;
+	unsigned int nthreads;
+	int stats;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct readahead_file *queue_head;
+	struct readahead_file *queue_tail;
+	pthread_t *threads;
+	unsigned int started;
+	int exit;
+	unsigned long long prefetches;
+	unsigned long long hits;
+	unsigned long long cancels;
+};
+
+static struct readahead *readahead_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static struct readahead_file *readahead_file(struct fuse_file_info *fi)
+{
+	return (struct readahead_file *) (uintptr_t) fi->fh;
+}
+
+/* Make a copy of 'fi' carrying the filesystem's own file handle */
+static struct fuse_file_info *readahead_fi(struct fuse_file_info *fi,
+					   struct fuse_file_info *tmp)
+{
+	*tmp = *fi;
+	tmp->fh = readahead_file(fi)->fi.fh;
+	return tmp;
+}
+
+/* Drop all prefetched data; must be called with rf->lock held */
+static void readahead_cancel(struct readahead *ra, struct readahead_file *rf)
+{
+	int i;
+
+	rf->gen++;
+	for (i = 0; i < 2; i++) {
+		if (rf->buf[i].state == RA_READY) {
+			rf->buf[i].state = RA_EMPTY;
+			pthread_mutex_lock(&ra->lock);
+			ra->cancels++;
+			pthread_mutex_unlock(&ra->lock);
+		}
+	}
+	rf->seq = 0;
+	rf->window = ra->min_window;
+	rf->eof = -1;
+}
+
+static void readahead_schedule(struct readahead *ra, struct readahead_file *rf,
+			       const char *path)
+{
+	struct readahead_buf *rb = NULL;
+	off_t end = rf->next_off;
+	int i;
+
+	/* Without a path (unlinked file) there is nothing to prefetch */
+	if (rf->seq < RA_SEQ_THRESHOLD || rf->queued || !ra->started ||
+	    path == NULL)
+		return;
+
+	for (i = 0; i < 2; i++) {
+		struct readahead_buf *b = &rf->buf[i];
+
+		if (b->state == RA_EMPTY)
+			rb = b;
+		else if (b->state == RA_PENDING)
+			return;
+		else if (b->off + (off_t) b->len > end)
+			end = b->off + b->len;
+	}
+	if (rb == NULL || end - rf->next_off >= (off_t) rf->window)
+		return;
+	if (rf->eof != -1 && end >= rf->eof)
+		return;
+
+	if (rb->size < rf->window) {
+		char *tmp = realloc(rb->data, rf->window);
+		if (tmp == NULL)
+			return;
+		rb->data = tmp;
+		rb->size = rf->window;
+	}
+	rb->path = strdup(path);
+	if (rb->path == NULL)
+		return;
+	rb->state = RA_PENDING;
+	rb->off = end;
+	rb->len = rf->window;
+	rb->err = 0;
+	rf->pending_gen = rf->gen;
+	rf->ctx = *fuse_get_context();
+
+	rf->window *= 2;
+	if (rf->window > ra->max_window)
+		rf->window = ra->max_window;
+
+	rf->queued = 1;
+	pthread_mutex_lock(&ra->lock);
+	rf->queue_next = NULL;
+	if (ra->queue_tail)
+		ra->queue_tail->queue_next = rf;
+	else
+		ra->queue_head = rf;
+	ra->queue_tail = rf;
+	ra->prefetches++;
+	pthread_cond_signal(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+}
+
+static void readahead_fill(struct readahead *ra, struct readahead_file *rf)
+{
+	struct readahead_buf *rb = NULL;
+	struct fuse_file_info fi;
+	unsigned long gen;
+	char *path;
+	int cancelled;
+	off_t off;
+	size_t len;
+	int res;
+	int i;
+
+	pthread_mutex_lock(&rf->lock);
+	for (i = 0; i < 2; i++)
+		if (rf->buf[i].state == RA_PENDING)
+			rb = &rf->buf[i];
+	gen = rf->pending_gen;
+	cancelled = gen != rf->gen;
+	off = rb->off;
+	len = rb->len;
+	path = rb->path;
+	rb->path = NULL;
+	fi = rf->fi;
+	*fuse_get_context() = rf->ctx;
+	pthread_mutex_unlock(&rf->lock);
+
+	res = -ECANCELED;
+	if (!cancelled)
+		res = fuse_fs_read(ra->next, path, rb->data, len, off, &fi);
+	free(path);
+
+	pthread_mutex_lock(&rf->lock);
+	if (gen != rf->gen) {
+		rb->state = RA_EMPTY;
+	} else if (res < 0) {
+		rb->state = RA_READY;
+		rb->len = 0;
+		rb->err = res;
+	} else {
+		rb->state = RA_READY;
+		rb->len = res;
+		if ((size_t) res < len)
+			rf->eof = off + res;
+	}
+	rf->queued = 0;
+	pthread_cond_broadcast(&rf->cond);
+	pthread_mutex_unlock(&rf->lock);
+}
+
+static void *readahead_worker(void *data)
+{
+	struct readahead *ra = data;
+
+	pthread_mutex_lock(&ra->lock);
+	while (!ra->exit) {
+		struct readahead_file *rf = ra->queue_head;
+
+		if (rf == NULL) {
+			pthread_cond_wait(&ra->cond, &ra->lock);
+			continue;
+		}
+		ra->queue_head = rf->queue_next;
+		if (ra->queue_head == NULL)
+			ra->queue_tail = NULL;
+		pthread_mutex_unlock(&ra->lock);
+
+		readahead_fill(ra, rf);
+
+		pthread_mutex_lock(&ra->lock);
+	}
+	pthread_mutex_unlock(&ra->lock);
+
+	return NULL;
+}
+
+static void readahead_file_free(struct readahead_file *rf)
+{
+	pthread_mutex_destroy(&rf->lock);
+	pthread_cond_destroy(&rf->cond);
+	free(rf->buf[0].data);
+	free(rf->buf[1].data);
+	free(rf->buf[0].path);
+	free(rf->buf[1].path);
+	free(rf);
+}
+
+static int readahead_file_new(struct readahead *ra, struct fuse_file_info *fi)
+{
+	struct readahead_file *rf = calloc(1, sizeof(struct readahead_file));
+	if (rf == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_init(&rf->lock, NULL);
+	pthread_cond_init(&rf->cond, NULL);
+	rf->fi = *fi;
+	rf->window = ra->min_window;
+	rf->eof = -1;
+	fi->fh = (uintptr_t) rf;
+
+	return 0;
+}
+
+static int readahead_getattr(const char *path, struct stat *stbuf)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_getattr(ra->next, path, stbuf);
+}
+
+static int readahead_access(const char *path, int mask)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_access(ra->next, path, mask);
+}
+
+static int readahead_readlink(const char *path, char *buf, size_t size)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_readlink(ra->next, path, buf, size);
+}
+
+static int readahead_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_opendir(ra->next, path, fi);
+}
+
+static int readahead_readdir(const char *path, void *buf,
+			     fuse_fill_dir_t filler, off_t offset,
+			     struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_readdir(ra->next, path, buf, filler, offset, fi);
+}
+
+static int readahead_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_releasedir(ra->next, path, fi);
+}
+
+static int readahead_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_mknod(ra->next, path, mode, rdev);
+}
+
+static int readahead_mkdir(const char *path, mode_t mode)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_mkdir(ra->next, path, mode);
+}
+
+static int readahead_unlink(const char *path)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_unlink(ra->next, path);
+}
+
+static int readahead_rmdir(const char *path)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_rmdir(ra->next, path);
+}
+
+static int readahead_symlink(const char *from, const char *path)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_symlink(ra->next, from, path);
+}
+
+static int readahead_rename(const char *from, const char *to)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_rename(ra->next, from, to);
+}
+
+static int readahead_link(const char *from, const char *to)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_link(ra->next, from, to);
+}
+
+#ifdef __APPLE__
+
+static int readahead_setvolname(const char *volname)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_setvolname(ra->next, volname);
+}
+
+static int readahead_exchange(const char *path1, const char *path2,
+			      unsigned long options)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_exchange(ra->next, path1, path2, options);
+}
+
+static int readahead_setattr_x(const char *path, struct setattr_x *attr)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_setattr_x(ra->next, path, attr);
+}
+
+static int readahead_chflags(const char *path, uint32_t flags)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_chflags(ra->next, path, flags);
+}
+
+static int readahead_getxtimes(const char *path, struct timespec *bkuptime,
+			       struct timespec *crtime)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_getxtimes(ra->next, path, bkuptime, crtime);
+}
+
+static int readahead_setbkuptime(const char *path,
+				 const struct timespec *bkuptime)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_setbkuptime(ra->next, path, bkuptime);
+}
+
+static int readahead_setchgtime(const char *path,
+				const struct timespec *chgtime)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_setchgtime(ra->next, path, chgtime);
+}
+
+static int readahead_setcrtime(const char *path, const struct timespec *crtime)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_setcrtime(ra->next, path, crtime);
+}
+
+#endif /* __APPLE__ */
+
+static int readahead_chmod(const char *path, mode_t mode)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_chmod(ra->next, path, mode);
+}
+
+static int readahead_chown(const char *path, uid_t uid, gid_t gid)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_chown(ra->next, path, uid, gid);
+}
+
+static int readahead_truncate(const char *path, off_t size)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_truncate(ra->next, path, size);
+}
+
+static int readahead_utimens(const char *path, const struct timespec ts[2])
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_utimens(ra->next, path, ts);
+}
+
+static int readahead_statfs(const char *path, struct statvfs *stbuf)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_statfs(ra->next, path, stbuf);
+}
+
+static int readahead_fsyncdir(const char *path, int isdatasync,
+			      struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_fsyncdir(ra->next, path, isdatasync, fi);
+}
+
+#ifdef __APPLE__
+static int readahead_setxattr(const char *path, const char *name,
+		       const char *value, size_t size, int flags,
+		       uint32_t position)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_setxattr(ra->next, path, name, value, size, flags,
+				position);
+}
+
+static int readahead_getxattr(const char *path, const char *name, char *value,
+		       size_t size, uint32_t position)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_getxattr(ra->next, path, name, value, size, position);
+}
+#else
+static int readahead_setxattr(const char *path, const char *name,
+		       const char *value, size_t size, int flags)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_setxattr(ra->next, path, name, value, size, flags);
+}
+
+static int readahead_getxattr(const char *path, const char *name, char *value,
+		       size_t size)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_getxattr(ra->next, path, name, value, size);
+}
+#endif /* __APPLE__ */
+
+static int readahead_listxattr(const char *path, char *list, size_t size)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_listxattr(ra->next, path, list, size);
+}
+
+static int readahead_removexattr(const char *path, const char *name)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_removexattr(ra->next, path, name);
+}
+
+static int readahead_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	struct readahead *ra = readahead_get();
+	return fuse_fs_bmap(ra->next, path, blocksize, idx);
+}
+
+
+static int readahead_fgetattr(const char *path, struct stat *stbuf,
+			      struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	struct fuse_file_info tmp;
+	return fuse_fs_fgetattr(ra->next, path, stbuf, readahead_fi(fi, &tmp));
+}
+
+#ifdef __APPLE__
+
+static int readahead_fsetattr_x(const char *path, struct setattr_x *attr,
+				struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	struct readahead_file *rf = readahead_file(fi);
+	struct fuse_file_info tmp;
+	int err;
+
+	err = fuse_fs_fsetattr_x(ra->next, path, attr, readahead_fi(fi, &tmp));
+	if (SETATTR_WANTS_SIZE(attr)) {
+		pthread_mutex_lock(&rf->lock);
+		readahead_cancel(ra, rf);
+		pthread_mutex_unlock(&rf->lock);
+	}
+	return err;
+}
+
+#endif /* __APPLE__ */
+
+static int readahead_ftruncate(const char *path, off_t size,
+			       struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	struct readahead_file *rf = readahead_file(fi);
+	struct fuse_file_info tmp;
+	int err;
+
+	err = fuse_fs_ftruncate(ra->next, path, size, readahead_fi(fi, &tmp));
+	pthread_mutex_lock(&rf->lock);
+	readahead_cancel(ra, rf);
+	pthread_mutex_unlock(&rf->lock);
+	return err;
+}
+
+static int readahead_create(const char *path, mode_t mode,
+			    struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	int err = fuse_fs_create(ra->next, path, mode, fi);
+	if (!err) {
+		err = readahead_file_new(ra, fi);
+		if (err)
+			fuse_fs_release(ra->next, path, fi);
+	}
+	return err;
+}
+
+static int readahead_open(const char *path, struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	int err = fuse_fs_open(ra->next, path, fi);
+	if (!err) {
+		err = readahead_file_new(ra, fi);
+		if (err)
+			fuse_fs_release(ra->next, path, fi);
+	}
+	return err;
+}
+
+static int readahead_read(const char *path, char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	struct readahead_file *rf = readahead_file(fi);
+	struct fuse_file_info tmp;
+	size_t done = 0;
+	int err = 0;
+	int i;
+
+	pthread_mutex_lock(&rf->lock);
+	if (offset == rf->next_off) {
+		rf->seq++;
+	} else {
+		readahead_cancel(ra, rf);
+		rf->seq = 1;
+	}
+
+	while (done < size) {
+		off_t pos = offset + done;
+		struct readahead_buf *rb = NULL;
+
+		for (i = 0; i < 2; i++) {
+			struct readahead_buf *b = &rf->buf[i];
+
+			int covers = b->off <= pos &&
+				(pos < b->off + (off_t) b->len ||
+				 (b->err && b->off == pos));
+
+			if (b->state == RA_EMPTY)
+				continue;
+			if (b->state == RA_READY && !covers &&
+			    b->off + (off_t) b->len <= pos) {
+				/* already consumed */
+				b->state = RA_EMPTY;
+				continue;
+			}
+			if (covers)
+				rb = b;
+		}
+		if (rb == NULL)
+			break;
+		if (rb->state == RA_PENDING) {
+			pthread_cond_wait(&rf->cond, &rf->lock);
+			continue;
+		}
+		if (rb->err) {
+			err = rb->err;
+			rb->state = RA_EMPTY;
+			break;
+		} else {
+			size_t len = rb->off + rb->len - pos;
+
+			if (len > size - done)
+				len = size - done;
+			memcpy(buf + done, rb->data + (pos - rb->off), len);
+			done += len;
+			pthread_mutex_lock(&ra->lock);
+			ra->hits++;
+			pthread_mutex_unlock(&ra->lock);
+		}
+	}
+	pthread_mutex_unlock(&rf->lock);
+
+	if (err) {
+		if (!done)
+			return err;
+	} else if (done < size) {
+		int res = fuse_fs_read(ra->next, path, buf + done, size - done,
+				       offset + done, readahead_fi(fi, &tmp));
+		if (res < 0) {
+			if (!done)
+				return res;
+		} else {
+			done += res;
+		}
+	}
+
+	pthread_mutex_lock(&rf->lock);
+	rf->next_off = offset + done;
+	/* the file may have grown */
+	if (rf->eof != -1 && rf->next_off > rf->eof)
+		rf->eof = -1;
+	readahead_schedule(ra, rf, path);
+	pthread_mutex_unlock(&rf->lock);
+
+	return done;
+}
+
+static int readahead_write(const char *path, const char *buf, size_t size,
+			   off_t offset, struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	struct readahead_file *rf = readahead_file(fi);
+	struct fuse_file_info tmp;
+	int res;
+
+	pthread_mutex_lock(&rf->lock);
+	readahead_cancel(ra, rf);
+	pthread_mutex_unlock(&rf->lock);
+	res = fuse_fs_write(ra->next, path, buf, size, offset,
+			    readahead_fi(fi, &tmp));
+	return res;
+}
+
+static int readahead_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	struct fuse_file_info tmp;
+	return fuse_fs_flush(ra->next, path, readahead_fi(fi, &tmp));
+}
+
+static int readahead_release(const char *path, struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	struct readahead_file *rf = readahead_file(fi);
+	struct fuse_file_info tmp;
+	int err;
+
+	/* Cancel prefetch, and wait for a read in progress to finish */
+	pthread_mutex_lock(&rf->lock);
+	readahead_cancel(ra, rf);
+	while (rf->queued)
+		pthread_cond_wait(&rf->cond, &rf->lock);
+	pthread_mutex_unlock(&rf->lock);
+
+	err = fuse_fs_release(ra->next, path, readahead_fi(fi, &tmp));
+	readahead_file_free(rf);
+	return err;
+}
+
+static int readahead_fsync(const char *path, int isdatasync,
+			   struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	struct fuse_file_info tmp;
+	return fuse_fs_fsync(ra->next, path, isdatasync,
+			     readahead_fi(fi, &tmp));
+}
+
+static int readahead_lock(const char *path, struct fuse_file_info *fi,
+			  int cmd, struct flock *lock)
+{
+	struct readahead *ra = readahead_get();
+	struct fuse_file_info tmp;
+	return fuse_fs_lock(ra->next, path, readahead_fi(fi, &tmp), cmd, lock);
+}
+
+static int readahead_ioctl(const char *path, int cmd, void *arg,
+			   struct fuse_file_info *fi, unsigned int flags,
+			   void *data)
+{
+	struct readahead *ra = readahead_get();
+	struct fuse_file_info tmp;
+	return fuse_fs_ioctl(ra->next, path, cmd, arg, readahead_fi(fi, &tmp),
+			     flags, data);
+}
+
+static int readahead_poll(const char *path, struct fuse_file_info *fi,
+			  struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct readahead *ra = readahead_get();
+	struct fuse_file_info tmp;
+	return fuse_fs_poll(ra->next, path, readahead_fi(fi, &tmp), ph,
+			    reventsp);
+}
+
+static ssize_t readahead_copy_file_range(const char *path_in,
+					 struct fuse_file_info *fi_in,
+					 off_t off_in, const char *path_out,
+					 struct fuse_file_info *fi_out,
+					 off_t off_out, size_t len, int flags)
+{
+	struct readahead *ra = readahead_get();
+	struct readahead_file *rf = readahead_file(fi_out);
+	struct fuse_file_info tmp_in, tmp_out;
+
+	pthread_mutex_lock(&rf->lock);
+	readahead_cancel(ra, rf);
+	pthread_mutex_unlock(&rf->lock);
+	return fuse_fs_copy_file_range(ra->next, path_in,
+				       readahead_fi(fi_in, &tmp_in), off_in,
+				       path_out, readahead_fi(fi_out, &tmp_out),
+				       off_out, len, flags);
+}
+
+static int readahead_fallocate(const char *path, int mode, off_t offset,
+			       off_t length, struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	struct readahead_file *rf = readahead_file(fi);
+	struct fuse_file_info tmp;
+
+	pthread_mutex_lock(&rf->lock);
+	readahead_cancel(ra, rf);
+	pthread_mutex_unlock(&rf->lock);
+	return fuse_fs_fallocate(ra->next, path, mode, offset, length,
+				 readahead_fi(fi, &tmp));
+}
+
+static off_t readahead_lseek(const char *path, off_t off, int whence,
+			     struct fuse_file_info *fi)
+{
+	struct readahead *ra = readahead_get();
+	struct fuse_file_info tmp;
+	return fuse_fs_lseek(ra->next, path, off, whence,
+			     readahead_fi(fi, &tmp));
+}
+
+static void readahead_retrieve_reply(const char *path, void *cookie,
+				     off_t offset, const void *buf, size_t size)
+{
+	struct readahead *ra = readahead_get();
+	fuse_fs_retrieve_reply(ra->next, path, cookie, offset, buf, size);
+}
+
+static void *readahead_init(struct fuse_conn_info *conn)
+{
+	struct readahead *ra = readahead_get();
+	unsigned int i;
+
+	fuse_fs_init(ra->next, conn);
+
+	/* Threads are started here, after the process has daemonized */
+	for (i = 0; i < ra->nthreads; i++) {
+		int res = pthread_create(&ra->threads[i], NULL,
+					 readahead_worker, ra);
+		if (res != 0) {
+			fprintf(stderr, "fuse-readahead: error creating thread: %s\n",
+				strerror(res));
+			break;
+		}
+	}
+	ra->started = i;
+
+	return ra;
+}
+
+static void readahead_destroy(void *data)
+{
+	struct readahead *ra = data;
+	unsigned int i;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->exit = 1;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	for (i = 0; i < ra->started; i++)
+		pthread_join(ra->threads[i], NULL);
+
+	fuse_fs_destroy(ra->next);
+	if (ra->stats)
+		fprintf(stderr, "fuse-readahead: %llu prefetches, %llu hits, %llu cancelled\n",
+			ra->prefetches, ra->hits, ra->cancels);
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->cond);
+	free(ra->threads);
+	free(ra);
+}
+
+static struct fuse_operations readahead_oper = {
+	.destroy	= readahead_destroy,
+	.init		= readahead_init,
+	.getattr	= readahead_getattr,
+	.fgetattr	= readahead_fgetattr,
+	.access		= readahead_access,
+	.readlink	= readahead_readlink,
+	.opendir	= readahead_opendir,
+	.readdir	= readahead_readdir,
+	.releasedir	= readahead_releasedir,
+	.mknod		= readahead_mknod,
+	.mkdir		= readahead_mkdir,
+	.unlink		= readahead_unlink,
+	.rmdir		= readahead_rmdir,
+	.symlink	= readahead_symlink,
+	.rename		= readahead_rename,
+	.link		= readahead_link,
+	.chmod		= readahead_chmod,
+	.chown		= readahead_chown,
+	.truncate	= readahead_truncate,
+	.ftruncate	= readahead_ftruncate,
+	.utimens	= readahead_utimens,
+	.create		= readahead_create,
+	.open		= readahead_open,
+	.read		= readahead_read,
+	.write		= readahead_write,
+	.statfs		= readahead_statfs,
+	.flush		= readahead_flush,
+	.release	= readahead_release,
+	.fsync		= readahead_fsync,
+	.fsyncdir	= readahead_fsyncdir,
+	.setxattr	= readahead_setxattr,
+	.getxattr	= readahead_getxattr,
+	.listxattr	= readahead_listxattr,
+	.removexattr	= readahead_removexattr,
+	.lock		= readahead_lock,
+	.bmap		= readahead_bmap,
+	.ioctl		= readahead_ioctl,
+	.poll		= readahead_poll,
+	.copy_file_range = readahead_copy_file_range,
+	.fallocate	= readahead_fallocate,
+	.lseek		= readahead_lseek,
+	.retrieve_reply = readahead_retrieve_reply,
+#ifdef __APPLE__
+	.setvolname	= readahead_setvolname,
+	.exchange	= readahead_exchange,
+	.setattr_x	= readahead_setattr_x,
+	.fsetattr_x	= readahead_fsetattr_x,
+	.chflags	= readahead_chflags,
+	.getxtimes	= readahead_getxtimes,
+	.setbkuptime	= readahead_setbkuptime,
+	.setchgtime	= readahead_setchgtime,
+	.setcrtime	= readahead_setcrtime,
+#endif /* __APPLE__ */
+
+	.flag_nullpath_ok = 1,
+	.flag_private_fh = 1,
+};
+
+static struct fuse_opt readahead_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "readahead_min=%u", offsetof(struct readahead, min_window), 0 },
+	{ "readahead_max=%u", offsetof(struct readahead, max_window), 0 },
+	{ "readahead_threads=%u", offsetof(struct readahead, nthreads), 0 },
+	{ "readahead_stats", offsetof(struct readahead, stats), 1 },
+	FUSE_OPT_END
+};
+
+static void readahead_help(void)
+{
+	fprintf(stderr,
+"    -o readahead_min=N     initial prefetch size in bytes (default: 131072)\n"
+"    -o readahead_max=N     maximum prefetch size in bytes (default: 4194304)\n"
+"    -o readahead_threads=N number of prefetch threads (default: 2)\n"
+"    -o readahead_stats     print prefetch statistics on unmount\n");
+}
+
+static int readahead_opt_proc(void *data, const char *arg, int key,
+			      struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		readahead_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *readahead_new(struct fuse_args *args,
+				     struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct readahead *ra;
+
+	ra = calloc(1, sizeof(struct readahead));
+	if (ra == NULL) {
+		fprintf(stderr, "fuse-readahead: memory allocation failed\n");
+		return NULL;
+	}
+
+	ra->min_window = 131072;
+	ra->max_window = 4194304;
+	ra->nthreads = 2;
+	if (fuse_opt_parse(args, ra, readahead_opts, readahead_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-readahead: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	if (!ra->min_window || ra->max_window < ra->min_window ||
+	    ra->max_window > INT_MAX) {
+		fprintf(stderr, "fuse-readahead: invalid prefetch size\n");
+		goto out_free;
+	}
+
+	if (!ra->nthreads) {
+		fprintf(stderr, "fuse-readahead: at least one thread required\n");
+		goto out_free;
+	}
+
+	ra->threads = calloc(ra->nthreads, sizeof(pthread_t));
+	if (ra->threads == NULL) {
+		fprintf(stderr, "fuse-readahead: memory allocation failed\n");
+		goto out_free;
+	}
+
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+	ra->next = next[0];
+	fs = fuse_fs_new(&readahead_oper, sizeof(readahead_oper), ra);
+	if (!fs)
+		goto out_destroy;
+
+	return fs;
+
+out_destroy:
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->cond);
+	free(ra->threads);
+out_free:
+	free(ra);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(readahead, readahead_new);
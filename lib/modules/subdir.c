@@ -14,11 +14,23 @@
 #include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+
+/* Number of paths an operation may have translated at the same time */
+#define SUBDIR_SLOTS 2
+
+/* Per-thread scratch buffers for the translated paths */
+struct subdir_thread {
+	char *buf[SUBDIR_SLOTS];
+	size_t size[SUBDIR_SLOTS];
+	int busy[SUBDIR_SLOTS];
+};
 
 struct subdir {
 	char *base;
 	size_t baselen;
 	int rellinks;
+	pthread_key_t key;
 	struct fuse_fs *next;
 };
 
@@ -27,21 +39,84 @@ static struct subdir *subdir_get(void)
 	return fuse_get_context()->private_data;
 }
 
+static void subdir_thread_free(void *data)
+{
+	struct subdir_thread *dt = data;
+	int i;
+
+	for (i = 0; i < SUBDIR_SLOTS; i++)
+		free(dt->buf[i]);
+	free(dt);
+}
+
+static char *subdir_getbuf(struct subdir *d, size_t len)
+{
+	struct subdir_thread *dt = pthread_getspecific(d->key);
+	int i;
+
+	if (dt == NULL) {
+		dt = calloc(1, sizeof(struct subdir_thread));
+		if (dt == NULL)
+			return NULL;
+		pthread_setspecific(d->key, dt);
+	}
+	for (i = 0; i < SUBDIR_SLOTS; i++) {
+		if (dt->busy[i])
+			continue;
+		if (dt->size[i] < len) {
+			size_t newsize = dt->size[i] ? dt->size[i] : 256;
+			char *tmp;
+
+			while (newsize < len)
+				newsize *= 2;
+			tmp = realloc(dt->buf[i], newsize);
+			if (!tmp)
+				return NULL;
+			dt->buf[i] = tmp;
+			dt->size[i] = newsize;
+		}
+		dt->busy[i] = 1;
+		return dt->buf[i];
+	}
+	/* All slots in use: shouldn't happen, but cope anyway */
+	return malloc(len);
+}
+
+static void subdir_putpath(struct subdir *d, char *newpath)
+{
+	struct subdir_thread *dt;
+	int i;
+
+	if (newpath == NULL)
+		return;
+
+	dt = pthread_getspecific(d->key);
+	for (i = 0; dt != NULL && i < SUBDIR_SLOTS; i++) {
+		if (dt->buf[i] == newpath) {
+			dt->busy[i] = 0;
+			return;
+		}
+	}
+	free(newpath);
+}
+
 static int subdir_addpath(struct subdir *d, const char *path, char **newpathp)
 {
 	char *newpath = NULL;
 
 	if (path != NULL) {
-		unsigned newlen = d->baselen + strlen(path);
+		size_t len;
+
+		if (path[0] == '/')
+			path++;
+		len = strlen(path);
 
-		newpath = malloc(newlen + 2);
+		newpath = subdir_getbuf(d, d->baselen + len + 2);
 		if (!newpath)
 			return -ENOMEM;
 
-		if (path[0] == '/')
-			path++;
-		strcpy(newpath, d->base);
-		strcpy(newpath + d->baselen, path);
+		memcpy(newpath, d->base, d->baselen);
+		memcpy(newpath + d->baselen, path, len + 1);
 		if (!newpath[0])
 			strcpy(newpath, ".");
 	}
@@ -57,7 +132,7 @@ static int subdir_getattr(const char *path, struct stat *stbuf)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_getattr(d->next, newpath, stbuf);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -70,7 +145,7 @@ static int subdir_fgetattr(const char *path, struct stat *stbuf,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_fgetattr(d->next, newpath, stbuf, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -82,7 +157,7 @@ static int subdir_access(const char *path, int mask)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_access(d->next, newpath, mask);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -160,7 +235,7 @@ static int subdir_readlink(const char *path, char *buf, size_t size)
 		err = fuse_fs_readlink(d->next, newpath, buf, size);
 		if (!err && d->rellinks)
 			transform_symlink(d, newpath, buf, size);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -172,7 +247,7 @@ static int subdir_opendir(const char *path, struct fuse_file_info *fi)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_opendir(d->next, newpath, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -187,7 +262,7 @@ static int subdir_readdir(const char *path, void *buf,
 	if (!err) {
 		err = fuse_fs_readdir(d->next, newpath, buf, filler, offset,
 				      fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -199,7 +274,7 @@ static int subdir_releasedir(const char *path, struct fuse_file_info *fi)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_releasedir(d->next, newpath, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -211,7 +286,7 @@ static int subdir_mknod(const char *path, mode_t mode, dev_t rdev)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_mknod(d->next, newpath, mode, rdev);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -223,7 +298,7 @@ static int subdir_mkdir(const char *path, mode_t mode)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_mkdir(d->next, newpath, mode);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -235,7 +310,7 @@ static int subdir_unlink(const char *path)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_unlink(d->next, newpath);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -247,7 +322,7 @@ static int subdir_rmdir(const char *path)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_rmdir(d->next, newpath);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -259,7 +334,7 @@ static int subdir_symlink(const char *from, const char *path)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_symlink(d->next, from, newpath);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -285,12 +360,12 @@ static int subdir_exchange(const char *path1, const char *path2,
 	}
 	err = subdir_addpath(d, path2, &new2);
 	if (err) {
-		free(new1);
+		subdir_putpath(d, new1);
 		return err;
 	}
 	err = fuse_fs_exchange(d->next, new1, new2, options);
-	free(new1);
-	free(new2);
+	subdir_putpath(d, new1);
+	subdir_putpath(d, new2);
 	return err;
 }
 
@@ -306,9 +381,9 @@ static int subdir_rename(const char *from, const char *to)
 		err = subdir_addpath(d, to, &newto);
 		if (!err) {
 			err = fuse_fs_rename(d->next, newfrom, newto);
-			free(newto);
+			subdir_putpath(d, newto);
 		}
-		free(newfrom);
+		subdir_putpath(d, newfrom);
 	}
 	return err;
 }
@@ -323,9 +398,9 @@ static int subdir_link(const char *from, const char *to)
 		err = subdir_addpath(d, to, &newto);
 		if (!err) {
 			err = fuse_fs_link(d->next, newfrom, newto);
-			free(newto);
+			subdir_putpath(d, newto);
 		}
-		free(newfrom);
+		subdir_putpath(d, newfrom);
 	}
 	return err;
 }
@@ -339,7 +414,7 @@ static int subdir_setattr_x(const char *path, struct setattr_x *attr)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_setattr_x(d->next, newpath, attr);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -352,7 +427,7 @@ static int subdir_fsetattr_x(const char *path, struct setattr_x *attr,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_fsetattr_x(d->next, newpath, attr, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -364,7 +439,7 @@ static int subdir_chflags(const char *path, uint32_t flags)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_chflags(d->next, newpath, flags);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -377,7 +452,7 @@ static int subdir_getxtimes(const char *path, struct timespec *bkuptime,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_getxtimes(d->next, newpath, bkuptime, crtime);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -389,7 +464,7 @@ static int subdir_setbkuptime(const char *path, const struct timespec *bkuptime)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_setbkuptime(d->next, newpath, bkuptime);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -401,7 +476,7 @@ static int subdir_setchgtime(const char *path, const struct timespec *chgtime)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_setchgtime(d->next, newpath, chgtime);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -413,7 +488,7 @@ static int subdir_setcrtime(const char *path, const struct timespec *crtime)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_setcrtime(d->next, newpath, crtime);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -426,7 +501,7 @@ static int subdir_chmod(const char *path, mode_t mode)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_chmod(d->next, newpath, mode);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -438,7 +513,7 @@ static int subdir_chown(const char *path, uid_t uid, gid_t gid)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_chown(d->next, newpath, uid, gid);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -450,7 +525,7 @@ static int subdir_truncate(const char *path, off_t size)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_truncate(d->next, newpath, size);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -463,7 +538,7 @@ static int subdir_ftruncate(const char *path, off_t size,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_ftruncate(d->next, newpath, size, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -475,7 +550,7 @@ static int subdir_utimens(const char *path, const struct timespec ts[2])
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_utimens(d->next, newpath, ts);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -488,7 +563,7 @@ static int subdir_create(const char *path, mode_t mode,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_create(d->next, newpath, mode, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -500,7 +575,7 @@ static int subdir_open(const char *path, struct fuse_file_info *fi)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_open(d->next, newpath, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -513,7 +588,7 @@ static int subdir_read(const char *path, char *buf, size_t size, off_t offset,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_read(d->next, newpath, buf, size, offset, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -526,7 +601,7 @@ static int subdir_write(const char *path, const char *buf, size_t size,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_write(d->next, newpath, buf, size, offset, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -538,7 +613,7 @@ static int subdir_statfs(const char *path, struct statvfs *stbuf)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_statfs(d->next, newpath, stbuf);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -550,7 +625,7 @@ static int subdir_flush(const char *path, struct fuse_file_info *fi)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_flush(d->next, newpath, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -562,7 +637,7 @@ static int subdir_release(const char *path, struct fuse_file_info *fi)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_release(d->next, newpath, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -575,7 +650,7 @@ static int subdir_fsync(const char *path, int isdatasync,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_fsync(d->next, newpath, isdatasync, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -588,7 +663,7 @@ static int subdir_fsyncdir(const char *path, int isdatasync,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_fsyncdir(d->next, newpath, isdatasync, fi);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -612,7 +687,7 @@ static int subdir_setxattr(const char *path, const char *name,
 		err = fuse_fs_setxattr(d->next, newpath, name, value, size,
 				       flags);
 #endif /* __APPLE__ */
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -634,7 +709,7 @@ static int subdir_getxattr(const char *path, const char *name, char *value,
 #else
 		err = fuse_fs_getxattr(d->next, newpath, name, value, size);
 #endif /* __APPLE__ */
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -646,7 +721,7 @@ static int subdir_listxattr(const char *path, char *list, size_t size)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_listxattr(d->next, newpath, list, size);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -658,7 +733,7 @@ static int subdir_removexattr(const char *path, const char *name)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_removexattr(d->next, newpath, name);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -671,7 +746,7 @@ static int subdir_lock(const char *path, struct fuse_file_info *fi, int cmd,
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_lock(d->next, newpath, fi, cmd, lock);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
@@ -683,11 +758,73 @@ static int subdir_bmap(const char *path, size_t blocksize, uint64_t *idx)
 	int err = subdir_addpath(d, path, &newpath);
 	if (!err) {
 		err = fuse_fs_bmap(d->next, newpath, blocksize, idx);
-		free(newpath);
+		subdir_putpath(d, newpath);
 	}
 	return err;
 }
 
+static ssize_t subdir_copy_file_range(const char *path_in,
+				      struct fuse_file_info *fi_in,
+				      off_t off_in, const char *path_out,
+				      struct fuse_file_info *fi_out,
+				      off_t off_out, size_t len, int flags)
+{
+	struct subdir *d = subdir_get();
+	char *newin;
+	char *newout;
+	ssize_t err = subdir_addpath(d, path_in, &newin);
+	if (!err) {
+		err = subdir_addpath(d, path_out, &newout);
+		if (!err) {
+			err = fuse_fs_copy_file_range(d->next, newin, fi_in,
+						      off_in, newout, fi_out,
+						      off_out, len, flags);
+			subdir_putpath(d, newout);
+		}
+		subdir_putpath(d, newin);
+	}
+	return err;
+}
+
+static int subdir_fallocate(const char *path, int mode, off_t offset,
+			    off_t length, struct fuse_file_info *fi)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	int err = subdir_addpath(d, path, &newpath);
+	if (!err) {
+		err = fuse_fs_fallocate(d->next, newpath, mode, offset,
+					length, fi);
+		subdir_putpath(d, newpath);
+	}
+	return err;
+}
+
+static off_t subdir_lseek(const char *path, off_t off, int whence,
+			  struct fuse_file_info *fi)
+{
+	struct subdir *d = subdir_get();
+	char *newpath;
+	off_t res = subdir_addpath(d, path, &newpath);
+	if (!res) {
+		res = fuse_fs_lseek(d->next, newpath, off, whence, fi);
+		subdir_putpath(d, newpath);
+	}
+	return res;
+}
+
+static void subdir_retrieve_reply(const char *path, void *cookie,
+				  off_t offset, const void *buf, size_t size)
+{
+	struct subdir *d = subdir_get();
+	char *newpath = NULL;
+	if (path && subdir_addpath(d, path, &newpath) != 0)
+		newpath = NULL;
+	fuse_fs_retrieve_reply(d->next, newpath, cookie, offset, buf, size);
+	if (newpath)
+		subdir_putpath(d, newpath);
+}
+
 static void *subdir_init(struct fuse_conn_info *conn)
 {
 	struct subdir *d = subdir_get();
@@ -698,7 +835,13 @@ static void *subdir_init(struct fuse_conn_info *conn)
 static void subdir_destroy(void *data)
 {
 	struct subdir *d = data;
+	struct subdir_thread *dt;
+
 	fuse_fs_destroy(d->next);
+	dt = pthread_getspecific(d->key);
+	if (dt)
+		subdir_thread_free(dt);
+	pthread_key_delete(d->key);
 	free(d->base);
 	free(d);
 }
@@ -740,6 +883,10 @@ static struct fuse_operations subdir_oper = {
 	.removexattr	= subdir_removexattr,
 	.lock		= subdir_lock,
 	.bmap		= subdir_bmap,
+	.copy_file_range = subdir_copy_file_range,
+	.fallocate	= subdir_fallocate,
+	.lseek		= subdir_lseek,
+	.retrieve_reply = subdir_retrieve_reply,
 #ifdef __APPLE__
 	.setvolname	= subdir_setvolname,
 	.exchange	= subdir_exchange,
@@ -789,6 +936,7 @@ static struct fuse_fs *subdir_new(struct fuse_args *args,
 {
 	struct fuse_fs *fs;
 	struct subdir *d;
+	int err;
 
 	d = calloc(1, sizeof(struct subdir));
 	if (d == NULL) {
@@ -819,12 +967,20 @@ static struct fuse_fs *subdir_new(struct fuse_args *args,
 		strcat(d->base, "/");
 	}
 	d->baselen = strlen(d->base);
+	err = pthread_key_create(&d->key, subdir_thread_free);
+	if (err) {
+		fprintf(stderr, "fuse-subdir: failed to create thread specific key: %s\n",
+			strerror(err));
+		goto out_free;
+	}
 	d->next = next[0];
 	fs = fuse_fs_new(&subdir_oper, sizeof(subdir_oper), d);
 	if (!fs)
-		goto out_free;
+		goto out_key_delete;
 	return fs;
 
+out_key_delete:
+	pthread_key_delete(d->key);
 out_free:
 	free(d->base);
 	free(d);
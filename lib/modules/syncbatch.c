@@ -0,0 +1,759 @@
+/*
+  fuse syncbatch module: group concurrent fsync requests
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#define SYNCBATCH_HASH 256
+
+/* A request waiting in a batch, with the result for its own handle */
+struct syncbatch_req {
+	struct syncbatch_req *next;
+	const char *path;
+	struct fuse_file_info *fi;
+	int datasync;
+	int err;
+};
+
+/* The requests completed together by one round of backend syncs */
+struct syncbatch_batch {
+	int refs;
+	int done;
+	struct syncbatch_req *reqs;
+};
+
+/*
+ * Requests for the same file (or for everything, with syncbatch_global)
+ * that arrive while a sync is running are collected in 'pending', and
+ * completed together by the next round of syncs.
+ */
+struct syncbatch_group {
+	struct syncbatch_group *next;
+	char *key;
+	int isdir;
+	int refs;
+	int running;
+	struct syncbatch_batch *pending;
+	pthread_cond_t cond;
+};
+
+struct syncbatch {
+	struct fuse_fs *next;
+	unsigned int window;
+	int global;
+	int stats;
+	pthread_mutex_t lock;
+	struct syncbatch_group *groups[SYNCBATCH_HASH];
+	unsigned long long requests;
+	unsigned long long syncs;
+};
+
+static struct syncbatch *syncbatch_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static unsigned int syncbatch_hash(const char *key, int isdir)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *key; key++)
+		hash = (hash ^ (unsigned char) *key) * 16777619U;
+
+	return (hash + isdir) % SYNCBATCH_HASH;
+}
+
+static struct syncbatch_group *syncbatch_get_group(struct syncbatch *sb,
+						   const char *key, int isdir)
+{
+	unsigned int hash = syncbatch_hash(key, isdir);
+	struct syncbatch_group *g;
+
+	for (g = sb->groups[hash]; g != NULL; g = g->next)
+		if (g->isdir == isdir && strcmp(g->key, key) == 0)
+			break;
+
+	if (g == NULL) {
+		g = calloc(1, sizeof(struct syncbatch_group));
+		if (g == NULL)
+			return NULL;
+		g->key = strdup(key);
+		if (g->key == NULL) {
+			free(g);
+			return NULL;
+		}
+		g->isdir = isdir;
+		pthread_cond_init(&g->cond, NULL);
+		g->next = sb->groups[hash];
+		sb->groups[hash] = g;
+	}
+	g->refs++;
+
+	return g;
+}
+
+static void syncbatch_put_group(struct syncbatch *sb, struct syncbatch_group *g)
+{
+	struct syncbatch_group **gp;
+
+	if (--g->refs)
+		return;
+
+	gp = &sb->groups[syncbatch_hash(g->key, g->isdir)];
+	for (; *gp != NULL; gp = &(*gp)->next) {
+		if (*gp == g) {
+			*gp = g->next;
+			break;
+		}
+	}
+	pthread_cond_destroy(&g->cond);
+	free(g->key);
+	free(g);
+}
+
+static int syncbatch_do_sync(struct syncbatch *sb, const char *path,
+			     int datasync, struct fuse_file_info *fi,
+			     int isdir)
+{
+	if (isdir)
+		return fuse_fs_fsyncdir(sb->next, path, datasync, fi);
+	else
+		return fuse_fs_fsync(sb->next, path, datasync, fi);
+}
+
+static int syncbatch_same_file(struct syncbatch_req *a,
+			       struct syncbatch_req *b)
+{
+	if (a->fi->fh != b->fi->fh)
+		return 0;
+	if (a->path == NULL || b->path == NULL)
+		return a->path == b->path;
+	return strcmp(a->path, b->path) == 0;
+}
+
+/*
+ * Sync every distinct open file in the batch once, and hand each
+ * request the result for its own file.  A full sync is done if any of
+ * the requests for the file asked for one.  With syncbatch_global a
+ * single sync of any one of the files completes the whole batch.
+ * Returns the number of backend syncs.
+ */
+static unsigned int syncbatch_run(struct syncbatch *sb,
+				  struct syncbatch_batch *b, int isdir)
+{
+	struct syncbatch_req *req;
+	struct syncbatch_req *other;
+	unsigned int syncs = 0;
+
+	if (sb->global) {
+		int datasync = 1;
+		int err;
+
+		for (req = b->reqs; req != NULL; req = req->next)
+			if (!req->datasync)
+				datasync = 0;
+		err = syncbatch_do_sync(sb, b->reqs->path, datasync,
+					b->reqs->fi, isdir);
+		for (req = b->reqs; req != NULL; req = req->next)
+			req->err = err;
+		return 1;
+	}
+
+	for (req = b->reqs; req != NULL; req = req->next) {
+		int datasync = req->datasync;
+
+		for (other = b->reqs; other != req; other = other->next)
+			if (syncbatch_same_file(other, req))
+				break;
+		if (other != req) {
+			req->err = other->err;
+			continue;
+		}
+
+		for (other = req->next; other != NULL; other = other->next)
+			if (!other->datasync && syncbatch_same_file(other, req))
+				datasync = 0;
+
+		req->err = syncbatch_do_sync(sb, req->path, datasync, req->fi,
+					     isdir);
+		syncs++;
+	}
+
+	return syncs;
+}
+
+static int syncbatch_sync(struct syncbatch *sb, const char *path,
+			  int datasync, struct fuse_file_info *fi, int isdir)
+{
+	struct syncbatch_group *g;
+	struct syncbatch_batch *b;
+	struct syncbatch_req req;
+	unsigned int syncs;
+
+	pthread_mutex_lock(&sb->lock);
+	sb->requests++;
+	if (path == NULL && !sb->global)
+		goto out_direct;
+
+	g = syncbatch_get_group(sb, sb->global ? "" : path, isdir);
+	if (g == NULL)
+		goto out_direct;
+
+	b = g->pending;
+	if (b == NULL) {
+		b = calloc(1, sizeof(struct syncbatch_batch));
+		if (b == NULL) {
+			syncbatch_put_group(sb, g);
+			goto out_direct;
+		}
+		g->pending = b;
+	}
+	b->refs++;
+	req.path = path;
+	req.fi = fi;
+	req.datasync = datasync;
+	req.err = 0;
+	req.next = b->reqs;
+	b->reqs = &req;
+
+	while (!b->done) {
+		if (g->running) {
+			pthread_cond_wait(&g->cond, &sb->lock);
+			continue;
+		}
+
+		/* Become the leader for the pending batch */
+		g->running = 1;
+		if (sb->window) {
+			struct timespec ts;
+
+			ts.tv_sec = sb->window / 1000000;
+			ts.tv_nsec = (sb->window % 1000000) * 1000;
+			pthread_mutex_unlock(&sb->lock);
+			nanosleep(&ts, NULL);
+			pthread_mutex_lock(&sb->lock);
+		}
+		g->pending = NULL;
+		pthread_mutex_unlock(&sb->lock);
+
+		syncs = syncbatch_run(sb, b, isdir);
+
+		pthread_mutex_lock(&sb->lock);
+		sb->syncs += syncs;
+		b->done = 1;
+		g->running = 0;
+		pthread_cond_broadcast(&g->cond);
+	}
+	if (--b->refs == 0)
+		free(b);
+	syncbatch_put_group(sb, g);
+	pthread_mutex_unlock(&sb->lock);
+
+	return req.err;
+
+out_direct:
+	sb->syncs++;
+	pthread_mutex_unlock(&sb->lock);
+	return syncbatch_do_sync(sb, path, datasync, fi, isdir);
+}
+
+static int syncbatch_getattr(const char *path, struct stat *stbuf)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_getattr(sb->next, path, stbuf);
+}
+
+static int syncbatch_fgetattr(const char *path, struct stat *stbuf,
+			      struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_fgetattr(sb->next, path, stbuf, fi);
+}
+
+static int syncbatch_access(const char *path, int mask)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_access(sb->next, path, mask);
+}
+
+static int syncbatch_readlink(const char *path, char *buf, size_t size)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_readlink(sb->next, path, buf, size);
+}
+
+static int syncbatch_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_opendir(sb->next, path, fi);
+}
+
+static int syncbatch_readdir(const char *path, void *buf,
+			     fuse_fill_dir_t filler, off_t offset,
+			     struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_readdir(sb->next, path, buf, filler, offset, fi);
+}
+
+static int syncbatch_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_releasedir(sb->next, path, fi);
+}
+
+static int syncbatch_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_mknod(sb->next, path, mode, rdev);
+}
+
+static int syncbatch_mkdir(const char *path, mode_t mode)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_mkdir(sb->next, path, mode);
+}
+
+static int syncbatch_unlink(const char *path)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_unlink(sb->next, path);
+}
+
+static int syncbatch_rmdir(const char *path)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_rmdir(sb->next, path);
+}
+
+static int syncbatch_symlink(const char *from, const char *path)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_symlink(sb->next, from, path);
+}
+
+static int syncbatch_rename(const char *from, const char *to)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_rename(sb->next, from, to);
+}
+
+static int syncbatch_link(const char *from, const char *to)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_link(sb->next, from, to);
+}
+
+#ifdef __APPLE__
+
+static int syncbatch_setvolname(const char *volname)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_setvolname(sb->next, volname);
+}
+
+static int syncbatch_exchange(const char *path1, const char *path2,
+			      unsigned long options)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_exchange(sb->next, path1, path2, options);
+}
+
+static int syncbatch_setattr_x(const char *path, struct setattr_x *attr)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_setattr_x(sb->next, path, attr);
+}
+
+static int syncbatch_fsetattr_x(const char *path, struct setattr_x *attr,
+				struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_fsetattr_x(sb->next, path, attr, fi);
+}
+
+static int syncbatch_chflags(const char *path, uint32_t flags)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_chflags(sb->next, path, flags);
+}
+
+static int syncbatch_getxtimes(const char *path, struct timespec *bkuptime,
+			       struct timespec *crtime)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_getxtimes(sb->next, path, bkuptime, crtime);
+}
+
+static int syncbatch_setbkuptime(const char *path,
+				 const struct timespec *bkuptime)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_setbkuptime(sb->next, path, bkuptime);
+}
+
+static int syncbatch_setchgtime(const char *path,
+				const struct timespec *chgtime)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_setchgtime(sb->next, path, chgtime);
+}
+
+static int syncbatch_setcrtime(const char *path, const struct timespec *crtime)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_setcrtime(sb->next, path, crtime);
+}
+
+#endif /* __APPLE__ */
+
+static int syncbatch_chmod(const char *path, mode_t mode)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_chmod(sb->next, path, mode);
+}
+
+static int syncbatch_chown(const char *path, uid_t uid, gid_t gid)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_chown(sb->next, path, uid, gid);
+}
+
+static int syncbatch_truncate(const char *path, off_t size)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_truncate(sb->next, path, size);
+}
+
+static int syncbatch_ftruncate(const char *path, off_t size,
+			       struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_ftruncate(sb->next, path, size, fi);
+}
+
+static int syncbatch_utimens(const char *path, const struct timespec ts[2])
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_utimens(sb->next, path, ts);
+}
+
+static int syncbatch_create(const char *path, mode_t mode,
+			    struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_create(sb->next, path, mode, fi);
+}
+
+static int syncbatch_open(const char *path, struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_open(sb->next, path, fi);
+}
+
+static int syncbatch_read(const char *path, char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_read(sb->next, path, buf, size, offset, fi);
+}
+
+static int syncbatch_write(const char *path, const char *buf, size_t size,
+			   off_t offset, struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_write(sb->next, path, buf, size, offset, fi);
+}
+
+static int syncbatch_statfs(const char *path, struct statvfs *stbuf)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_statfs(sb->next, path, stbuf);
+}
+
+static int syncbatch_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_flush(sb->next, path, fi);
+}
+
+static int syncbatch_release(const char *path, struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_release(sb->next, path, fi);
+}
+
+#ifdef __APPLE__
+static int syncbatch_setxattr(const char *path, const char *name,
+		       const char *value, size_t size, int flags,
+		       uint32_t position)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_setxattr(sb->next, path, name, value, size, flags,
+				position);
+}
+
+static int syncbatch_getxattr(const char *path, const char *name, char *value,
+		       size_t size, uint32_t position)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_getxattr(sb->next, path, name, value, size, position);
+}
+#else
+static int syncbatch_setxattr(const char *path, const char *name,
+		       const char *value, size_t size, int flags)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_setxattr(sb->next, path, name, value, size, flags);
+}
+
+static int syncbatch_getxattr(const char *path, const char *name, char *value,
+		       size_t size)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_getxattr(sb->next, path, name, value, size);
+}
+#endif /* __APPLE__ */
+
+static int syncbatch_listxattr(const char *path, char *list, size_t size)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_listxattr(sb->next, path, list, size);
+}
+
+static int syncbatch_removexattr(const char *path, const char *name)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_removexattr(sb->next, path, name);
+}
+
+static int syncbatch_lock(const char *path, struct fuse_file_info *fi, int cmd,
+			  struct flock *lock)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_lock(sb->next, path, fi, cmd, lock);
+}
+
+static int syncbatch_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_bmap(sb->next, path, blocksize, idx);
+}
+
+static int syncbatch_ioctl(const char *path, int cmd, void *arg,
+			   struct fuse_file_info *fi, unsigned int flags,
+			   void *data)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_ioctl(sb->next, path, cmd, arg, fi, flags, data);
+}
+
+static int syncbatch_poll(const char *path, struct fuse_file_info *fi,
+			  struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_poll(sb->next, path, fi, ph, reventsp);
+}
+
+static ssize_t syncbatch_copy_file_range(const char *path_in,
+					 struct fuse_file_info *fi_in,
+					 off_t off_in, const char *path_out,
+					 struct fuse_file_info *fi_out,
+					 off_t off_out, size_t len, int flags)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_copy_file_range(sb->next, path_in, fi_in, off_in,
+				       path_out, fi_out, off_out, len, flags);
+}
+
+static int syncbatch_fallocate(const char *path, int mode, off_t offset,
+			       off_t length, struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_fallocate(sb->next, path, mode, offset, length, fi);
+}
+
+static off_t syncbatch_lseek(const char *path, off_t off, int whence,
+			     struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return fuse_fs_lseek(sb->next, path, off, whence, fi);
+}
+
+static void syncbatch_retrieve_reply(const char *path, void *cookie,
+				     off_t offset, const void *buf, size_t size)
+{
+	struct syncbatch *sb = syncbatch_get();
+	fuse_fs_retrieve_reply(sb->next, path, cookie, offset, buf, size);
+}
+
+static int syncbatch_fsync(const char *path, int isdatasync,
+			   struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return syncbatch_sync(sb, path, isdatasync, fi, 0);
+}
+
+static int syncbatch_fsyncdir(const char *path, int isdatasync,
+			      struct fuse_file_info *fi)
+{
+	struct syncbatch *sb = syncbatch_get();
+	return syncbatch_sync(sb, path, isdatasync, fi, 1);
+}
+
+static void *syncbatch_init(struct fuse_conn_info *conn)
+{
+	struct syncbatch *sb = syncbatch_get();
+	fuse_fs_init(sb->next, conn);
+	return sb;
+}
+
+static void syncbatch_destroy(void *data)
+{
+	struct syncbatch *sb = data;
+
+	fuse_fs_destroy(sb->next);
+	if (sb->stats)
+		fprintf(stderr, "fuse-syncbatch: %llu requests, %llu syncs\n",
+			sb->requests, sb->syncs);
+	pthread_mutex_destroy(&sb->lock);
+	free(sb);
+}
+
+static struct fuse_operations syncbatch_oper = {
+	.destroy	= syncbatch_destroy,
+	.init		= syncbatch_init,
+	.getattr	= syncbatch_getattr,
+	.fgetattr	= syncbatch_fgetattr,
+	.access		= syncbatch_access,
+	.readlink	= syncbatch_readlink,
+	.opendir	= syncbatch_opendir,
+	.readdir	= syncbatch_readdir,
+	.releasedir	= syncbatch_releasedir,
+	.mknod		= syncbatch_mknod,
+	.mkdir		= syncbatch_mkdir,
+	.unlink		= syncbatch_unlink,
+	.rmdir		= syncbatch_rmdir,
+	.symlink	= syncbatch_symlink,
+	.rename		= syncbatch_rename,
+	.link		= syncbatch_link,
+	.chmod		= syncbatch_chmod,
+	.chown		= syncbatch_chown,
+	.truncate	= syncbatch_truncate,
+	.ftruncate	= syncbatch_ftruncate,
+	.utimens	= syncbatch_utimens,
+	.create		= syncbatch_create,
+	.open		= syncbatch_open,
+	.read		= syncbatch_read,
+	.write		= syncbatch_write,
+	.statfs		= syncbatch_statfs,
+	.flush		= syncbatch_flush,
+	.release	= syncbatch_release,
+	.fsync		= syncbatch_fsync,
+	.fsyncdir	= syncbatch_fsyncdir,
+	.setxattr	= syncbatch_setxattr,
+	.getxattr	= syncbatch_getxattr,
+	.listxattr	= syncbatch_listxattr,
+	.removexattr	= syncbatch_removexattr,
+	.lock		= syncbatch_lock,
+	.bmap		= syncbatch_bmap,
+	.ioctl		= syncbatch_ioctl,
+	.poll		= syncbatch_poll,
+	.copy_file_range = syncbatch_copy_file_range,
+	.fallocate	= syncbatch_fallocate,
+	.lseek		= syncbatch_lseek,
+	.retrieve_reply = syncbatch_retrieve_reply,
+#ifdef __APPLE__
+	.setvolname	= syncbatch_setvolname,
+	.exchange	= syncbatch_exchange,
+	.setattr_x	= syncbatch_setattr_x,
+	.fsetattr_x	= syncbatch_fsetattr_x,
+	.chflags	= syncbatch_chflags,
+	.getxtimes	= syncbatch_getxtimes,
+	.setbkuptime	= syncbatch_setbkuptime,
+	.setchgtime	= syncbatch_setchgtime,
+	.setcrtime	= syncbatch_setcrtime,
+#endif /* __APPLE__ */
+
+	.flag_nullpath_ok = 1,
+};
+
+static struct fuse_opt syncbatch_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "syncbatch_window=%u", offsetof(struct syncbatch, window), 0 },
+	{ "syncbatch_global", offsetof(struct syncbatch, global), 1 },
+	{ "syncbatch_stats", offsetof(struct syncbatch, stats), 1 },
+	FUSE_OPT_END
+};
+
+static void syncbatch_help(void)
+{
+	fprintf(stderr,
+"    -o syncbatch_window=N  microseconds to wait for more requests (default: 0)\n"
+"    -o syncbatch_global    one backend sync completes a round of requests\n"
+"    -o syncbatch_stats     print sync statistics on unmount\n");
+}
+
+static int syncbatch_opt_proc(void *data, const char *arg, int key,
+			      struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		syncbatch_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *syncbatch_new(struct fuse_args *args,
+				     struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct syncbatch *sb;
+
+	sb = calloc(1, sizeof(struct syncbatch));
+	if (sb == NULL) {
+		fprintf(stderr, "fuse-syncbatch: memory allocation failed\n");
+		return NULL;
+	}
+
+	if (fuse_opt_parse(args, sb, syncbatch_opts, syncbatch_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-syncbatch: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	pthread_mutex_init(&sb->lock, NULL);
+	sb->next = next[0];
+	fs = fuse_fs_new(&syncbatch_oper, sizeof(syncbatch_oper), sb);
+	if (!fs)
+		goto out_destroy;
+
+	return fs;
+
+out_destroy:
+	pthread_mutex_destroy(&sb->lock);
+out_free:
+	free(sb);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(syncbatch, syncbatch_new);
@@ -0,0 +1,915 @@
+/*
+  fuse writebehind module: merge small sequential writes
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+/*
+ * Per open file state.  The module replaces the filesystem's file
+ * handle with a pointer to this, and hands the original down.
+ */
+struct writebehind_file {
+	struct fuse_file_info fi;
+	char *path;
+	pthread_mutex_t lock;
+	char *data;
+	off_t off;
+	size_t len;
+	int err;
+	int refctr;
+	struct writebehind_file *prev;
+	struct writebehind_file *next;
+};
+
+struct writebehind {
+	struct fuse_fs *next;
+	unsigned int max_size;
+	int stats;
+	pthread_mutex_t files_lock;
+	struct writebehind_file files;
+	pthread_mutex_t lock;
+	unsigned long long writes;
+	unsigned long long backend_writes;
+	unsigned long long errors;
+};
+
+static struct writebehind *writebehind_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static struct writebehind_file *writebehind_file(struct fuse_file_info *fi)
+{
+	return (struct writebehind_file *) (uintptr_t) fi->fh;
+}
+
+/* Make a copy of 'fi' carrying the filesystem's own file handle */
+static struct fuse_file_info *writebehind_fi(struct fuse_file_info *fi,
+					     struct fuse_file_info *tmp)
+{
+	*tmp = *fi;
+	tmp->fh = writebehind_file(fi)->fi.fh;
+	return tmp;
+}
+
+/*
+ * Write out the buffered data.  Must be called with wf->lock held.
+ * Returns a negative error if the write failed, or was short.
+ */
+static int writebehind_flush_buf(struct writebehind *wb,
+				 struct writebehind_file *wf, const char *path)
+{
+	struct fuse_file_info fi = wf->fi;
+	size_t done = 0;
+	int res = 0;
+
+	while (done < wf->len) {
+		res = fuse_fs_write(wb->next, path, wf->data + done,
+				    wf->len - done, wf->off + done, &fi);
+		pthread_mutex_lock(&wb->lock);
+		wb->backend_writes++;
+		pthread_mutex_unlock(&wb->lock);
+		if (res <= 0) {
+			if (res == 0)
+				res = -EIO;
+			break;
+		}
+		done += res;
+		res = 0;
+	}
+	wf->len = 0;
+	if (res) {
+		pthread_mutex_lock(&wb->lock);
+		wb->errors++;
+		pthread_mutex_unlock(&wb->lock);
+	}
+	return res;
+}
+
+/* Write out buffered data, keeping an error to be reported later */
+static void writebehind_writeout(struct writebehind *wb,
+				 struct writebehind_file *wf, const char *path)
+{
+	pthread_mutex_lock(&wf->lock);
+	if (wf->len) {
+		int err = writebehind_flush_buf(wb, wf, path);
+		if (err && !wf->err)
+			wf->err = err;
+	}
+	pthread_mutex_unlock(&wf->lock);
+}
+
+/* Write out buffered data, and return any error not yet reported */
+static int writebehind_sync(struct writebehind *wb,
+			    struct writebehind_file *wf, const char *path)
+{
+	int err;
+
+	pthread_mutex_lock(&wf->lock);
+	err = writebehind_flush_buf(wb, wf, path);
+	if (!err)
+		err = wf->err;
+	wf->err = 0;
+	pthread_mutex_unlock(&wf->lock);
+
+	return err;
+}
+
+/* Drop a reference taken with files_lock held, freeing on the last one */
+static void writebehind_file_put(struct writebehind *wb,
+				 struct writebehind_file *wf)
+{
+	int refctr;
+
+	pthread_mutex_lock(&wb->files_lock);
+	refctr = --wf->refctr;
+	pthread_mutex_unlock(&wb->files_lock);
+	if (refctr)
+		return;
+
+	pthread_mutex_destroy(&wf->lock);
+	free(wf->data);
+	free(wf->path);
+	free(wf);
+}
+
+/*
+ * Write out the data buffered for other handles of 'path' before an
+ * operation that looks at or changes the file by name.  Errors are
+ * reported later, through the handle.
+ *
+ * The matching handles are collected under files_lock, and written out
+ * after dropping it, so that a slow backend write doesn't hold up every
+ * open and release.
+ */
+static void writebehind_sync_path(struct writebehind *wb, const char *path)
+{
+	struct writebehind_file *wf;
+	struct writebehind_file **found;
+	size_t num = 0;
+	size_t i;
+
+	if (path == NULL)
+		return;
+
+	pthread_mutex_lock(&wb->files_lock);
+	for (wf = wb->files.next; wf != &wb->files; wf = wf->next)
+		if (wf->path && strcmp(wf->path, path) == 0)
+			num++;
+	if (!num) {
+		pthread_mutex_unlock(&wb->files_lock);
+		return;
+	}
+	found = malloc(num * sizeof(found[0]));
+	if (found == NULL) {
+		/* Still write everything out, only less concurrently */
+		for (wf = wb->files.next; wf != &wb->files; wf = wf->next)
+			if (wf->path && strcmp(wf->path, path) == 0)
+				writebehind_writeout(wb, wf, path);
+		pthread_mutex_unlock(&wb->files_lock);
+		return;
+	}
+	num = 0;
+	for (wf = wb->files.next; wf != &wb->files; wf = wf->next) {
+		if (wf->path && strcmp(wf->path, path) == 0) {
+			wf->refctr++;
+			found[num++] = wf;
+		}
+	}
+	pthread_mutex_unlock(&wb->files_lock);
+
+	for (i = 0; i < num; i++) {
+		writebehind_writeout(wb, found[i], path);
+		writebehind_file_put(wb, found[i]);
+	}
+	free(found);
+}
+
+/*
+ * Move the open files under 'from' to 'to', or forget their name if
+ * 'to' is NULL.  Like the path of a node, this covers everything below
+ * a renamed directory as well.
+ */
+static void writebehind_move_files(struct writebehind *wb, const char *from,
+				   const char *to)
+{
+	size_t len = strlen(from);
+	struct writebehind_file *wf;
+
+	pthread_mutex_lock(&wb->files_lock);
+	for (wf = wb->files.next; wf != &wb->files; wf = wf->next) {
+		char *newpath = NULL;
+
+		if (!wf->path || strncmp(wf->path, from, len) != 0 ||
+		    (wf->path[len] != '\0' && wf->path[len] != '/'))
+			continue;
+
+		if (to) {
+			newpath = malloc(strlen(to) + strlen(wf->path + len) + 1);
+			if (newpath) {
+				strcpy(newpath, to);
+				strcat(newpath, wf->path + len);
+			}
+		}
+		free(wf->path);
+		wf->path = newpath;
+	}
+	pthread_mutex_unlock(&wb->files_lock);
+}
+
+static void writebehind_file_free(struct writebehind *wb,
+				  struct writebehind_file *wf)
+{
+	pthread_mutex_lock(&wb->files_lock);
+	wf->prev->next = wf->next;
+	wf->next->prev = wf->prev;
+	pthread_mutex_unlock(&wb->files_lock);
+
+	writebehind_file_put(wb, wf);
+}
+
+static int writebehind_file_new(struct writebehind *wb, const char *path,
+				struct fuse_file_info *fi)
+{
+	struct writebehind_file *wf;
+
+	wf = calloc(1, sizeof(struct writebehind_file));
+	if (wf == NULL)
+		return -ENOMEM;
+
+	if (path) {
+		wf->path = strdup(path);
+		if (wf->path == NULL) {
+			free(wf);
+			return -ENOMEM;
+		}
+	}
+	pthread_mutex_init(&wf->lock, NULL);
+	wf->refctr = 1;
+	wf->fi = *fi;
+	fi->fh = (uintptr_t) wf;
+
+	pthread_mutex_lock(&wb->files_lock);
+	wf->next = wb->files.next;
+	wf->prev = &wb->files;
+	wb->files.next->prev = wf;
+	wb->files.next = wf;
+	pthread_mutex_unlock(&wb->files_lock);
+
+	return 0;
+}
+
+static int writebehind_access(const char *path, int mask)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_access(wb->next, path, mask);
+}
+
+static int writebehind_readlink(const char *path, char *buf, size_t size)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_readlink(wb->next, path, buf, size);
+}
+
+static int writebehind_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_opendir(wb->next, path, fi);
+}
+
+static int writebehind_readdir(const char *path, void *buf,
+			       fuse_fill_dir_t filler, off_t offset,
+			       struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_readdir(wb->next, path, buf, filler, offset, fi);
+}
+
+static int writebehind_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_releasedir(wb->next, path, fi);
+}
+
+static int writebehind_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_mknod(wb->next, path, mode, rdev);
+}
+
+static int writebehind_mkdir(const char *path, mode_t mode)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_mkdir(wb->next, path, mode);
+}
+
+static int writebehind_rmdir(const char *path)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_rmdir(wb->next, path);
+}
+
+static int writebehind_symlink(const char *from, const char *path)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_symlink(wb->next, from, path);
+}
+
+static int writebehind_link(const char *from, const char *to)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_link(wb->next, from, to);
+}
+
+#ifdef __APPLE__
+
+static int writebehind_setvolname(const char *volname)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_setvolname(wb->next, volname);
+}
+
+static int writebehind_chflags(const char *path, uint32_t flags)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_chflags(wb->next, path, flags);
+}
+
+static int writebehind_getxtimes(const char *path, struct timespec *bkuptime,
+				 struct timespec *crtime)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_getxtimes(wb->next, path, bkuptime, crtime);
+}
+
+static int writebehind_setbkuptime(const char *path,
+				   const struct timespec *bkuptime)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_setbkuptime(wb->next, path, bkuptime);
+}
+
+static int writebehind_setchgtime(const char *path,
+				  const struct timespec *chgtime)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_setchgtime(wb->next, path, chgtime);
+}
+
+static int writebehind_setcrtime(const char *path,
+				 const struct timespec *crtime)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_setcrtime(wb->next, path, crtime);
+}
+
+#endif /* __APPLE__ */
+
+static int writebehind_chmod(const char *path, mode_t mode)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_chmod(wb->next, path, mode);
+}
+
+static int writebehind_chown(const char *path, uid_t uid, gid_t gid)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_chown(wb->next, path, uid, gid);
+}
+
+static int writebehind_statfs(const char *path, struct statvfs *stbuf)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_statfs(wb->next, path, stbuf);
+}
+
+static int writebehind_fsyncdir(const char *path, int isdatasync,
+				struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_fsyncdir(wb->next, path, isdatasync, fi);
+}
+
+#ifdef __APPLE__
+static int writebehind_setxattr(const char *path, const char *name,
+		       const char *value, size_t size, int flags,
+		       uint32_t position)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_setxattr(wb->next, path, name, value, size, flags,
+				position);
+}
+
+static int writebehind_getxattr(const char *path, const char *name, char *value,
+		       size_t size, uint32_t position)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_getxattr(wb->next, path, name, value, size, position);
+}
+#else
+static int writebehind_setxattr(const char *path, const char *name,
+		       const char *value, size_t size, int flags)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_setxattr(wb->next, path, name, value, size, flags);
+}
+
+static int writebehind_getxattr(const char *path, const char *name, char *value,
+		       size_t size)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_getxattr(wb->next, path, name, value, size);
+}
+#endif /* __APPLE__ */
+
+static int writebehind_listxattr(const char *path, char *list, size_t size)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_listxattr(wb->next, path, list, size);
+}
+
+static int writebehind_removexattr(const char *path, const char *name)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_removexattr(wb->next, path, name);
+}
+
+static int writebehind_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	struct writebehind *wb = writebehind_get();
+	return fuse_fs_bmap(wb->next, path, blocksize, idx);
+}
+
+
+static int writebehind_getattr(const char *path, struct stat *stbuf)
+{
+	struct writebehind *wb = writebehind_get();
+	writebehind_sync_path(wb, path);
+	return fuse_fs_getattr(wb->next, path, stbuf);
+}
+
+static int writebehind_fgetattr(const char *path, struct stat *stbuf,
+				struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+	writebehind_writeout(wb, writebehind_file(fi), path);
+	return fuse_fs_fgetattr(wb->next, path, stbuf,
+				writebehind_fi(fi, &tmp));
+}
+
+static int writebehind_unlink(const char *path)
+{
+	struct writebehind *wb = writebehind_get();
+	int err;
+
+	writebehind_sync_path(wb, path);
+	err = fuse_fs_unlink(wb->next, path);
+	if (!err)
+		writebehind_move_files(wb, path, NULL);
+	return err;
+}
+
+static int writebehind_rename(const char *from, const char *to)
+{
+	struct writebehind *wb = writebehind_get();
+	int err;
+
+	writebehind_sync_path(wb, from);
+	writebehind_sync_path(wb, to);
+	err = fuse_fs_rename(wb->next, from, to);
+	if (err)
+		return err;
+
+	/* Keep matching the open files by their new name */
+	writebehind_move_files(wb, to, NULL);
+	writebehind_move_files(wb, from, to);
+	return 0;
+}
+
+#ifdef __APPLE__
+
+static int writebehind_exchange(const char *path1, const char *path2,
+				unsigned long options)
+{
+	struct writebehind *wb = writebehind_get();
+	writebehind_sync_path(wb, path1);
+	writebehind_sync_path(wb, path2);
+	return fuse_fs_exchange(wb->next, path1, path2, options);
+}
+
+static int writebehind_setattr_x(const char *path, struct setattr_x *attr)
+{
+	struct writebehind *wb = writebehind_get();
+	writebehind_sync_path(wb, path);
+	return fuse_fs_setattr_x(wb->next, path, attr);
+}
+
+static int writebehind_fsetattr_x(const char *path, struct setattr_x *attr,
+				  struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+	writebehind_writeout(wb, writebehind_file(fi), path);
+	return fuse_fs_fsetattr_x(wb->next, path, attr,
+				  writebehind_fi(fi, &tmp));
+}
+
+#endif /* __APPLE__ */
+
+static int writebehind_truncate(const char *path, off_t size)
+{
+	struct writebehind *wb = writebehind_get();
+	writebehind_sync_path(wb, path);
+	return fuse_fs_truncate(wb->next, path, size);
+}
+
+static int writebehind_ftruncate(const char *path, off_t size,
+				 struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+	writebehind_writeout(wb, writebehind_file(fi), path);
+	return fuse_fs_ftruncate(wb->next, path, size,
+				 writebehind_fi(fi, &tmp));
+}
+
+static int writebehind_utimens(const char *path, const struct timespec ts[2])
+{
+	struct writebehind *wb = writebehind_get();
+	writebehind_sync_path(wb, path);
+	return fuse_fs_utimens(wb->next, path, ts);
+}
+
+static int writebehind_create(const char *path, mode_t mode,
+			      struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	int err = fuse_fs_create(wb->next, path, mode, fi);
+	if (!err) {
+		err = writebehind_file_new(wb, path, fi);
+		if (err)
+			fuse_fs_release(wb->next, path, fi);
+	}
+	return err;
+}
+
+static int writebehind_open(const char *path, struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	int err = fuse_fs_open(wb->next, path, fi);
+	if (!err) {
+		err = writebehind_file_new(wb, path, fi);
+		if (err)
+			fuse_fs_release(wb->next, path, fi);
+	}
+	return err;
+}
+
+static int writebehind_read(const char *path, char *buf, size_t size,
+			    off_t offset, struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+	writebehind_writeout(wb, writebehind_file(fi), path);
+	writebehind_sync_path(wb, path);
+	return fuse_fs_read(wb->next, path, buf, size, offset,
+			    writebehind_fi(fi, &tmp));
+}
+
+static int writebehind_write(const char *path, const char *buf, size_t size,
+			     off_t offset, struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	struct writebehind_file *wf = writebehind_file(fi);
+	struct fuse_file_info tmp;
+	int err;
+
+	pthread_mutex_lock(&wb->lock);
+	wb->writes++;
+	pthread_mutex_unlock(&wb->lock);
+
+	pthread_mutex_lock(&wf->lock);
+	err = wf->err;
+	wf->err = 0;
+	if (err)
+		goto out_unlock;
+
+	/* Not contiguous with the buffered data, or no room left */
+	if (wf->len && (offset != wf->off + (off_t) wf->len ||
+			wf->len + size > wb->max_size)) {
+		err = writebehind_flush_buf(wb, wf, path);
+		if (err)
+			goto out_unlock;
+	}
+
+	if (size >= wb->max_size) {
+		pthread_mutex_unlock(&wf->lock);
+		pthread_mutex_lock(&wb->lock);
+		wb->backend_writes++;
+		pthread_mutex_unlock(&wb->lock);
+		return fuse_fs_write(wb->next, path, buf, size, offset,
+				     writebehind_fi(fi, &tmp));
+	}
+
+	if (wf->data == NULL) {
+		wf->data = malloc(wb->max_size);
+		if (wf->data == NULL) {
+			err = -ENOMEM;
+			goto out_unlock;
+		}
+	}
+	if (!wf->len)
+		wf->off = offset;
+	memcpy(wf->data + wf->len, buf, size);
+	wf->len += size;
+	pthread_mutex_unlock(&wf->lock);
+
+	return size;
+
+out_unlock:
+	pthread_mutex_unlock(&wf->lock);
+	return err;
+}
+
+static int writebehind_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+	int err = writebehind_sync(wb, writebehind_file(fi), path);
+	int res = fuse_fs_flush(wb->next, path, writebehind_fi(fi, &tmp));
+	return err ? err : res;
+}
+
+static int writebehind_release(const char *path, struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	struct writebehind_file *wf = writebehind_file(fi);
+	struct fuse_file_info tmp;
+	int err;
+
+	err = writebehind_sync(wb, wf, path);
+	if (err)
+		fprintf(stderr, "fuse-writebehind: error writing %s: %s\n",
+			path ? path : "(deleted)", strerror(-err));
+
+	err = fuse_fs_release(wb->next, path, writebehind_fi(fi, &tmp));
+	writebehind_file_free(wb, wf);
+	return err;
+}
+
+static int writebehind_fsync(const char *path, int isdatasync,
+			     struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+	int err = writebehind_sync(wb, writebehind_file(fi), path);
+	int res = fuse_fs_fsync(wb->next, path, isdatasync,
+				writebehind_fi(fi, &tmp));
+	return err ? err : res;
+}
+
+static int writebehind_lock(const char *path, struct fuse_file_info *fi,
+			    int cmd, struct flock *lock)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+	return fuse_fs_lock(wb->next, path, writebehind_fi(fi, &tmp), cmd,
+			    lock);
+}
+
+static int writebehind_ioctl(const char *path, int cmd, void *arg,
+			     struct fuse_file_info *fi, unsigned int flags,
+			     void *data)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+	writebehind_writeout(wb, writebehind_file(fi), path);
+	return fuse_fs_ioctl(wb->next, path, cmd, arg,
+			     writebehind_fi(fi, &tmp), flags, data);
+}
+
+static int writebehind_poll(const char *path, struct fuse_file_info *fi,
+			    struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+	return fuse_fs_poll(wb->next, path, writebehind_fi(fi, &tmp), ph,
+			    reventsp);
+}
+
+static ssize_t writebehind_copy_file_range(const char *path_in,
+					   struct fuse_file_info *fi_in,
+					   off_t off_in, const char *path_out,
+					   struct fuse_file_info *fi_out,
+					   off_t off_out, size_t len, int flags)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp_in, tmp_out;
+
+	writebehind_writeout(wb, writebehind_file(fi_in), path_in);
+	writebehind_writeout(wb, writebehind_file(fi_out), path_out);
+	return fuse_fs_copy_file_range(wb->next, path_in,
+				       writebehind_fi(fi_in, &tmp_in), off_in,
+				       path_out,
+				       writebehind_fi(fi_out, &tmp_out),
+				       off_out, len, flags);
+}
+
+static int writebehind_fallocate(const char *path, int mode, off_t offset,
+				 off_t length, struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+
+	writebehind_writeout(wb, writebehind_file(fi), path);
+	return fuse_fs_fallocate(wb->next, path, mode, offset, length,
+				 writebehind_fi(fi, &tmp));
+}
+
+static off_t writebehind_lseek(const char *path, off_t off, int whence,
+			       struct fuse_file_info *fi)
+{
+	struct writebehind *wb = writebehind_get();
+	struct fuse_file_info tmp;
+
+	writebehind_writeout(wb, writebehind_file(fi), path);
+	return fuse_fs_lseek(wb->next, path, off, whence,
+			     writebehind_fi(fi, &tmp));
+}
+
+static void writebehind_retrieve_reply(const char *path, void *cookie,
+				       off_t offset, const void *buf,
+				       size_t size)
+{
+	struct writebehind *wb = writebehind_get();
+	fuse_fs_retrieve_reply(wb->next, path, cookie, offset, buf, size);
+}
+
+static void *writebehind_init(struct fuse_conn_info *conn)
+{
+	struct writebehind *wb = writebehind_get();
+	fuse_fs_init(wb->next, conn);
+	return wb;
+}
+
+static void writebehind_destroy(void *data)
+{
+	struct writebehind *wb = data;
+
+	fuse_fs_destroy(wb->next);
+	if (wb->stats)
+		fprintf(stderr, "fuse-writebehind: %llu writes, %llu backend writes, %llu errors\n",
+			wb->writes, wb->backend_writes, wb->errors);
+	pthread_mutex_destroy(&wb->files_lock);
+	pthread_mutex_destroy(&wb->lock);
+	free(wb);
+}
+
+static struct fuse_operations writebehind_oper = {
+	.destroy	= writebehind_destroy,
+	.init		= writebehind_init,
+	.getattr	= writebehind_getattr,
+	.fgetattr	= writebehind_fgetattr,
+	.access		= writebehind_access,
+	.readlink	= writebehind_readlink,
+	.opendir	= writebehind_opendir,
+	.readdir	= writebehind_readdir,
+	.releasedir	= writebehind_releasedir,
+	.mknod		= writebehind_mknod,
+	.mkdir		= writebehind_mkdir,
+	.unlink		= writebehind_unlink,
+	.rmdir		= writebehind_rmdir,
+	.symlink	= writebehind_symlink,
+	.rename		= writebehind_rename,
+	.link		= writebehind_link,
+	.chmod		= writebehind_chmod,
+	.chown		= writebehind_chown,
+	.truncate	= writebehind_truncate,
+	.ftruncate	= writebehind_ftruncate,
+	.utimens	= writebehind_utimens,
+	.create		= writebehind_create,
+	.open		= writebehind_open,
+	.read		= writebehind_read,
+	.write		= writebehind_write,
+	.statfs		= writebehind_statfs,
+	.flush		= writebehind_flush,
+	.release	= writebehind_release,
+	.fsync		= writebehind_fsync,
+	.fsyncdir	= writebehind_fsyncdir,
+	.setxattr	= writebehind_setxattr,
+	.getxattr	= writebehind_getxattr,
+	.listxattr	= writebehind_listxattr,
+	.removexattr	= writebehind_removexattr,
+	.lock		= writebehind_lock,
+	.bmap		= writebehind_bmap,
+	.ioctl		= writebehind_ioctl,
+	.poll		= writebehind_poll,
+	.copy_file_range = writebehind_copy_file_range,
+	.fallocate	= writebehind_fallocate,
+	.lseek		= writebehind_lseek,
+	.retrieve_reply = writebehind_retrieve_reply,
+#ifdef __APPLE__
+	.setvolname	= writebehind_setvolname,
+	.exchange	= writebehind_exchange,
+	.setattr_x	= writebehind_setattr_x,
+	.fsetattr_x	= writebehind_fsetattr_x,
+	.chflags	= writebehind_chflags,
+	.getxtimes	= writebehind_getxtimes,
+	.setbkuptime	= writebehind_setbkuptime,
+	.setchgtime	= writebehind_setchgtime,
+	.setcrtime	= writebehind_setcrtime,
+#endif /* __APPLE__ */
+
+	.flag_nullpath_ok = 1,
+	.flag_private_fh = 1,
+};
+
+static struct fuse_opt writebehind_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "writebehind_size=%u", offsetof(struct writebehind, max_size), 0 },
+	{ "writebehind_stats", offsetof(struct writebehind, stats), 1 },
+	FUSE_OPT_END
+};
+
+static void writebehind_help(void)
+{
+	fprintf(stderr,
+"    -o writebehind_size=N  bytes buffered per open file (default: 1048576)\n"
+"    -o writebehind_stats   print write statistics on unmount\n");
+}
+
+static int writebehind_opt_proc(void *data, const char *arg, int key,
+				struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		writebehind_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *writebehind_new(struct fuse_args *args,
+				       struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct writebehind *wb;
+
+	wb = calloc(1, sizeof(struct writebehind));
+	if (wb == NULL) {
+		fprintf(stderr, "fuse-writebehind: memory allocation failed\n");
+		return NULL;
+	}
+
+	wb->max_size = 1048576;
+	if (fuse_opt_parse(args, wb, writebehind_opts,
+			   writebehind_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-writebehind: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	if (!wb->max_size || wb->max_size > INT_MAX) {
+		fprintf(stderr, "fuse-writebehind: invalid buffer size: %u\n",
+			wb->max_size);
+		goto out_free;
+	}
+
+	pthread_mutex_init(&wb->files_lock, NULL);
+	pthread_mutex_init(&wb->lock, NULL);
+	wb->files.next = wb->files.prev = &wb->files;
+	wb->next = next[0];
+	fs = fuse_fs_new(&writebehind_oper, sizeof(writebehind_oper), wb);
+	if (!fs)
+		goto out_destroy;
+
+	return fs;
+
+out_destroy:
+	pthread_mutex_destroy(&wb->files_lock);
+	pthread_mutex_destroy(&wb->lock);
+out_free:
+	free(wb);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(writebehind, writebehind_new);
@@ -0,0 +1,892 @@
+/*
+  fuse xattrcache module: cache extended attributes
+
+  This program can be distributed under the terms of the GNU LGPLv2.
+  See the file COPYING.LIB
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+#define XATTRCACHE_HASH 1024
+
+/* Largest value or list kept in the cache */
+#define XATTRCACHE_MAX_VALUE 65536
+
+/* A cached value, or the error returned for it */
+struct xattrcache_value {
+	struct xattrcache_value *next;
+	char *name;
+	double time;
+	int res;
+	char *value;
+};
+
+struct xattrcache_node {
+	struct xattrcache_node *hash_next;
+	struct xattrcache_node *lru_prev;
+	struct xattrcache_node *lru_next;
+	char *path;
+	struct xattrcache_value *values;
+	double list_time;
+	int list_res;
+	char *list;
+};
+
+struct xattrcache {
+	struct fuse_fs *next;
+	double ttl;
+	unsigned int max_nodes;
+	int stats;
+	pthread_mutex_t lock;
+	struct xattrcache_node *table[XATTRCACHE_HASH];
+	struct xattrcache_node lru;
+	unsigned int nnodes;
+	unsigned long gen;
+	unsigned long long hits;
+	unsigned long long misses;
+};
+
+static struct xattrcache *xattrcache_get(void)
+{
+	return fuse_get_context()->private_data;
+}
+
+static double xattrcache_now(void)
+{
+#ifdef __APPLE__
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif /* __APPLE__ */
+}
+
+/* Only remember errors that will not change by simply retrying */
+static int xattrcache_cacheable(int res)
+{
+	return res >= 0 || res == -ENOATTR || res == -ENODATA ||
+		res == -ENOTSUP || res == -ENOSYS;
+}
+
+static unsigned int xattrcache_hash(const char *path)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *path; path++)
+		hash = (hash ^ (unsigned char) *path) * 16777619U;
+
+	return hash % XATTRCACHE_HASH;
+}
+
+static struct xattrcache_node *xattrcache_lookup(struct xattrcache *xc,
+						 const char *path)
+{
+	struct xattrcache_node *node;
+
+	node = xc->table[xattrcache_hash(path)];
+	for (; node != NULL; node = node->hash_next)
+		if (strcmp(node->path, path) == 0)
+			break;
+
+	return node;
+}
+
+static void xattrcache_free_value(struct xattrcache_value *val)
+{
+	free(val->name);
+	free(val->value);
+	free(val);
+}
+
+static void xattrcache_remove(struct xattrcache *xc,
+			      struct xattrcache_node *node)
+{
+	struct xattrcache_node **nodep;
+
+	nodep = &xc->table[xattrcache_hash(node->path)];
+	for (; *nodep != NULL; nodep = &(*nodep)->hash_next) {
+		if (*nodep == node) {
+			*nodep = node->hash_next;
+			break;
+		}
+	}
+	node->lru_prev->lru_next = node->lru_next;
+	node->lru_next->lru_prev = node->lru_prev;
+	xc->nnodes--;
+
+	while (node->values) {
+		struct xattrcache_value *val = node->values;
+		node->values = val->next;
+		xattrcache_free_value(val);
+	}
+	free(node->list);
+	free(node->path);
+	free(node);
+}
+
+/* Look up or create the node for 'path', and make it most recent */
+static struct xattrcache_node *xattrcache_node(struct xattrcache *xc,
+					       const char *path)
+{
+	struct xattrcache_node *node = xattrcache_lookup(xc, path);
+
+	if (node == NULL) {
+		unsigned int hash = xattrcache_hash(path);
+
+		node = calloc(1, sizeof(struct xattrcache_node));
+		if (node == NULL)
+			return NULL;
+		node->path = strdup(path);
+		if (node->path == NULL) {
+			free(node);
+			return NULL;
+		}
+		node->hash_next = xc->table[hash];
+		xc->table[hash] = node;
+		xc->nnodes++;
+	} else {
+		node->lru_prev->lru_next = node->lru_next;
+		node->lru_next->lru_prev = node->lru_prev;
+	}
+	node->lru_next = xc->lru.lru_next;
+	node->lru_prev = &xc->lru;
+	xc->lru.lru_next->lru_prev = node;
+	xc->lru.lru_next = node;
+
+	while (xc->nnodes > xc->max_nodes && xc->lru.lru_prev != node)
+		xattrcache_remove(xc, xc->lru.lru_prev);
+
+	return node;
+}
+
+static void xattrcache_invalidate(struct xattrcache *xc, const char *path)
+{
+	struct xattrcache_node *node;
+
+	if (path == NULL)
+		return;
+
+	pthread_mutex_lock(&xc->lock);
+	xc->gen++;
+	node = xattrcache_lookup(xc, path);
+	if (node != NULL)
+		xattrcache_remove(xc, node);
+	pthread_mutex_unlock(&xc->lock);
+}
+
+/* Drop 'path' and everything below it */
+static void xattrcache_invalidate_tree(struct xattrcache *xc,
+				       const char *path)
+{
+	size_t len = strlen(path);
+	struct xattrcache_node *node;
+	struct xattrcache_node *next;
+
+	pthread_mutex_lock(&xc->lock);
+	xc->gen++;
+	for (node = xc->lru.lru_next; node != &xc->lru; node = next) {
+		next = node->lru_next;
+		if (strncmp(node->path, path, len) == 0 &&
+		    (node->path[len] == '\0' || node->path[len] == '/'))
+			xattrcache_remove(xc, node);
+	}
+	pthread_mutex_unlock(&xc->lock);
+}
+
+/*
+ * Answer a getxattr or listxattr request from a cached result, in the
+ * same way the filesystem would: the length for a size probe, -ERANGE
+ * if the buffer is too small.
+ */
+static int xattrcache_reply(int res, const char *data, char *buf,
+			    size_t size)
+{
+	if (res < 0 || size == 0)
+		return res;
+	if ((size_t) res > size)
+		return -ERANGE;
+	memcpy(buf, data, res);
+	return res;
+}
+
+#ifdef __APPLE__
+static int xattrcache_getxattr(const char *path, const char *name,
+			       char *value, size_t size, uint32_t position)
+#else
+static int xattrcache_getxattr(const char *path, const char *name,
+			       char *value, size_t size)
+#endif /* __APPLE__ */
+{
+	struct xattrcache *xc = xattrcache_get();
+	struct xattrcache_node *node;
+	struct xattrcache_value *val;
+	unsigned long gen;
+	char *buf;
+	int res;
+
+#ifdef __APPLE__
+	if (path == NULL || position != 0)
+		return fuse_fs_getxattr(xc->next, path, name, value, size,
+					position);
+#else
+	if (path == NULL)
+		return fuse_fs_getxattr(xc->next, path, name, value, size);
+#endif /* __APPLE__ */
+
+	pthread_mutex_lock(&xc->lock);
+	node = xattrcache_lookup(xc, path);
+	for (val = node ? node->values : NULL; val; val = val->next) {
+		if (strcmp(val->name, name) == 0) {
+			if (xattrcache_now() - val->time < xc->ttl) {
+				xc->hits++;
+				res = xattrcache_reply(val->res, val->value,
+						       value, size);
+				pthread_mutex_unlock(&xc->lock);
+				return res;
+			}
+			break;
+		}
+	}
+	xc->misses++;
+	gen = xc->gen;
+	pthread_mutex_unlock(&xc->lock);
+
+	/* Fetch the whole value, whatever was asked for */
+	buf = malloc(XATTRCACHE_MAX_VALUE);
+	if (buf == NULL)
+		return -ENOMEM;
+#ifdef __APPLE__
+	res = fuse_fs_getxattr(xc->next, path, name, buf, XATTRCACHE_MAX_VALUE,
+			       0);
+#else
+	res = fuse_fs_getxattr(xc->next, path, name, buf, XATTRCACHE_MAX_VALUE);
+#endif /* __APPLE__ */
+	if (res == -ERANGE) {
+		/* Too big to cache */
+		free(buf);
+#ifdef __APPLE__
+		return fuse_fs_getxattr(xc->next, path, name, value, size, 0);
+#else
+		return fuse_fs_getxattr(xc->next, path, name, value, size);
+#endif /* __APPLE__ */
+	}
+
+	pthread_mutex_lock(&xc->lock);
+	if (xc->gen == gen && xattrcache_cacheable(res) &&
+	    (node = xattrcache_node(xc, path)) != NULL) {
+		struct xattrcache_value **valp;
+
+		for (valp = &node->values; *valp; valp = &(*valp)->next) {
+			if (strcmp((*valp)->name, name) == 0) {
+				val = *valp;
+				*valp = val->next;
+				xattrcache_free_value(val);
+				break;
+			}
+		}
+		val = calloc(1, sizeof(struct xattrcache_value));
+		if (val != NULL) {
+			val->name = strdup(name);
+			val->value = res > 0 ? malloc(res) : NULL;
+			if (val->name == NULL || (res > 0 && !val->value)) {
+				xattrcache_free_value(val);
+			} else {
+				if (res > 0)
+					memcpy(val->value, buf, res);
+				val->res = res;
+				val->time = xattrcache_now();
+				val->next = node->values;
+				node->values = val;
+			}
+		}
+	}
+	pthread_mutex_unlock(&xc->lock);
+
+	res = xattrcache_reply(res, buf, value, size);
+	free(buf);
+	return res;
+}
+
+static int xattrcache_listxattr(const char *path, char *list, size_t size)
+{
+	struct xattrcache *xc = xattrcache_get();
+	struct xattrcache_node *node;
+	unsigned long gen;
+	char *buf;
+	int res;
+
+	if (path == NULL)
+		return fuse_fs_listxattr(xc->next, path, list, size);
+
+	pthread_mutex_lock(&xc->lock);
+	node = xattrcache_lookup(xc, path);
+	if (node != NULL && node->list_time &&
+	    xattrcache_now() - node->list_time < xc->ttl) {
+		xc->hits++;
+		res = xattrcache_reply(node->list_res, node->list, list, size);
+		pthread_mutex_unlock(&xc->lock);
+		return res;
+	}
+	xc->misses++;
+	gen = xc->gen;
+	pthread_mutex_unlock(&xc->lock);
+
+	buf = malloc(XATTRCACHE_MAX_VALUE);
+	if (buf == NULL)
+		return -ENOMEM;
+	res = fuse_fs_listxattr(xc->next, path, buf, XATTRCACHE_MAX_VALUE);
+	if (res == -ERANGE) {
+		free(buf);
+		return fuse_fs_listxattr(xc->next, path, list, size);
+	}
+
+	pthread_mutex_lock(&xc->lock);
+	if (xc->gen == gen && xattrcache_cacheable(res) &&
+	    (node = xattrcache_node(xc, path)) != NULL) {
+		char *copy = res > 0 ? malloc(res) : NULL;
+
+		if (res <= 0 || copy != NULL) {
+			if (res > 0)
+				memcpy(copy, buf, res);
+			free(node->list);
+			node->list = copy;
+			node->list_res = res;
+			node->list_time = xattrcache_now();
+		}
+	}
+	pthread_mutex_unlock(&xc->lock);
+
+	res = xattrcache_reply(res, buf, list, size);
+	free(buf);
+	return res;
+}
+
+#ifdef __APPLE__
+static int xattrcache_setxattr(const char *path, const char *name,
+			       const char *value, size_t size, int flags,
+			       uint32_t position)
+#else
+static int xattrcache_setxattr(const char *path, const char *name,
+			       const char *value, size_t size, int flags)
+#endif /* __APPLE__ */
+{
+	struct xattrcache *xc = xattrcache_get();
+	int err;
+
+#ifdef __APPLE__
+	err = fuse_fs_setxattr(xc->next, path, name, value, size, flags,
+			       position);
+#else
+	err = fuse_fs_setxattr(xc->next, path, name, value, size, flags);
+#endif /* __APPLE__ */
+	xattrcache_invalidate(xc, path);
+	return err;
+}
+
+static int xattrcache_getattr(const char *path, struct stat *stbuf)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_getattr(xc->next, path, stbuf);
+}
+
+static int xattrcache_fgetattr(const char *path, struct stat *stbuf,
+			       struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_fgetattr(xc->next, path, stbuf, fi);
+}
+
+static int xattrcache_access(const char *path, int mask)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_access(xc->next, path, mask);
+}
+
+static int xattrcache_readlink(const char *path, char *buf, size_t size)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_readlink(xc->next, path, buf, size);
+}
+
+static int xattrcache_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_opendir(xc->next, path, fi);
+}
+
+static int xattrcache_readdir(const char *path, void *buf,
+			      fuse_fill_dir_t filler, off_t offset,
+			      struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_readdir(xc->next, path, buf, filler, offset, fi);
+}
+
+static int xattrcache_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_releasedir(xc->next, path, fi);
+}
+
+static int xattrcache_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_mknod(xc->next, path, mode, rdev);
+}
+
+static int xattrcache_mkdir(const char *path, mode_t mode)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_mkdir(xc->next, path, mode);
+}
+
+static int xattrcache_symlink(const char *from, const char *path)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_symlink(xc->next, from, path);
+}
+
+static int xattrcache_link(const char *from, const char *to)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_link(xc->next, from, to);
+}
+
+#ifdef __APPLE__
+
+static int xattrcache_setvolname(const char *volname)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_setvolname(xc->next, volname);
+}
+
+static int xattrcache_chflags(const char *path, uint32_t flags)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_chflags(xc->next, path, flags);
+}
+
+static int xattrcache_getxtimes(const char *path, struct timespec *bkuptime,
+				struct timespec *crtime)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_getxtimes(xc->next, path, bkuptime, crtime);
+}
+
+static int xattrcache_setbkuptime(const char *path,
+				  const struct timespec *bkuptime)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_setbkuptime(xc->next, path, bkuptime);
+}
+
+static int xattrcache_setchgtime(const char *path,
+				 const struct timespec *chgtime)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_setchgtime(xc->next, path, chgtime);
+}
+
+static int xattrcache_setcrtime(const char *path, const struct timespec *crtime)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_setcrtime(xc->next, path, crtime);
+}
+
+#endif /* __APPLE__ */
+
+static int xattrcache_truncate(const char *path, off_t size)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_truncate(xc->next, path, size);
+}
+
+static int xattrcache_ftruncate(const char *path, off_t size,
+				struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_ftruncate(xc->next, path, size, fi);
+}
+
+static int xattrcache_utimens(const char *path, const struct timespec ts[2])
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_utimens(xc->next, path, ts);
+}
+
+static int xattrcache_create(const char *path, mode_t mode,
+			     struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_create(xc->next, path, mode, fi);
+}
+
+static int xattrcache_open(const char *path, struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_open(xc->next, path, fi);
+}
+
+static int xattrcache_read(const char *path, char *buf, size_t size,
+			   off_t offset, struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_read(xc->next, path, buf, size, offset, fi);
+}
+
+static int xattrcache_write(const char *path, const char *buf, size_t size,
+			    off_t offset, struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_write(xc->next, path, buf, size, offset, fi);
+}
+
+static int xattrcache_statfs(const char *path, struct statvfs *stbuf)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_statfs(xc->next, path, stbuf);
+}
+
+static int xattrcache_flush(const char *path, struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_flush(xc->next, path, fi);
+}
+
+static int xattrcache_release(const char *path, struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_release(xc->next, path, fi);
+}
+
+static int xattrcache_fsync(const char *path, int isdatasync,
+			    struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_fsync(xc->next, path, isdatasync, fi);
+}
+
+static int xattrcache_fsyncdir(const char *path, int isdatasync,
+			       struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_fsyncdir(xc->next, path, isdatasync, fi);
+}
+
+static int xattrcache_lock(const char *path, struct fuse_file_info *fi, int cmd,
+			   struct flock *lock)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_lock(xc->next, path, fi, cmd, lock);
+}
+
+static int xattrcache_bmap(const char *path, size_t blocksize, uint64_t *idx)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_bmap(xc->next, path, blocksize, idx);
+}
+
+static int xattrcache_ioctl(const char *path, int cmd, void *arg,
+			    struct fuse_file_info *fi, unsigned int flags,
+			    void *data)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_ioctl(xc->next, path, cmd, arg, fi, flags, data);
+}
+
+static int xattrcache_poll(const char *path, struct fuse_file_info *fi,
+			   struct fuse_pollhandle *ph, unsigned *reventsp)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_poll(xc->next, path, fi, ph, reventsp);
+}
+
+static ssize_t xattrcache_copy_file_range(const char *path_in,
+					  struct fuse_file_info *fi_in,
+					  off_t off_in, const char *path_out,
+					  struct fuse_file_info *fi_out,
+					  off_t off_out, size_t len, int flags)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_copy_file_range(xc->next, path_in, fi_in, off_in,
+				       path_out, fi_out, off_out, len, flags);
+}
+
+static int xattrcache_fallocate(const char *path, int mode, off_t offset,
+				off_t length, struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_fallocate(xc->next, path, mode, offset, length, fi);
+}
+
+static off_t xattrcache_lseek(const char *path, off_t off, int whence,
+			      struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	return fuse_fs_lseek(xc->next, path, off, whence, fi);
+}
+
+static void xattrcache_retrieve_reply(const char *path, void *cookie,
+				      off_t offset, const void *buf,
+				      size_t size)
+{
+	struct xattrcache *xc = xattrcache_get();
+	fuse_fs_retrieve_reply(xc->next, path, cookie, offset, buf, size);
+}
+
+static int xattrcache_removexattr(const char *path, const char *name)
+{
+	struct xattrcache *xc = xattrcache_get();
+	int err = fuse_fs_removexattr(xc->next, path, name);
+	xattrcache_invalidate(xc, path);
+	return err;
+}
+
+static int xattrcache_unlink(const char *path)
+{
+	struct xattrcache *xc = xattrcache_get();
+	int err = fuse_fs_unlink(xc->next, path);
+	xattrcache_invalidate(xc, path);
+	return err;
+}
+
+static int xattrcache_rmdir(const char *path)
+{
+	struct xattrcache *xc = xattrcache_get();
+	int err = fuse_fs_rmdir(xc->next, path);
+	xattrcache_invalidate(xc, path);
+	return err;
+}
+
+static int xattrcache_rename(const char *from, const char *to)
+{
+	struct xattrcache *xc = xattrcache_get();
+	int err = fuse_fs_rename(xc->next, from, to);
+	xattrcache_invalidate_tree(xc, from);
+	xattrcache_invalidate_tree(xc, to);
+	return err;
+}
+
+/* ACLs are usually stored in xattrs, and follow the mode */
+static int xattrcache_chmod(const char *path, mode_t mode)
+{
+	struct xattrcache *xc = xattrcache_get();
+	int err = fuse_fs_chmod(xc->next, path, mode);
+	xattrcache_invalidate(xc, path);
+	return err;
+}
+
+static int xattrcache_chown(const char *path, uid_t uid, gid_t gid)
+{
+	struct xattrcache *xc = xattrcache_get();
+	int err = fuse_fs_chown(xc->next, path, uid, gid);
+	xattrcache_invalidate(xc, path);
+	return err;
+}
+
+#ifdef __APPLE__
+
+static int xattrcache_exchange(const char *path1, const char *path2,
+			       unsigned long options)
+{
+	struct xattrcache *xc = xattrcache_get();
+	int err = fuse_fs_exchange(xc->next, path1, path2, options);
+	xattrcache_invalidate(xc, path1);
+	xattrcache_invalidate(xc, path2);
+	return err;
+}
+
+static int xattrcache_setattr_x(const char *path, struct setattr_x *attr)
+{
+	struct xattrcache *xc = xattrcache_get();
+	int err = fuse_fs_setattr_x(xc->next, path, attr);
+	xattrcache_invalidate(xc, path);
+	return err;
+}
+
+static int xattrcache_fsetattr_x(const char *path, struct setattr_x *attr,
+				 struct fuse_file_info *fi)
+{
+	struct xattrcache *xc = xattrcache_get();
+	int err = fuse_fs_fsetattr_x(xc->next, path, attr, fi);
+	xattrcache_invalidate(xc, path);
+	return err;
+}
+
+#endif /* __APPLE__ */
+
+static void *xattrcache_init(struct fuse_conn_info *conn)
+{
+	struct xattrcache *xc = xattrcache_get();
+	fuse_fs_init(xc->next, conn);
+	return xc;
+}
+
+static void xattrcache_destroy(void *data)
+{
+	struct xattrcache *xc = data;
+
+	fuse_fs_destroy(xc->next);
+	if (xc->stats)
+		fprintf(stderr, "fuse-xattrcache: %llu hits, %llu misses\n",
+			xc->hits, xc->misses);
+	while (xc->lru.lru_next != &xc->lru)
+		xattrcache_remove(xc, xc->lru.lru_next);
+	pthread_mutex_destroy(&xc->lock);
+	free(xc);
+}
+
+static struct fuse_operations xattrcache_oper = {
+	.destroy	= xattrcache_destroy,
+	.init		= xattrcache_init,
+	.getattr	= xattrcache_getattr,
+	.fgetattr	= xattrcache_fgetattr,
+	.access		= xattrcache_access,
+	.readlink	= xattrcache_readlink,
+	.opendir	= xattrcache_opendir,
+	.readdir	= xattrcache_readdir,
+	.releasedir	= xattrcache_releasedir,
+	.mknod		= xattrcache_mknod,
+	.mkdir		= xattrcache_mkdir,
+	.unlink		= xattrcache_unlink,
+	.rmdir		= xattrcache_rmdir,
+	.symlink	= xattrcache_symlink,
+	.rename		= xattrcache_rename,
+	.link		= xattrcache_link,
+	.chmod		= xattrcache_chmod,
+	.chown		= xattrcache_chown,
+	.truncate	= xattrcache_truncate,
+	.ftruncate	= xattrcache_ftruncate,
+	.utimens	= xattrcache_utimens,
+	.create		= xattrcache_create,
+	.open		= xattrcache_open,
+	.read		= xattrcache_read,
+	.write		= xattrcache_write,
+	.statfs		= xattrcache_statfs,
+	.flush		= xattrcache_flush,
+	.release	= xattrcache_release,
+	.fsync		= xattrcache_fsync,
+	.fsyncdir	= xattrcache_fsyncdir,
+	.setxattr	= xattrcache_setxattr,
+	.getxattr	= xattrcache_getxattr,
+	.listxattr	= xattrcache_listxattr,
+	.removexattr	= xattrcache_removexattr,
+	.lock		= xattrcache_lock,
+	.bmap		= xattrcache_bmap,
+	.ioctl		= xattrcache_ioctl,
+	.poll		= xattrcache_poll,
+	.copy_file_range = xattrcache_copy_file_range,
+	.fallocate	= xattrcache_fallocate,
+	.lseek		= xattrcache_lseek,
+	.retrieve_reply = xattrcache_retrieve_reply,
+#ifdef __APPLE__
+	.setvolname	= xattrcache_setvolname,
+	.exchange	= xattrcache_exchange,
+	.setattr_x	= xattrcache_setattr_x,
+	.fsetattr_x	= xattrcache_fsetattr_x,
+	.chflags	= xattrcache_chflags,
+	.getxtimes	= xattrcache_getxtimes,
+	.setbkuptime	= xattrcache_setbkuptime,
+	.setchgtime	= xattrcache_setchgtime,
+	.setcrtime	= xattrcache_setcrtime,
+#endif /* __APPLE__ */
+
+	.flag_nullpath_ok = 1,
+};
+
+static struct fuse_opt xattrcache_opts[] = {
+	FUSE_OPT_KEY("-h", 0),
+	FUSE_OPT_KEY("--help", 0),
+	{ "xattrcache_ttl=%lf", offsetof(struct xattrcache, ttl), 0 },
+	{ "xattrcache_max=%u", offsetof(struct xattrcache, max_nodes), 0 },
+	{ "xattrcache_stats", offsetof(struct xattrcache, stats), 1 },
+	FUSE_OPT_END
+};
+
+static void xattrcache_help(void)
+{
+	fprintf(stderr,
+"    -o xattrcache_ttl=T    seconds to keep cached attributes (default: 1.0)\n"
+"    -o xattrcache_max=N    maximum number of cached paths (default: 4096)\n"
+"    -o xattrcache_stats    print cache statistics on unmount\n");
+}
+
+static int xattrcache_opt_proc(void *data, const char *arg, int key,
+			       struct fuse_args *outargs)
+{
+	(void) data; (void) arg; (void) outargs;
+
+	if (!key) {
+		xattrcache_help();
+		return -1;
+	}
+
+	return 1;
+}
+
+static struct fuse_fs *xattrcache_new(struct fuse_args *args,
+				      struct fuse_fs *next[])
+{
+	struct fuse_fs *fs;
+	struct xattrcache *xc;
+
+	xc = calloc(1, sizeof(struct xattrcache));
+	if (xc == NULL) {
+		fprintf(stderr, "fuse-xattrcache: memory allocation failed\n");
+		return NULL;
+	}
+
+	xc->ttl = 1.0;
+	xc->max_nodes = 4096;
+	if (fuse_opt_parse(args, xc, xattrcache_opts,
+			   xattrcache_opt_proc) == -1)
+		goto out_free;
+
+	if (!next[0] || next[1]) {
+		fprintf(stderr, "fuse-xattrcache: exactly one next filesystem required\n");
+		goto out_free;
+	}
+
+	if (!xc->max_nodes) {
+		fprintf(stderr, "fuse-xattrcache: cache must hold at least one path\n");
+		goto out_free;
+	}
+
+	pthread_mutex_init(&xc->lock, NULL);
+	xc->lru.lru_next = xc->lru.lru_prev = &xc->lru;
+	xc->next = next[0];
+	fs = fuse_fs_new(&xattrcache_oper, sizeof(xattrcache_oper), xc);
+	if (!fs)
+		goto out_destroy;
+
+	return fs;
+
+out_destroy:
+	pthread_mutex_destroy(&xc->lock);
+out_free:
+	free(xc);
+	return NULL;
+}
+
+FUSE_REGISTER_MODULE(xattrcache, xattrcache_new);
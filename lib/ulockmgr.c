@@ -8,6 +8,9 @@
 
 /* #define DEBUG 1 */
 
+/* For F_OFD_SETLK */
+#define _GNU_SOURCE
+
 #include "ulockmgr.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +21,7 @@
 #include <assert.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #ifdef __APPLE__
 #undef _POSIX_C_SOURCE
 #include <sys/socket.h>
@@ -34,7 +38,7 @@
 struct message {
 	unsigned intr : 1;
 	unsigned nofd : 1;
-	pthread_t thr;
+	unsigned long long cookie;
 	int cmd;
 	int fd;
 	struct flock lock;
@@ -49,7 +53,6 @@ struct fd_store {
 
 struct owner {
 	struct owner *next;
-	struct owner *prev;
 	struct fd_store *fds;
 	void *id;
 	size_t id_len;
@@ -58,25 +61,73 @@ struct owner {
 
 static pthread_mutex_t ulockmgr_lock;
 static int ulockmgr_cfd = -1;
-static struct owner owner_list = { .next = &owner_list, .prev = &owner_list };
+
+#define OWNER_HASH_SIZE 256
+
+static struct owner *owner_table[OWNER_HASH_SIZE];
 
 #define MAX_SEND_FDS 2
 
-static void list_del_owner(struct owner *owner)
+#ifdef F_OFD_SETLK
+#define ULOCKMGR_OFD 1
+
+/*
+ * Linux can keep the locks in-process, using open file description
+ * locks: each owner gets a private open file description for each file
+ * it locks, so locks of different owners conflict, and locks of one
+ * owner taken through different fds of the same file merge, just as
+ * with the per-owner processes of ulockmgr_server.  The server is still
+ * used if the kernel lacks OFD locks, or the file cannot be reopened.
+ */
+struct ofd_file {
+	struct ofd_file *next;
+	dev_t dev;
+	ino_t ino;
+	int fd;		/* -1 if the server holds the locks */
+	int refs;
+	void *id;
+	size_t id_len;
+};
+
+#define OFD_HASH_SIZE 1024
+
+static struct ofd_file *ofd_table[OFD_HASH_SIZE];
+static int ofd_supported = -1;
+#endif /* F_OFD_SETLK */
+
+static uint32_t owner_hash(const unsigned char *id, size_t id_len)
 {
-	struct owner *prev = owner->prev;
-	struct owner *next = owner->next;
-	prev->next = next;
-	next->prev = prev;
+	uint32_t h = 0;
+	size_t i;
+	for (i = 0; i < id_len; i++)
+		h = ((h << 8) | (h >> 24)) ^ id[i];
+
+	return h;
+}
+
+static struct owner **owner_bucket(const void *id, size_t id_len)
+{
+	return &owner_table[owner_hash(id, id_len) % OWNER_HASH_SIZE];
 }
 
-static void list_add_owner(struct owner *owner, struct owner *next)
+static void del_owner(struct owner *owner)
 {
-	struct owner *prev = next->prev;
-	owner->next = next;
-	owner->prev = prev;
-	prev->next = owner;
-	next->prev = owner;
+	struct owner **op = owner_bucket(owner->id, owner->id_len);
+
+	for (; *op; op = &(*op)->next) {
+		if (*op == owner) {
+			*op = owner->next;
+			break;
+		}
+	}
+}
+
+static void add_owner(struct owner *owner)
+{
+	struct owner **op = owner_bucket(owner->id, owner->id_len);
+
+	owner->next = *op;
+	*op = owner;
 }
 
 /*
@@ -192,7 +243,7 @@ static struct owner *ulockmgr_new_owner(const void *id, size_t id_len)
 
 	o->cfd = sv[1];
 	memcpy(o->id, id, id_len);
-	list_add_owner(o, &owner_list);
+	add_owner(o);
 
 	return o;
 
@@ -218,13 +269,10 @@ static int ulockmgr_send_request(struct message *msg, const void *id,
 	int unlockall = (cmd == F_SETLK && msg->lock.l_type == F_UNLCK &&
 			 msg->lock.l_start == 0 && msg->lock.l_len == 0);
 
-	for (o = owner_list.next; o != &owner_list; o = o->next)
+	for (o = *owner_bucket(id, id_len); o; o = o->next)
 		if (o->id_len == id_len && memcmp(o->id, id, id_len) == 0)
 			break;
 
-	if (o == &owner_list)
-		o = NULL;
-
 	if (!o && cmd != F_GETLK && msg->lock.l_type != F_UNLCK)
 		o = ulockmgr_new_owner(id, id_len);
 
@@ -347,7 +395,7 @@ static int ulockmgr_send_request(struct message *msg, const void *id,
 				fp = &f->next;
 		}
 		if (!o->fds) {
-			list_del_owner(o);
+			del_owner(o);
 			close(o->cfd);
 			free(o);
 		}
@@ -359,17 +407,208 @@ static int ulockmgr_send_request(struct message *msg, const void *id,
 	return -msg->error;
 }
 
-#ifdef DEBUG
-static uint32_t owner_hash(const unsigned char *id, size_t id_len)
+#ifdef ULOCKMGR_OFD
+static struct ofd_file **ofd_hash(const struct stat *stbuf, const void *id,
+				  size_t id_len)
 {
-	uint32_t h = 0;
-	size_t i;
-	for (i = 0; i < id_len; i++)
-		h = ((h << 8) | (h >> 24)) ^ id[i];
+	uint32_t h = owner_hash(id, id_len);
 
-	return h;
+	h ^= (uint32_t) stbuf->st_ino * 2654435761U;
+	h ^= (uint32_t) stbuf->st_dev;
+
+	return &ofd_table[h % OFD_HASH_SIZE];
 }
-#endif
+
+static struct ofd_file *ofd_lookup(const struct stat *stbuf, const void *id,
+				   size_t id_len)
+{
+	struct ofd_file *of = *ofd_hash(stbuf, id, id_len);
+
+	for (; of; of = of->next)
+		if (of->ino == stbuf->st_ino && of->dev == stbuf->st_dev &&
+		    of->id_len == id_len && memcmp(of->id, id, id_len) == 0)
+			break;
+
+	return of;
+}
+
+static void ofd_unhash(struct ofd_file *of, const struct stat *stbuf)
+{
+	struct ofd_file **ofp = ofd_hash(stbuf, of->id, of->id_len);
+
+	for (; *ofp; ofp = &(*ofp)->next) {
+		if (*ofp == of) {
+			*ofp = of->next;
+			of->refs--;
+			break;
+		}
+	}
+}
+
+static void ofd_put(struct ofd_file *of)
+{
+	if (--of->refs == 0) {
+		if (of->fd != -1)
+			close(of->fd);
+		free(of);
+	}
+}
+
+/*
+ * Open a new file description for the file behind 'fd'.  Only regular
+ * files are reopened, since opening a device may have side effects.
+ */
+static int ofd_open(int fd, const struct stat *stbuf)
+{
+	char procname[64];
+	int flags;
+	int res;
+
+	if (!S_ISREG(stbuf->st_mode))
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1)
+		return -1;
+
+	snprintf(procname, sizeof(procname), "/proc/self/fd/%i", fd);
+	/* Read-write if possible, so both read and write locks work */
+	res = open(procname, O_RDWR | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (res == -1 && (flags & O_ACCMODE) != O_RDWR)
+		res = open(procname, (flags & O_ACCMODE) | O_NONBLOCK |
+			   O_NOCTTY | O_CLOEXEC);
+
+	return res;
+}
+
+static struct ofd_file *ofd_get(int fd, const struct stat *stbuf,
+				const void *id, size_t id_len, int create)
+{
+	struct ofd_file *of;
+	struct ofd_file **ofp;
+
+	of = ofd_lookup(stbuf, id, id_len);
+	if (of || !create) {
+		if (of)
+			of->refs++;
+		return of;
+	}
+
+	of = calloc(1, sizeof(struct ofd_file) + id_len);
+	if (!of) {
+		fprintf(stderr, "libulockmgr: failed to allocate memory\n");
+		return NULL;
+	}
+	of->id = of + 1;
+	of->id_len = id_len;
+	memcpy(of->id, id, id_len);
+	of->dev = stbuf->st_dev;
+	of->ino = stbuf->st_ino;
+	of->fd = ofd_open(fd, stbuf);
+	of->refs = 2;
+	ofp = ofd_hash(stbuf, id, id_len);
+	of->next = *ofp;
+	*ofp = of;
+
+	return of;
+}
+
+static int ofd_check_supported(int fd)
+{
+	if (ofd_supported == -1) {
+		struct flock lock;
+
+		memset(&lock, 0, sizeof(lock));
+		lock.l_type = F_WRLCK;
+		lock.l_whence = SEEK_SET;
+		if (fcntl(fd, F_OFD_GETLK, &lock) == -1 && errno == EINVAL)
+			ofd_supported = 0;
+		else
+			ofd_supported = 1;
+	}
+	return ofd_supported;
+}
+
+/*
+ * Returns 1 if the request has to be sent to the server, otherwise the
+ * result is stored in msg->error.  Called with ulockmgr_lock held.
+ */
+static int ulockmgr_ofd_request(struct message *msg, const void *id,
+				size_t id_len)
+{
+	struct stat stbuf;
+	struct ofd_file *of;
+	int cmd = msg->cmd;
+	int ofdcmd;
+	int res;
+	int unlockall = (cmd == F_SETLK && msg->lock.l_type == F_UNLCK &&
+			 msg->lock.l_start == 0 && msg->lock.l_len == 0);
+
+	if (!ofd_check_supported(msg->fd))
+		return 1;
+
+	if (fstat(msg->fd, &stbuf) == -1) {
+		msg->error = errno;
+		return 0;
+	}
+
+	of = ofd_get(msg->fd, &stbuf, id, id_len,
+		     cmd != F_GETLK && msg->lock.l_type != F_UNLCK);
+	if (!of) {
+		/* The owner holds no locks on this file */
+		msg->error = 0;
+		if (cmd == F_GETLK) {
+			msg->lock.l_pid = 0;
+			res = fcntl(msg->fd, F_OFD_GETLK, &msg->lock);
+			if (res == -1)
+				msg->error = errno;
+		} else if (msg->lock.l_type != F_UNLCK)
+			msg->error = ENOLCK;
+		return 0;
+	}
+
+	if (unlockall)
+		ofd_unhash(of, &stbuf);
+
+	if (of->fd == -1) {
+		ofd_put(of);
+		return 1;
+	}
+
+	if (cmd == F_GETLK)
+		ofdcmd = F_OFD_GETLK;
+	else if (cmd == F_SETLK)
+		ofdcmd = F_OFD_SETLK;
+	else
+		ofdcmd = F_OFD_SETLKW;
+
+	pthread_mutex_unlock(&ulockmgr_lock);
+	msg->lock.l_pid = 0;
+	if (ofdcmd == F_OFD_SETLKW) {
+		sigset_t old;
+		sigset_t unblock;
+
+		/* Let the interrupt signal break the wait */
+		sigemptyset(&unblock);
+		sigaddset(&unblock, SIGUSR1);
+		pthread_sigmask(SIG_UNBLOCK, &unblock, &old);
+		res = fcntl(of->fd, ofdcmd, &msg->lock);
+		msg->error = (res == -1) ? errno : 0;
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	} else {
+		res = fcntl(of->fd, ofdcmd, &msg->lock);
+		msg->error = (res == -1) ? errno : 0;
+	}
+	pthread_mutex_lock(&ulockmgr_lock);
+
+	/* Closing the file description will drop the locks anyway */
+	if (unlockall)
+		msg->error = 0;
+	ofd_put(of);
+
+	return 0;
+}
+#endif /* ULOCKMGR_OFD */
 
 static int ulockmgr_canonicalize(int fd, struct flock *lock)
 {
@@ -447,6 +686,11 @@ int ulockmgr_op(int fd, int cmd, struct flock *lock, const void *owner,
 	sigaddset(&block, SIGUSR1);
 	pthread_sigmask(SIG_BLOCK, &block, &old);
 	pthread_mutex_lock(&ulockmgr_lock);
+#ifdef ULOCKMGR_OFD
+	if (!ulockmgr_ofd_request(&msg, owner, owner_len))
+		err = -msg.error;
+	else
+#endif /* ULOCKMGR_OFD */
 	err = ulockmgr_send_request(&msg, owner, owner_len);
 	pthread_mutex_unlock(&ulockmgr_lock);
 	pthread_sigmask(SIG_SETMASK, &old, NULL);
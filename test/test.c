@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
@@ -7,8 +8,10 @@
 #include <utime.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 
 static char testfile[1024];
@@ -22,8 +25,13 @@ static const char *testdir_files[] = { "f1", "f2", NULL};
 static char zerodata[4096];
 static int testdatalen = sizeof(testdata) - 1;
 static int testdata2len = sizeof(testdata2) - 1;
+static double min_speedup;
 
 #define MAX_ENTRIES 1024
+#define PARALLEL_THREADS 8
+#define PARALLEL_FILES 256
+#define PARALLEL_LOOKUPS 4096
+#define STAT_LOOPS 100000
 
 static void test_perror(const char *func, const char *msg)
 {
@@ -1258,14 +1266,217 @@ static int test_mkdir(void)
 	return 0;
 }
 
+struct parallel_arg {
+	pthread_t thread;
+	int id;
+	int nthreads;
+	int err;
+};
+
+static void *parallel_create(void *data)
+{
+	struct parallel_arg *arg = (struct parallel_arg *) data;
+	char fpath[sizeof(testdir) + 32];
+	int i;
+
+	for (i = arg->id; i < PARALLEL_FILES; i += arg->nthreads) {
+		sprintf(fpath, "%s/f%i", testdir, i);
+		if (create_file(fpath, "", 0) == -1) {
+			arg->err = -1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void *parallel_lookup(void *data)
+{
+	struct parallel_arg *arg = (struct parallel_arg *) data;
+	char fpath[sizeof(testdir) + 32];
+	struct stat stbuf;
+	int i;
+
+	/* Negative lookups aren't cached, so each one reaches the
+	   filesystem */
+	for (i = arg->id; i < PARALLEL_LOOKUPS; i += arg->nthreads) {
+		sprintf(fpath, "%s/n%i_%i", testdir, arg->nthreads, i);
+		if (lstat(fpath, &stbuf) == 0 || errno != ENOENT) {
+			ERROR("lookup of nonexistent file: %s",
+			      strerror(errno));
+			arg->err = -1;
+			break;
+		}
+		sprintf(fpath, "%s/f%i", testdir, i % PARALLEL_FILES);
+		if (lstat(fpath, &stbuf) == -1) {
+			PERROR("lstat");
+			arg->err = -1;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int run_parallel(void *(*func)(void *), int nthreads, double *time)
+{
+	struct parallel_arg args[PARALLEL_THREADS];
+	struct timeval start, end;
+	int err = 0;
+	int res;
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nthreads; i++) {
+		args[i].id = i;
+		args[i].nthreads = nthreads;
+		args[i].err = 0;
+		res = pthread_create(&args[i].thread, NULL, func, &args[i]);
+		if (res != 0) {
+			ERROR("pthread_create: %s", strerror(res));
+			nthreads = i;
+			err = -1;
+			break;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(args[i].thread, NULL);
+		err += args[i].err;
+	}
+	gettimeofday(&end, NULL);
+	if (time)
+		*time = (end.tv_sec - start.tv_sec) +
+			(end.tv_usec - start.tv_usec) / 1000000.0;
+
+	return err ? -1 : 0;
+}
+
+/*
+ * Lookups in one directory only reach the filesystem in parallel with
+ * -o parallel_dirops, and only a slow filesystem shows the difference.
+ * With "-s N" the test fails unless PARALLEL_THREADS threads do at least
+ * N times the lookups of one, e.g. "-s 4" against fusexmp with 1ms added
+ * to getattr.
+ */
+static int test_parallel_dirops(void)
+{
+	const char *dir_contents[PARALLEL_FILES + 1];
+	char names[PARALLEL_FILES][16];
+	double serial, parallel;
+	int res;
+	int i;
+
+	start_test("parallel dirops");
+	for (i = 0; i < PARALLEL_FILES; i++) {
+		sprintf(names[i], "f%i", i);
+		dir_contents[i] = names[i];
+	}
+	dir_contents[i] = NULL;
+
+	rmdir(testdir);
+	res = mkdir(testdir, 0755);
+	if (res == -1) {
+		PERROR("mkdir");
+		return -1;
+	}
+	res = run_parallel(parallel_create, PARALLEL_THREADS, NULL);
+	if (res == -1)
+		goto out;
+	res = check_dir_contents(testdir, dir_contents);
+	if (res == -1)
+		goto out;
+
+	res = run_parallel(parallel_lookup, 1, &serial);
+	if (res == -1)
+		goto out;
+	res = run_parallel(parallel_lookup, PARALLEL_THREADS, &parallel);
+	if (res == -1)
+		goto out;
+	if (serial / parallel < min_speedup) {
+		ERROR("%i threads: %.2fx the lookup rate of one, expected %.2fx",
+		      PARALLEL_THREADS, serial / parallel, min_speedup);
+		goto out;
+	}
+
+	res = cleanup_dir(testdir, dir_contents, 0);
+	if (res == -1)
+		goto out;
+	res = rmdir(testdir);
+	if (res == -1) {
+		PERROR("rmdir");
+		return -1;
+	}
+	res = check_nonexist(testdir);
+	if (res == -1)
+		return -1;
+
+	success();
+	fprintf(stderr, "[%s] %i threads: %.2fx the lookup rate of one\n",
+		testname, PARALLEL_THREADS, serial / parallel);
+	return 0;
+
+out:
+	cleanup_dir(testdir, dir_contents, 1);
+	rmdir(testdir);
+	return -1;
+}
+
+/*
+ * Not a correctness test: report how fast the same file can be stat-ed,
+ * which with attr_timeout=0 is the cost of a getattr round trip through
+ * the library and any stacked modules.
+ */
+static int test_stat_rate(void)
+{
+	struct timeval start, end;
+	struct stat stbuf;
+	double time;
+	int res;
+	int i;
+
+	start_test("stat rate");
+	res = create_file(testfile, testdata, testdatalen);
+	if (res == -1)
+		return -1;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < STAT_LOOPS; i++) {
+		res = lstat(testfile, &stbuf);
+		if (res == -1) {
+			PERROR("lstat");
+			unlink(testfile);
+			return -1;
+		}
+	}
+	gettimeofday(&end, NULL);
+	time = (end.tv_sec - start.tv_sec) +
+		(end.tv_usec - start.tv_usec) / 1000000.0;
+
+	res = unlink(testfile);
+	if (res == -1) {
+		PERROR("unlink");
+		return -1;
+	}
+
+	success();
+	fprintf(stderr, "[%s] %.0f stats per second\n", testname,
+		STAT_LOOPS / time);
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	const char *basepath;
 	int err = 0;
 
 	umask(0);
+	if (argc == 4 && strcmp(argv[1], "-s") == 0) {
+		/* Minimum speedup of parallel lookups */
+		min_speedup = atof(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
 	if (argc != 2) {
-		fprintf(stderr, "usage: %s testdir\n", argv[0]);
+		fprintf(stderr, "usage: %s [-s min_speedup] testdir\n",
+			argv[0]);
 		return 1;
 	}
 	basepath = argv[1];
@@ -1286,6 +1497,8 @@ int main(int argc, char *argv[])
 	err += test_link();
 	err += test_mkfifo();
 	err += test_mkdir();
+	err += test_parallel_dirops();
+	err += test_stat_rate();
 	err += test_rename_file();
 	err += test_rename_dir();
 	err += test_utime();
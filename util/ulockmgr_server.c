@@ -21,11 +21,12 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/time.h>
 
 struct message {
 	unsigned intr : 1;
 	unsigned nofd : 1;
-	pthread_t thr;
+	unsigned long long cookie;
 	int cmd;
 	int fd;
 	struct flock lock;
@@ -39,16 +40,39 @@ struct fd_store {
 	int inuse;
 };
 
-struct owner {
-	struct fd_store *fds;
-	pthread_mutex_t lock;
-};
-
 struct req_data {
+	struct req_data *next;
 	struct owner *o;
 	int cfd;
 	struct fd_store *f;
 	struct message msg;
+	pthread_t thr;
+	struct timeval queued;
+};
+
+#define FD_HASH_SIZE 64
+
+/* Maximum number of idle threads kept for waiting on locks, per owner */
+#define MAX_IDLE_WORKERS 4
+
+struct owner {
+	struct fd_store *fds[FD_HASH_SIZE];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct req_data *queue;
+	struct req_data **queue_tail;
+	struct req_data *active;
+	int nworkers;
+	int idle;
+	int queue_len;
+	unsigned long long next_cookie;
+
+	/* statistics */
+	unsigned long long requests;
+	unsigned long long waits;
+	unsigned long long wait_usec;
+	unsigned long long max_wait_usec;
+	int max_queue_len;
 };
 
 #define MAX_SEND_FDS 2
@@ -152,38 +176,166 @@ static void send_reply(int cfd, struct message *msg)
 #endif
 }
 
-static void *process_request(void *d_)
+static struct fd_store **fd_hash(struct owner *o, int origfd)
 {
-	struct req_data *d = d_;
-	int res;
+	return &o->fds[(unsigned int) origfd % FD_HASH_SIZE];
+}
 
-	assert(d->msg.cmd == F_SETLKW);
-	res = fcntl(d->f->fd, F_SETLK, &d->msg.lock);
-	if (res == -1 && errno == EAGAIN) {
-		d->msg.error = EAGAIN;
-		d->msg.thr = pthread_self();
-		send_reply(d->cfd, &d->msg);
-		res = fcntl(d->f->fd, F_SETLKW, &d->msg.lock);
-	}
-	d->msg.error = (res == -1) ? errno : 0;
-	pthread_mutex_lock(&d->o->lock);
-	d->f->inuse--;
-	pthread_mutex_unlock(&d->o->lock);
+static unsigned long long usec_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000ULL +
+		now.tv_usec - start->tv_usec;
+}
+
+static void finish_request(struct req_data *d, int error)
+{
+	d->msg.error = error;
 	send_reply(d->cfd, &d->msg);
 	close(d->cfd);
 	free(d);
+}
+
+/*
+ * Blocking lock requests are queued by the receiving thread and served
+ * by a pool of workers.  A worker may wait for a lock indefinitely, so
+ * the pool is grown whenever no idle worker is left for a queued request,
+ * and only the number of idle workers kept around is bounded.
+ */
+static void *process_requests(void *o_)
+{
+	struct owner *o = o_;
+	struct req_data *d;
+	struct req_data **dp;
+	unsigned long long wait;
+	int res;
+
+	pthread_mutex_lock(&o->lock);
+	while (1) {
+		while (!o->queue)
+			pthread_cond_wait(&o->cond, &o->lock);
+
+		d = o->queue;
+		o->queue = d->next;
+		if (!o->queue)
+			o->queue_tail = &o->queue;
+		o->queue_len--;
+		o->idle--;
+		d->thr = pthread_self();
+		d->next = o->active;
+		o->active = d;
+		pthread_mutex_unlock(&o->lock);
+
+		res = fcntl(d->f->fd, F_SETLKW, &d->msg.lock);
+
+		pthread_mutex_lock(&o->lock);
+		for (dp = &o->active; *dp != d; dp = &(*dp)->next)
+			;
+		*dp = d->next;
+		d->f->inuse--;
+		wait = usec_since(&d->queued);
+		o->wait_usec += wait;
+		if (wait > o->max_wait_usec)
+			o->max_wait_usec = wait;
+		o->idle++;
+		pthread_mutex_unlock(&o->lock);
+
+		finish_request(d, (res == -1) ? errno : 0);
+
+		pthread_mutex_lock(&o->lock);
+		if (o->idle > MAX_IDLE_WORKERS) {
+			o->idle--;
+			o->nworkers--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&o->lock);
 
 	return NULL;
 }
 
+static void queue_request(struct owner *o, struct message *msg, int cfd,
+			  struct fd_store *f)
+{
+	struct req_data *d;
+	pthread_t tid;
+
+	d = malloc(sizeof(struct req_data));
+	if (!d) {
+		msg->error = ENOLCK;
+		send_reply(cfd, msg);
+		close(cfd);
+		return;
+	}
+
+	if (o->idle <= o->queue_len) {
+		if (pthread_create(&tid, NULL, process_requests, o) == 0) {
+			pthread_detach(tid);
+			o->nworkers++;
+			o->idle++;
+		} else {
+			free(d);
+			msg->error = ENOLCK;
+			send_reply(cfd, msg);
+			close(cfd);
+			return;
+		}
+	}
+
+	f->inuse++;
+	d->next = NULL;
+	d->o = o;
+	d->cfd = cfd;
+	d->f = f;
+	d->msg = *msg;
+	d->msg.cookie = ++o->next_cookie;
+	gettimeofday(&d->queued, NULL);
+	*o->queue_tail = d;
+	o->queue_tail = &d->next;
+	o->queue_len++;
+	if (o->queue_len > o->max_queue_len)
+		o->max_queue_len = o->queue_len;
+	o->waits++;
+	pthread_cond_signal(&o->cond);
+
+	/* Tell the client to wait, and allow it to interrupt by cookie */
+	msg->error = EAGAIN;
+	msg->cookie = d->msg.cookie;
+	send_reply(cfd, msg);
+}
+
+static void interrupt_request(struct owner *o, struct message *msg)
+{
+	struct req_data *d;
+	struct req_data **dp;
+
+	for (d = o->active; d; d = d->next) {
+		if (d->msg.cookie == msg->cookie) {
+			pthread_kill(d->thr, SIGUSR1);
+			return;
+		}
+	}
+	for (dp = &o->queue; *dp; dp = &(*dp)->next) {
+		d = *dp;
+		if (d->msg.cookie == msg->cookie) {
+			*dp = d->next;
+			if (o->queue_tail == &d->next)
+				o->queue_tail = dp;
+			o->queue_len--;
+			d->f->inuse--;
+			finish_request(d, EINTR);
+			return;
+		}
+	}
+}
+
 static void process_message(struct owner *o, struct message *msg, int cfd,
 			    int fd)
 {
 	struct fd_store *f = NULL;
-	struct fd_store *newf = NULL;
 	struct fd_store **fp;
-	struct req_data *d;
-	pthread_t tid;
 	int res;
 
 #ifdef DEBUG
@@ -192,9 +344,10 @@ static void process_message(struct owner *o, struct message *msg, int cfd,
 		msg->lock.l_start, msg->lock.l_len);
 #endif
 
+	o->requests++;
 	if (msg->cmd == F_SETLK	 && msg->lock.l_type == F_UNLCK &&
 	    msg->lock.l_start == 0 && msg->lock.l_len == 0) {
-		for (fp = &o->fds; *fp;) {
+		for (fp = fd_hash(o, msg->fd); *fp;) {
 			f = *fp;
 			if (f->origfd == msg->fd && !f->inuse) {
 				close(f->fd);
@@ -213,7 +366,7 @@ static void process_message(struct owner *o, struct message *msg, int cfd,
 	}
 
 	if (msg->nofd) {
-		for (fp = &o->fds; *fp; fp = &(*fp)->next) {
+		for (fp = fd_hash(o, msg->fd); *fp; fp = &(*fp)->next) {
 			f = *fp;
 			if (f->origfd == msg->fd)
 				break;
@@ -227,7 +380,7 @@ static void process_message(struct owner *o, struct message *msg, int cfd,
 			return;
 		}
 	} else {
-		newf = f = malloc(sizeof(struct fd_store));
+		f = malloc(sizeof(struct fd_store));
 		if (!f) {
 			msg->error = ENOLCK;
 			send_reply(cfd, msg);
@@ -238,51 +391,31 @@ static void process_message(struct owner *o, struct message *msg, int cfd,
 		f->fd = fd;
 		f->origfd = msg->fd;
 		f->inuse = 0;
+		fp = fd_hash(o, msg->fd);
+		f->next = *fp;
+		*fp = f;
 	}
 
-	if (msg->cmd == F_GETLK || msg->cmd == F_SETLK ||
-	    msg->lock.l_type == F_UNLCK) {
-		res = fcntl(f->fd, msg->cmd, &msg->lock);
-		msg->error = (res == -1) ? errno : 0;
-		send_reply(cfd, msg);
-		close(cfd);
-		if (newf) {
-			newf->next = o->fds;
-			o->fds = newf;
-		}
+	/* Try a blocking lock without blocking first */
+	res = fcntl(f->fd, msg->cmd == F_SETLKW ? F_SETLK : msg->cmd,
+		    &msg->lock);
+	if (res == -1 && errno == EAGAIN && msg->cmd == F_SETLKW) {
+		queue_request(o, msg, cfd, f);
 		return;
 	}
 
-	d = malloc(sizeof(struct req_data));
-	if (!d) {
-		msg->error = ENOLCK;
-		send_reply(cfd, msg);
-		close(cfd);
-		free(newf);
-		return;
-	}
-
-	f->inuse++;
-	d->o = o;
-	d->cfd = cfd;
-	d->f = f;
-	d->msg = *msg;
-	res = pthread_create(&tid, NULL, process_request, d);
-	if (res) {
-		msg->error = ENOLCK;
-		send_reply(cfd, msg);
-		close(cfd);
-		free(d);
-		f->inuse--;
-		free(newf);
-		return;
-	}
+	msg->error = (res == -1) ? errno : 0;
+	send_reply(cfd, msg);
+	close(cfd);
+}
 
-	if (newf) {
-		newf->next = o->fds;
-		o->fds = newf;
-	}
-	pthread_detach(tid);
+static void print_stats(struct owner *o)
+{
+	fprintf(stderr, "ulockmgr_server: %llu requests, %llu waits, "
+		"average wait %llu us, max wait %llu us, max queue %i\n",
+		o->requests, o->waits,
+		o->waits ? o->wait_usec / o->waits : 0, o->max_wait_usec,
+		o->max_queue_len);
 }
 
 static void sigusr1_handler(int sig)
@@ -295,6 +428,7 @@ static void process_owner(int cfd)
 {
 	struct owner o;
 	struct sigaction sa;
+	int i;
 
 	memset(&sa, 0, sizeof(struct sigaction));
 	sa.sa_handler = sigusr1_handler;
@@ -307,6 +441,8 @@ static void process_owner(int cfd)
 
 	memset(&o, 0, sizeof(struct owner));
 	pthread_mutex_init(&o.lock, NULL);
+	pthread_cond_init(&o.cond, NULL);
+	o.queue_tail = &o.queue;
 	while (1) {
 		struct message msg;
 		int rfds[2];
@@ -323,7 +459,9 @@ static void process_owner(int cfd)
 			if (numfds != 0)
 				fprintf(stderr,
 					"ulockmgr_server: too many fds for intr\n");
-			pthread_kill(msg.thr, SIGUSR1);
+			pthread_mutex_lock(&o.lock);
+			interrupt_request(&o, &msg);
+			pthread_mutex_unlock(&o.lock);
 		} else {
 			if (numfds != 2)
 				continue;
@@ -333,9 +471,16 @@ static void process_owner(int cfd)
 			pthread_mutex_unlock(&o.lock);
 		}
 	}
-	if (o.fds)
+	pthread_mutex_lock(&o.lock);
+	for (i = 0; i < FD_HASH_SIZE; i++)
+		if (o.fds[i])
+			break;
+	if (i < FD_HASH_SIZE)
 		fprintf(stderr,
 			"ulockmgr_server: open file descriptors on exit\n");
+	if (getenv("ULOCKMGR_STATS"))
+		print_stats(&o);
+	pthread_mutex_unlock(&o.lock);
 }
 
 int main(int argc, char *argv[])